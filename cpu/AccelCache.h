@@ -0,0 +1,177 @@
+/* ====================================================
+#   File Name     : AccelCache.h
+# ====================================================*/
+
+#ifndef _ACCEL_CACHE_H
+#define _ACCEL_CACHE_H
+
+#include "FileIO.h"
+#include "MappedFile.h"
+
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#define ACCEL_CACHE_MAGIC   0x43414652u /* "RFAC" */
+#define ACCEL_CACHE_VERSION 1u
+#define ACCEL_CACHE_ARRAYS  4
+#define ACCEL_CACHE_ALIGN   64
+
+#define FNV_OFFSET 14695981039346656037ull
+#define FNV_PRIME  1099511628211ull
+
+struct AccelCacheArray
+{
+    const void *data;
+    unsigned long long count;
+    unsigned int stride;
+};
+
+struct AccelCacheHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    char kind[8];
+    unsigned long long key;
+    unsigned int record_size;
+    unsigned int num_arrays;
+    struct
+    {
+        unsigned long long offset;
+        unsigned long long count;
+        unsigned long long stride;
+    } arrays[ACCEL_CACHE_ARRAYS];
+};
+
+/*
+ * Built acceleration structures kept on disk between runs.  A structure is
+ * filed under its kind and a key that hashes everything its build reads,
+ * so a second render of the same geometry, whatever the camera, lights or
+ * materials, maps the result back instead of building it again.  An entry
+ * is one fixed record followed by up to ACCEL_CACHE_ARRAYS flat arrays,
+ * which the caller uses straight from the mapping.  Entries are written to
+ * a temporary file of their own, flushed and renamed, so neither other
+ * jobs sharing the directory nor other threads storing the same entry see
+ * a partial one.  A mapped entry is only as trustworthy as the disk, so
+ * the caller checks every index in it before using it.  Caching is off
+ * until a directory is set.
+ */
+class AccelCache
+{
+public:
+    static void set_directory(const char *dir)
+    {
+        directory() = dir ? dir : "";
+        if (dir && mkdir(dir, 0755) != 0 && errno != EEXIST)
+            fprintf(stderr, "WARNING: cannot create accelerator cache %s: %s\n", dir, strerror(errno));
+    }
+
+    static bool enabled(void)
+    {
+        return !directory().empty();
+    }
+
+    /* FNV-1a, chained through h */
+    static unsigned long long hash(const void *data, size_t size, unsigned long long h = FNV_OFFSET)
+    {
+        const unsigned char *p = (const unsigned char *)data;
+        for (size_t i = 0; i < size; i++)
+            h = (h ^ p[i]) * FNV_PRIME;
+        return h;
+    }
+
+    /* on a hit, arrays[i] point into file, which must outlive their use */
+    static bool load(const char *kind, unsigned long long key, void *record, size_t record_size,
+            AccelCacheArray *arrays, int num_arrays, MappedFile& file)
+    {
+        if (!file.open_file(path(kind, key).c_str()))
+            return false;
+        const char *base = file.get_data();
+        size_t size = file.get_size();
+        const AccelCacheHeader& h = *(const AccelCacheHeader *)base;
+        bool ok = size >= sizeof(h) + record_size && h.magic == ACCEL_CACHE_MAGIC
+            && h.version == ACCEL_CACHE_VERSION && !strncmp(h.kind, kind, sizeof(h.kind))
+            && h.key == key && h.record_size == record_size && (int)h.num_arrays == num_arrays;
+        for (int i = 0; ok && i < num_arrays; i++)
+            ok = h.arrays[i].stride == arrays[i].stride && h.arrays[i].offset <= size
+                && h.arrays[i].count <= (size - h.arrays[i].offset) / h.arrays[i].stride;
+        if (!ok) {
+            file.close_file();
+            return false;
+        }
+        memcpy(record, base + sizeof(h), record_size);
+        for (int i = 0; i < num_arrays; i++) {
+            arrays[i].data = base + h.arrays[i].offset;
+            arrays[i].count = h.arrays[i].count;
+        }
+        return true;
+    }
+
+    /* best effort: a failed write only costs the next run a rebuild */
+    static void store(const char *kind, unsigned long long key, const void *record, size_t record_size,
+            const AccelCacheArray *arrays, int num_arrays)
+    {
+        AccelCacheHeader h;
+        memset(&h, 0, sizeof(h));
+        h.magic = ACCEL_CACHE_MAGIC;
+        h.version = ACCEL_CACHE_VERSION;
+        memcpy(h.kind, kind, std::min(strlen(kind), sizeof(h.kind)));
+        h.key = key;
+        h.record_size = record_size;
+        h.num_arrays = num_arrays;
+
+        static const char zeros[ACCEL_CACHE_ALIGN] = {};
+        struct iovec iov[2 + 2 * ACCEL_CACHE_ARRAYS];
+        int n = 0;
+        iov[n++] = { (void *)&h, sizeof(h) };
+        iov[n++] = { (void *)record, record_size };
+        unsigned long long at = sizeof(h) + record_size;
+        for (int i = 0; i < num_arrays; i++)
+        {
+            unsigned long long start = (at + ACCEL_CACHE_ALIGN - 1) / ACCEL_CACHE_ALIGN * ACCEL_CACHE_ALIGN;
+            iov[n++] = { (void *)zeros, (size_t)(start - at) };
+            iov[n++] = { (void *)arrays[i].data, (size_t)(arrays[i].count * arrays[i].stride) };
+            h.arrays[i].offset = start;
+            h.arrays[i].count = arrays[i].count;
+            h.arrays[i].stride = arrays[i].stride;
+            at = start + arrays[i].count * arrays[i].stride;
+        }
+
+        std::string file = path(kind, key);
+        std::string tmp = file + ".XXXXXX";
+        int fd = mkstemp(&tmp[0]);
+        bool ok = fd >= 0 && fchmod(fd, 0644) == 0 && write_all(fd, iov, n) && fsync(fd) == 0;
+        if (fd >= 0)
+            close(fd);
+        if (ok && rename(tmp.c_str(), file.c_str()) != 0)
+            ok = false;
+        if (!ok) {
+            fprintf(stderr, "WARNING: cannot write accelerator cache %s: %s\n", file.c_str(), strerror(errno));
+            if (fd >= 0)
+                unlink(tmp.c_str());
+        }
+    }
+
+private:
+    static std::string& directory(void)
+    {
+        static std::string dir;
+        return dir;
+    }
+
+    static std::string path(const char *kind, unsigned long long key)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "/%s-%016llx.accel", kind, key);
+        return directory() + name;
+    }
+};
+
+#endif // _ACCEL_CACHE_H
@@ -0,0 +1,193 @@
+/* ====================================================
+#   File Name     : Arena.h
+# ====================================================*/
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <new>
+#include <vector>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
+
+#include "MemoryStats.h"
+
+/*
+ * Bump-pointer allocator for objects that live exactly as long as the scene.
+ * Objects are packed back to back in large blocks and are never freed one by
+ * one; release() runs the destructors that actually need running, newest
+ * first, and hands the blocks back in one go.
+ */
+class Arena
+{
+public:
+    Arena(size_t block_size_ = 64 * 1024, MemoryCategory category_ = MEM_GEOMETRY):
+        block_size(block_size_),
+        category(category_),
+        blocks(),
+        cur(nullptr),
+        remaining(0),
+        used(0),
+        reserved(0),
+        finalizers(nullptr)
+    {}
+
+    ~Arena()
+    {
+        release();
+    }
+
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t))
+    {
+        size_t pad = (align - ((size_t)cur & (align - 1))) & (align - 1);
+        if (cur == nullptr || pad + size > remaining)
+        {
+            size_t bytes = size + align > block_size ? size + align : block_size;
+            cur = (char *)::operator new(bytes);
+            blocks.push_back(cur);
+            reserved += bytes;
+            MemoryStats::add(category, bytes);
+            remaining = bytes;
+            pad = (align - ((size_t)cur & (align - 1))) & (align - 1);
+        }
+        char *p = cur + pad;
+        cur += pad + size;
+        remaining -= pad + size;
+        used += size;
+        return p;
+    }
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        void *p = allocate(sizeof(T), alignof(T));
+        T *obj = new (p) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value)
+        {
+            Finalizer *f = new (allocate(sizeof(Finalizer), alignof(Finalizer))) Finalizer;
+            f->destroy = &destroy<T>;
+            f->obj = obj;
+            f->next = finalizers;
+            finalizers = f;
+        }
+        return obj;
+    }
+
+    void release(void)
+    {
+        for (Finalizer *f = finalizers; f; f = f->next)
+            f->destroy(f->obj);
+        finalizers = nullptr;
+        for (char *b: blocks)
+            ::operator delete(b);
+        blocks.clear();
+        MemoryStats::sub(category, reserved);
+        reserved = 0;
+        cur = nullptr;
+        remaining = 0;
+        used = 0;
+    }
+
+    size_t bytes_used(void) const
+    {
+        return used;
+    }
+
+    /* what the blocks take, padding and unused tails included */
+    size_t bytes_reserved(void) const
+    {
+        return reserved;
+    }
+
+private:
+    Arena(const Arena&);
+    Arena& operator = (const Arena&);
+
+    struct Finalizer
+    {
+        void (*destroy)(void *);
+        void *obj;
+        Finalizer *next;
+    };
+
+    template <typename T>
+    static void destroy(void *p)
+    {
+        ((T *)p)->~T();
+    }
+
+private:
+    size_t block_size;
+    MemoryCategory category;
+    std::vector<char *> blocks;
+    char *cur;
+    size_t remaining;
+    size_t used;
+    size_t reserved;
+    Finalizer *finalizers;
+};
+
+/*
+ * Per-thread scratch space for the temporaries of one camera sample: path
+ * vertices and their shading records.  Allocation bumps an offset into a
+ * small fixed buffer that stays resident in L1, and reset() between samples
+ * makes all of it available again, so the path loop never touches the heap.
+ * Only the rare sample that outgrows the buffer spills into an Arena.
+ */
+class ScratchArena
+{
+public:
+    enum { CAPACITY = 16 * 1024 };
+
+    static ScratchArena& local(void)
+    {
+        static thread_local ScratchArena scratch;
+        return scratch;
+    }
+
+    template <typename T>
+    T* alloc(size_t n = 1)
+    {
+        static_assert(std::is_trivially_destructible<T>::value,
+                "scratch memory is reset without running destructors");
+        size_t align = alignof(T);
+        size_t start = (offset + align - 1) & ~(align - 1);
+        T *p;
+        if (start + n * sizeof(T) <= CAPACITY) {
+            p = (T *)(buffer + start);
+            offset = start + n * sizeof(T);
+        }
+        else {
+            p = (T *)overflow.allocate(n * sizeof(T), align);
+            spilled = true;
+        }
+        for (size_t i = 0; i < n; i++)
+            new (p + i) T();
+        return p;
+    }
+
+    void reset(void)
+    {
+        offset = 0;
+        if (spilled) {
+            overflow.release();
+            spilled = false;
+        }
+    }
+
+private:
+    ScratchArena():
+        offset(0),
+        spilled(false),
+        overflow(CAPACITY, MEM_SCRATCH)
+    {}
+
+private:
+    alignas(64) char buffer[CAPACITY];
+    size_t offset;
+    bool spilled;
+    Arena overflow;
+};
+
+#endif // _ARENA_H
@@ -146,10 +146,12 @@ public:
     }
 
 
+    /* the lobe samples belong to this BRDF; calling again replaces them */
     void set_samples(const int num_samples = 100, const float exp = 5.0)
     {
-        sampler_ptr = new NRooks(num_samples);
-        sampler_ptr->map_samples_to_hemisphere(exp);
+        lobe_sampler = NRooks(num_samples);
+        lobe_sampler.map_samples_to_hemisphere(exp);
+        sampler_ptr = &lobe_sampler;
     }
 
     // void set_samples()
@@ -168,6 +170,7 @@ public:
 private:
 	float ks;
 	float e;
+	NRooks lobe_sampler;
 };
 
 class PerfectSpecular: public BRDF
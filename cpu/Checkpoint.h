@@ -0,0 +1,183 @@
+/* ====================================================
+#   File Name     : Checkpoint.h
+# ====================================================*/
+
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include "sampler.h"
+#include "Framebuffer.h"
+#include "AccelCache.h"
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define CHECKPOINT_MAGIC   0x4b434652u /* "RFCK" */
+#define CHECKPOINT_VERSION 3u
+
+/*
+ * Everything a progressive render needs to carry on where it stopped.  The
+ * structs are written as they are in memory, so a checkpoint is only meant
+ * to be resumed by the same build on the same kind of machine.
+ */
+struct RenderParams
+{
+    unsigned int magic;
+    unsigned int version;
+    int width, height;
+    int num_samples;       /* samples per pixel per pass */
+    int max_depth;
+    int num_passes;
+    int passes_done;
+    int rows_done;         /* of the pass after those, a multiple of TILE_SIZE */
+    float s, d, zoom;
+    float position[3];
+    float lookat[3];
+    unsigned long long rand_state;
+    unsigned long long seed;        /* as given with --seed */
+    unsigned long long scene;       /* scene_identity() of what was rendered */
+    unsigned int num_samplers;
+};
+
+struct SamplerState
+{
+    unsigned long long count;
+    long long jump;
+};
+
+/* true when a checkpoint was taken from the same camera, scene and image */
+inline bool
+same_render(const RenderParams& a, const RenderParams& b)
+{
+    return a.width == b.width && a.height == b.height
+        && a.num_samples == b.num_samples && a.max_depth == b.max_depth
+        && a.s == b.s && a.d == b.d && a.zoom == b.zoom
+        && !memcmp(a.position, b.position, sizeof(a.position))
+        && !memcmp(a.lookat, b.lookat, sizeof(a.lookat))
+        && a.seed == b.seed && a.scene == b.scene
+        && a.num_samplers == b.num_samplers;
+}
+
+/*
+ * A hash of the scene or snapshot file's contents, so a checkpoint is not
+ * resumed over an edited scene; 0 stands for the built-in one.  False with
+ * errno set if the file cannot be read.
+ */
+inline bool
+scene_identity(const char *path, unsigned long long& id)
+{
+    id = 0;
+    if (path == nullptr)
+        return true;
+    MappedFile file;
+    if (!file.open_file(path))
+        return false;
+    id = AccelCache::hash(file.get_data(), file.get_size());
+    return true;
+}
+
+inline void
+capture_samplers(std::vector<SamplerState>& states)
+{
+    const std::vector<Sampler*>& live = Sampler::live_samplers();
+    states.resize(live.size());
+    for (size_t i = 0; i < live.size(); i++)
+    {
+        unsigned long count;
+        int jump;
+        live[i]->get_state(count, jump);
+        states[i].count = count;
+        states[i].jump = jump;
+    }
+}
+
+inline void
+restore_samplers(const std::vector<SamplerState>& states)
+{
+    const std::vector<Sampler*>& live = Sampler::live_samplers();
+    for (size_t i = 0; i < live.size() && i < states.size(); i++)
+        live[i]->set_state(states[i].count, states[i].jump);
+}
+
+/*
+ * Write to <file>.tmp, fsync, then rename over <file>: a crash at any point
+ * leaves either the previous checkpoint or the new one, never a torn file.
+ */
+inline bool
+write_checkpoint(const std::string& file, const RenderParams& params,
+        const std::vector<SamplerState>& states, const Framebuffer& fb)
+{
+    std::string tmp = file + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: cannot open checkpoint: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct iovec iov[4] = {
+        { (void *)&params, sizeof(params) },
+        { (void *)states.data(), states.size() * sizeof(SamplerState) },
+        { (void *)fb.get_data(), fb.num_pixels() * 3 * sizeof(float) },
+        { (void *)fb.get_counts(), fb.num_pixels() * sizeof(unsigned int) }
+    };
+    bool ok = write_all(fd, iov, 4) && fsync(fd) == 0;
+    close(fd);
+
+    if (ok && rename(tmp.c_str(), file.c_str()) != 0)
+        ok = false;
+    if (!ok) {
+        fprintf(stderr, "ERROR: cannot write checkpoint: %s\n", strerror(errno));
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+inline bool
+read_exact(int fd, void *dst, size_t size)
+{
+    char *p = (char *)dst;
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool
+read_checkpoint(const std::string& file, RenderParams& params,
+        std::vector<SamplerState>& states, Framebuffer& fb)
+{
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    bool ok = read_exact(fd, &params, sizeof(params))
+        && params.magic == CHECKPOINT_MAGIC
+        && params.version == CHECKPOINT_VERSION;
+    if (ok)
+    {
+        states.resize(params.num_samplers);
+        fb.resize(params.width, params.height);
+        ok = read_exact(fd, states.data(), states.size() * sizeof(SamplerState))
+            && read_exact(fd, fb.get_data(), fb.num_pixels() * 3 * sizeof(float))
+            && read_exact(fd, fb.get_counts(), fb.num_pixels() * sizeof(unsigned int));
+    }
+    close(fd);
+    if (!ok)
+        fprintf(stderr, "ERROR: checkpoint %s is damaged or from another version\n", file.c_str());
+    return ok;
+}
+
+#endif // _CHECKPOINT_H
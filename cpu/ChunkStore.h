@@ -0,0 +1,234 @@
+/* ====================================================
+#   File Name     : ChunkStore.h
+# ====================================================*/
+
+#ifndef _CHUNK_STORE_H
+#define _CHUNK_STORE_H
+
+#include "object/CompactMesh.h"
+
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unistd.h>
+
+/*
+ * Pieces of streamed meshes kept in a file on disk, with no more of them
+ * in memory than a budget allows.  add() writes a piece out while the
+ * scene loads.  While rendering, get() hands out a piece that is in
+ * memory and page_in() reads a batch of missing ones in file order,
+ * dropping the least recently used pieces to make room.  Pieces are held
+ * by shared_ptr, so one a ray is still testing outlives being dropped.
+ * The file is unlinked as soon as it is made, so nothing is left behind
+ * however the process ends.
+ */
+class ChunkStore
+{
+public:
+    ChunkStore(size_t budget_):
+        fd(-1),
+        budget(budget_),
+        end(0),
+        resident_bytes(0),
+        chunks(),
+        lru(),
+        lock(),
+        warned(false)
+    {}
+
+    ~ChunkStore()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    /* a new file in dir, which errno explains on failure */
+    bool open_file(const std::string& dir)
+    {
+        std::string path = dir + "/chunks-XXXXXX";
+        std::vector<char> name(path.begin(), path.end());
+        name.push_back('\0');
+        fd = mkstemp(name.data());
+        if (fd < 0)
+            return false;
+        unlink(name.data());
+        return true;
+    }
+
+    /* written out at once; id names it from now on */
+    bool add(const CompactMesh& piece, unsigned int& id)
+    {
+        std::vector<char> buffer(piece.packed_size());
+        piece.pack(buffer.data());
+        off_t offset;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            offset = end;
+            end += buffer.size();
+            id = chunks.size();
+            chunks.emplace_back();
+            chunks.back().offset = offset;
+            chunks.back().size = buffer.size();
+        }
+        for (size_t done = 0; done < buffer.size(); )
+        {
+            ssize_t n = pwrite(fd, buffer.data() + done, buffer.size() - done, offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                fprintf(stderr, "ERROR: cannot write streamed geometry to disk: %s\n", strerror(errno));
+                return false;
+            }
+            done += n;
+        }
+        stats().chunks++;
+        stats().disk_bytes += buffer.size();
+        return true;
+    }
+
+    /* the piece if it is in memory, now the most recently used; null if not */
+    std::shared_ptr<CompactMesh> get(unsigned int id)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Chunk& c = chunks[id];
+        if (c.mesh)
+            lru.splice(lru.begin(), lru, c.where);
+        return c.mesh;
+    }
+
+    /*
+     * Every piece of ids into pieces, reading the missing ones in the
+     * order they lie in the file.  Room is made before each read, though
+     * never by dropping a piece of the same batch, so a batch larger than
+     * the budget goes over it until the next one.  A piece that cannot be
+     * read comes back null and is left out of the image.
+     */
+    void page_in(const unsigned int *ids, int n, std::shared_ptr<CompactMesh> *pieces)
+    {
+        std::vector<int> order(n);
+        for (int k = 0; k < n; k++)
+            order[k] = k;
+        std::lock_guard<std::mutex> guard(lock);
+        std::sort(order.begin(), order.end(), [&](int a, int b) {
+            return chunks[ids[a]].offset < chunks[ids[b]].offset;
+        });
+        size_t kept = 0;
+        for (int k: order)
+        {
+            Chunk& c = chunks[ids[k]];
+            if (!c.mesh)
+            {
+                while (resident_bytes + c.size > budget && lru.size() > kept)
+                    evict(lru.back());
+                c.mesh = read(c);
+                if (c.mesh) {
+                    lru.push_front(ids[k]);
+                    c.where = lru.begin();
+                    c.bytes = c.mesh->bytes();
+                    resident_bytes += c.bytes;
+                }
+            }
+            else
+                lru.splice(lru.begin(), lru, c.where);
+            if (c.mesh)
+                kept++;
+            pieces[k] = c.mesh;
+        }
+    }
+
+    /* what all the stores of the process did, if there were any */
+    static void summary(void)
+    {
+        Stats& s = stats();
+        if (s.chunks == 0)
+            return;
+        printf("Streamed geometry:      %zu chunks, %.1f MB on disk, %zu page-ins, %.1f MB read\n",
+                (size_t)s.chunks, s.disk_bytes / 1048576.0, (size_t)s.page_ins, s.read_bytes / 1048576.0);
+    }
+
+private:
+    struct Chunk
+    {
+        off_t offset;
+        size_t size;
+        size_t bytes;       /* in memory, while it is there */
+        std::shared_ptr<CompactMesh> mesh;
+        std::list<unsigned int>::iterator where;
+
+        Chunk(): offset(0), size(0), bytes(0), mesh(), where() {}
+    };
+
+    struct Stats
+    {
+        std::atomic<size_t> chunks;
+        std::atomic<size_t> disk_bytes;
+        std::atomic<size_t> page_ins;
+        std::atomic<size_t> read_bytes;
+    };
+
+    static Stats& stats(void)
+    {
+        static Stats s;
+        return s;
+    }
+
+    void evict(unsigned int id)
+    {
+        Chunk& c = chunks[id];
+        lru.erase(c.where);
+        resident_bytes -= c.bytes;
+        c.mesh.reset();
+    }
+
+    std::shared_ptr<CompactMesh> read(const Chunk& c)
+    {
+        std::vector<char> buffer(c.size);
+        for (size_t done = 0; done < c.size; )
+        {
+            ssize_t n = pread(fd, buffer.data() + done, c.size - done, c.offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                if (!warned)
+                    fprintf(stderr, "ERROR: cannot read streamed geometry back: %s\n", n < 0 ? strerror(errno) : "file too short");
+                warned = true;
+                return nullptr;
+            }
+            done += n;
+        }
+        std::shared_ptr<CompactMesh> mesh = std::make_shared<CompactMesh>();
+        if (!mesh->unpack(buffer.data(), c.size)) {
+            if (!warned)
+                fprintf(stderr, "ERROR: streamed geometry read back damaged\n");
+            warned = true;
+            return nullptr;
+        }
+        stats().page_ins++;
+        stats().read_bytes += c.size;
+        return mesh;
+    }
+
+private:
+    ChunkStore(const ChunkStore&);
+    ChunkStore& operator = (const ChunkStore&);
+
+private:
+    int fd;
+    size_t budget;
+    off_t end;
+    size_t resident_bytes;
+    std::vector<Chunk> chunks;
+    std::list<unsigned int> lru;    /* the pieces in memory, most recently used first */
+    std::mutex lock;
+    bool warned;
+};
+
+#endif // _CHUNK_STORE_H
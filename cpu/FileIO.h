@@ -0,0 +1,45 @@
+/* ====================================================
+#   File Name     : FileIO.h
+# ====================================================*/
+
+#ifndef _FILE_IO_H
+#define _FILE_IO_H
+
+#include <cerrno>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* writev() until every byte is out, resuming after short writes */
+inline bool
+write_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        int n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+        ssize_t written = writev(fd, iov, n);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (n > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++; iovcnt--; n--;
+        }
+        if (n > 0 && written > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+#endif // _FILE_IO_H
@@ -0,0 +1,197 @@
+/* ====================================================
+#   File Name     : Framebuffer.h
+# ====================================================*/
+
+#ifndef _FRAMEBUFFER_H
+#define _FRAMEBUFFER_H
+
+#include "RGBColor.h"
+#include "PostProcess.h"
+#include "FileIO.h"
+
+#include <algorithm>
+#include <vector>
+#include "MemoryStats.h"
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+enum ImageFormat
+{
+    IMAGE_PPM = 0, IMAGE_PFM = 1, IMAGE_RAW = 2
+};
+
+/* pick the output format from the file extension, PPM by default */
+inline ImageFormat
+image_format_from_name(const std::string& name)
+{
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos)
+        return IMAGE_PPM;
+    std::string ext = name.substr(dot + 1);
+    if (ext == "pfm")
+        return IMAGE_PFM;
+    if (ext == "raw" || ext == "f32")
+        return IMAGE_RAW;
+    return IMAGE_PPM;
+}
+
+/*
+ * Contiguous RGB float image, preallocated by resize() and indexed by pixel.
+ * Each pixel holds the running mean of the samples added so far together
+ * with their count, so progressive passes can accumulate into it and the
+ * mean can be written out at any time.  Rows are stored top to bottom (file
+ * order); the accessors take the camera raster row, which counts from the
+ * bottom.  Every pixel owns its own floats and count, so concurrent writers
+ * of distinct pixels never race.
+ */
+class Framebuffer
+{
+public:
+    Framebuffer():
+        width(0),
+        height(0),
+        data(),
+        counts()
+    {}
+
+    void resize(int w, int h)
+    {
+        width = w;
+        height = h;
+        data.assign((size_t)w * h * 3, 0.0f);
+        counts.assign((size_t)w * h, 0);
+    }
+
+    /* fold n new samples whose mean is `mean` into the pixel */
+    void add_samples(int r, int c, const RGBColor& mean, unsigned int n)
+    {
+        size_t i = index(r, c);
+        float *p = &data[i * 3];
+        unsigned int total = counts[i] + n;
+        float w_old = (float)counts[i] / total;
+        float w_new = (float)n / total;
+        p[0] = p[0] * w_old + mean.r * w_new;
+        p[1] = p[1] * w_old + mean.g * w_new;
+        p[2] = p[2] * w_old + mean.b * w_new;
+        counts[i] = total;
+    }
+
+    RGBColor get_pixel(int r, int c) const
+    {
+        const float *p = &data[index(r, c) * 3];
+        return RGBColor(p[0], p[1], p[2]);
+    }
+
+    unsigned int get_count(int r, int c) const
+    {
+        return counts[index(r, c)];
+    }
+
+    bool save(const std::string& filename, const PostProcess& post) const
+    {
+        return save(filename, image_format_from_name(filename), post);
+    }
+
+    /* the display transform only applies to 8-bit output */
+    bool save(const std::string& filename, ImageFormat format, const PostProcess& post) const
+    {
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "ERROR: cannot open output file: %s\n", strerror(errno));
+            return false;
+        }
+
+        bool ok;
+        switch (format)
+        {
+            case IMAGE_PFM:
+                ok = write_pfm(fd);
+                break;
+            case IMAGE_RAW:
+                ok = write_raw(fd);
+                break;
+            default:
+                ok = write_ppm(fd, post);
+                break;
+        }
+        if (!ok)
+            fprintf(stderr, "ERROR: cannot write output file: %s\n", strerror(errno));
+        close(fd);
+        return ok;
+    }
+
+    int get_width(void) const { return width; }
+    int get_height(void) const { return height; }
+    float* get_data(void) { return data.data(); }
+    const float* get_data(void) const { return data.data(); }
+    unsigned int* get_counts(void) { return counts.data(); }
+    const unsigned int* get_counts(void) const { return counts.data(); }
+    size_t num_pixels(void) const { return counts.size(); }
+
+private:
+    size_t index(int r, int c) const
+    {
+        return (size_t)(height - 1 - r) * width + c;
+    }
+
+    /* 8-bit binary PPM through the display transform */
+    bool write_ppm(int fd, const PostProcess& post) const
+    {
+        char header[64];
+        int len = snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", width, height, 255);
+
+        std::vector<unsigned char> bytes(data.size());
+        for (int y = 0; y < height; y++)
+        {
+            size_t offset = (size_t)y * width * 3;
+            post.process_row(&data[offset], &bytes[offset], width, 0, y);
+        }
+
+        struct iovec iov[2] = {
+            { header, (size_t)len },
+            { bytes.data(), bytes.size() }
+        };
+        return write_all(fd, iov, 2);
+    }
+
+    /* PFM keeps the full float range; scanlines are stored bottom to top */
+    bool write_pfm(int fd) const
+    {
+        const unsigned int one = 1;
+        bool little_endian = *(const unsigned char *)&one == 1;
+        char header[64];
+        int len = snprintf(header, sizeof(header), "PF\n%d %d\n%s\n",
+                width, height, little_endian ? "-1.0" : "1.0");
+
+        size_t row_bytes = (size_t)width * 3 * sizeof(float);
+        std::vector<struct iovec> iov(height + 1);
+        iov[0].iov_base = header;
+        iov[0].iov_len = len;
+        for (int r = 0; r < height; r++)
+        {
+            iov[r + 1].iov_base = (void *)&data[index(r, 0) * 3];
+            iov[r + 1].iov_len = row_bytes;
+        }
+        return write_all(fd, iov.data(), iov.size());
+    }
+
+    /* headerless float32 RGB, top to bottom, for compositing tools */
+    bool write_raw(int fd) const
+    {
+        struct iovec iov = { (void *)data.data(), data.size() * sizeof(float) };
+        return write_all(fd, &iov, 1);
+    }
+
+private:
+    int width, height;
+    tracked_vector<float, MEM_FRAMEBUFFER> data;
+    tracked_vector<unsigned int, MEM_FRAMEBUFFER> counts;
+};
+
+#endif // _FRAMEBUFFER_H
@@ -10,7 +10,7 @@
 
 // #include "World.h"
 #include "RGBColor.h"
-#include "Sampler.h"
+#include "sampler.h"
 #include "ShadeRec.h"
 #include "Material.h"
 #include "Utilities.h"
@@ -18,7 +18,28 @@
 #include <vector>
 #include <cfloat>
 
-bool in_shadow(const Ray&);
+/* is anything hit along the ray closer than max_t */
+bool in_shadow(const Ray&, const float max_t = FLT_MAX);
+
+enum LightKind
+{
+    LIGHT_AMBIENT = 1,
+    LIGHT_POINT,
+    LIGHT_AREA,
+    LIGHT_AMBIENT_OCCLUDER,
+    LIGHT_ENVIRONMENT
+};
+
+/* a light as it is stored in a scene snapshot, as ObjectRecord */
+struct LightRecord
+{
+    unsigned int kind;
+    unsigned int ref;      /* object of an area light */
+    unsigned int material; /* emission of an area or environment light */
+    float ls;
+    float color[3];
+    float p[3];            /* location, or the minimum of an occluder */
+};
 
 class Light
 {
@@ -40,6 +61,16 @@ public:
     {
         sampler_ptr = s_;
     }
+	/* occlusion of the ray from a shading point towards this light */
+	virtual bool shadowed(const Ray& ray, const ShadeRec&) const
+    {
+        return in_shadow(ray);
+    }
+	/* false for lights that cannot be written to a snapshot */
+	virtual bool save(LightRecord&) const
+    {
+        return false;
+    }
 
 protected:
 	Sampler *sampler_ptr;
@@ -73,6 +104,13 @@ public:
     {
         color = color_;
     }
+    virtual bool save(LightRecord& r) const
+    {
+        r.kind = LIGHT_AMBIENT;
+        r.ls = ls;
+        r.color[0] = color.r; r.color[1] = color.g; r.color[2] = color.b;
+        return true;
+    }
 
 private:
 	float ls;
@@ -104,6 +142,18 @@ public:
     {
         return color * ls;
     }
+    virtual bool shadowed(const Ray& ray, const ShadeRec& sr) const
+    {
+        return in_shadow(ray, (location - ray.o) * ray.d);
+    }
+    virtual bool save(LightRecord& r) const
+    {
+        r.kind = LIGHT_POINT;
+        r.ls = ls;
+        r.color[0] = color.r; r.color[1] = color.g; r.color[2] = color.b;
+        r.p[0] = location.x; r.p[1] = location.y; r.p[2] = location.z;
+        return true;
+    }
 
 private:
 	float ls;
@@ -121,11 +171,6 @@ public:
         object_ptr = object_ptr_;
     }
 
-    ~AreaLight()
-    {
-        delete object_ptr;
-    }
-
     virtual RGBColor L(ShadeRec& sr)
     {
         float ndotd = -light_normal * wi;
@@ -152,6 +197,11 @@ public:
     {
         return object_ptr->pdf(sr);
     }
+    /* only what lies between the point and the sample counts, not the emitter */
+    virtual bool shadowed(const Ray& ray, const ShadeRec& sr) const
+    {
+        return in_shadow(ray, (sample_point - ray.o) * ray.d - 1e-3f);
+    }
 
     void set_object(Object* object_ptr_)
     {
@@ -161,6 +211,20 @@ public:
     {
         material_ptr = material_ptr_;
     }
+    Object* get_object(void) const
+    {
+        return object_ptr;
+    }
+    Material* get_material(void) const
+    {
+        return material_ptr;
+    }
+    /* the object and material are the writer's to number */
+    virtual bool save(LightRecord& r) const
+    {
+        r.kind = LIGHT_AREA;
+        return true;
+    }
 
 private:
 	bool V(const Ray&) const;
@@ -191,12 +255,20 @@ public:
         v = w ^ Vector3D(0.0072, 1.0, 0.0034);
         v.normalize();
         u = v ^ w;
-        Ray shadow_ray(sr.hit_point, get_direction(sr));
+        Ray shadow_ray(sr.hit_point, get_direction(sr), sr.ray.footprint(sr.t), sr.ray.spread);
         if (in_shadow(shadow_ray))
             return min_amount * ls * color;
         else
             return color * ls;
     }
+    virtual bool save(LightRecord& r) const
+    {
+        r.kind = LIGHT_AMBIENT_OCCLUDER;
+        r.ls = ls;
+        r.color[0] = color.r; r.color[1] = color.g; r.color[2] = color.b;
+        r.p[0] = min_amount.r; r.p[1] = min_amount.g; r.p[2] = min_amount.b;
+        return true;
+    }
 
 private:
 	Vector3D u, v, w;
@@ -235,6 +307,15 @@ public:
     {
         return material_ptr->get_Le(sr);
     }
+    Material* get_material(void) const
+    {
+        return material_ptr;
+    }
+    virtual bool save(LightRecord& r) const
+    {
+        r.kind = LIGHT_ENVIRONMENT;
+        return true;
+    }
 
 private:
     Material* material_ptr;
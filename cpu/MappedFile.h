@@ -0,0 +1,78 @@
+/* ====================================================
+#   File Name     : MappedFile.h
+# ====================================================*/
+
+#ifndef _MAPPED_FILE_H
+#define _MAPPED_FILE_H
+
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * A whole file mapped read-only, unmapped when this goes away.  Failures
+ * leave errno set for the caller to report.
+ */
+class MappedFile
+{
+public:
+    MappedFile():
+        data(nullptr),
+        size(0)
+    {}
+
+    ~MappedFile()
+    {
+        close_file();
+    }
+
+    bool open_file(const char *path)
+    {
+        close_file();
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        data = (const char *)p;
+        size = st.st_size;
+        return true;
+    }
+
+    void close_file(void)
+    {
+        if (data)
+            munmap((void *)data, size);
+        data = nullptr;
+        size = 0;
+    }
+
+    const char* get_data(void) const
+    {
+        return data;
+    }
+
+    size_t get_size(void) const
+    {
+        return size;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator = (const MappedFile&);
+
+private:
+    const char *data;
+    size_t size;
+};
+
+#endif // _MAPPED_FILE_H
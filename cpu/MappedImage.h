@@ -0,0 +1,155 @@
+/* ====================================================
+#   File Name     : MappedImage.h
+# ====================================================*/
+
+#ifndef _MAPPED_IMAGE_H
+#define _MAPPED_IMAGE_H
+
+#include "Tile.h"
+#include "PostProcess.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Binary PPM preallocated on disk and mapped into memory.  Finished tiles
+ * go through the display transform straight into the mapping, so the
+ * renderer never holds more than the tiles in flight.  Unwritten pixels
+ * read back as black, which makes a partial render a valid image; once a
+ * band of tiles is complete it is flushed and dropped from the resident
+ * set.
+ */
+class MappedImage
+{
+public:
+    MappedImage():
+        fd(-1),
+        map(nullptr),
+        map_size(0),
+        pixels(nullptr),
+        width(0),
+        height(0),
+        post()
+    {}
+
+    ~MappedImage()
+    {
+        close_image();
+    }
+
+    bool open_image(const std::string& filename, int w, int h)
+    {
+        close_image();
+        width = w;
+        height = h;
+
+        char header[64];
+        int len = snprintf(header, sizeof(header), "P6\n%d %d\n%d\n", width, height, 255);
+        map_size = (size_t)len + (size_t)width * height * 3;
+
+        fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "ERROR: cannot open output file: %s\n", strerror(errno));
+            return false;
+        }
+        if (ftruncate(fd, map_size) != 0) {
+            fprintf(stderr, "ERROR: cannot allocate output file: %s\n", strerror(errno));
+            close_image();
+            return false;
+        }
+        void *p = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "ERROR: cannot map output file: %s\n", strerror(errno));
+            close_image();
+            return false;
+        }
+        map = (unsigned char *)p;
+        memcpy(map, header, len);
+        pixels = map + len;
+
+        int bands = (height + TILE_SIZE - 1) / TILE_SIZE;
+        band_done.assign(bands, 0);
+        return true;
+    }
+
+    void set_postprocess(const PostProcess& post_)
+    {
+        post = post_;
+    }
+
+    void write_tile(const Tile& tile)
+    {
+        for (int i = 0; i < tile.rows; i++)
+        {
+            int r = tile.r0 + i;
+            post.process_row(tile.row(i), pixel(r, tile.c0), tile.cols, tile.c0, height - 1 - r);
+        }
+
+        int band = tile.r0 / TILE_SIZE;
+        band_done[band] += tile.cols;
+        if (band_done[band] == width)
+            release_band(band);
+    }
+
+    void close_image(void)
+    {
+        if (map) {
+            msync(map, map_size, MS_SYNC);
+            munmap(map, map_size);
+        }
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+        map = nullptr;
+        pixels = nullptr;
+        map_size = 0;
+    }
+
+    bool is_open(void) const
+    {
+        return map != nullptr;
+    }
+
+private:
+    /* file rows run top to bottom, raster rows bottom to top */
+    unsigned char* pixel(int r, int c)
+    {
+        return pixels + ((size_t)(height - 1 - r) * width + c) * 3;
+    }
+
+    /* write a finished band back and let the kernel reclaim its pages */
+    void release_band(int band)
+    {
+        int r_hi = std::min(height, (band + 1) * TILE_SIZE) - 1;
+        int r_lo = band * TILE_SIZE;
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t begin = pixel(r_hi, 0) - map;
+        size_t end = pixel(r_lo, 0) - map + (size_t)width * 3;
+        size_t aligned = begin / page * page;
+        msync(map + aligned, end - aligned, MS_SYNC);
+
+        /* pages shared with a band still in progress must stay resident */
+        size_t first = (begin + page - 1) / page * page;
+        size_t last = end / page * page;
+        if (last > first)
+            madvise(map + first, last - first, MADV_DONTNEED);
+    }
+
+private:
+    int fd;
+    unsigned char *map;
+    size_t map_size;
+    unsigned char *pixels;
+    int width, height;
+    PostProcess post;
+    std::vector<int> band_done;
+};
+
+#endif // _MAPPED_IMAGE_H
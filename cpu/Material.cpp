@@ -45,12 +45,12 @@ Material::set_color(const RGBColor& c_)
 
 /* implementation of Matte */
 Matte::Matte(void):
-	ambient_brdf(new Lambertian),
-	diffuse_brdf(new Lambertian)
+	ambient_brdf(),
+	diffuse_brdf()
 {}
 Matte::Matte(const float ka_, const float kd_, const RGBColor& c_):
-	ambient_brdf(new Lambertian),
-	diffuse_brdf(new Lambertian)
+	ambient_brdf(),
+	diffuse_brdf()
 {
 	set_ka(ka_);
 	set_kd(kd_);
@@ -58,37 +58,31 @@ Matte::Matte(const float ka_, const float kd_, const RGBColor& c_):
 	set_color(c_);
 }
 
-Matte::~Matte(void)
-{
-	delete ambient_brdf;
-	delete diffuse_brdf;
-}
-
 void
 Matte::set_ka(const float ka_)
 {
-	ambient_brdf->set_kd(ka_);
+	ambient_brdf.set_kd(ka_);
 }
 
 void
 Matte::set_kd(const float kd_)
 {
-	diffuse_brdf->set_kd(kd_);
+	diffuse_brdf.set_kd(kd_);
 }
 
 void
 Matte::set_color(const RGBColor& c_)
 {
 	color = c_;
-	ambient_brdf->set_color(c_);
-	diffuse_brdf->set_color(c_);
+	ambient_brdf.set_color(c_);
+	diffuse_brdf.set_color(c_);
 }
 
 RGBColor
 Matte::area_light_shade(ShadeRec& sr) const
 {
 	Vector3D wo = -sr.ray.d;
-	RGBColor L = ambient_brdf->rho(sr, wo) * world.ambient_ptr->L(sr);
+	RGBColor L = ambient_brdf.rho(sr, wo) * world.ambient_ptr->L(sr);
 
 	for (auto light_ptr: world.light_ptrs)
 	{
@@ -97,12 +91,12 @@ Matte::area_light_shade(ShadeRec& sr) const
 
 		if (ndotwi > 0.0f)
 		{
-			Ray shadow_ray(sr.hit_point, wi);
-			bool is_in_shadow = in_shadow(shadow_ray);
+			Ray shadow_ray(sr.hit_point, wi, sr.ray.footprint(sr.t), sr.ray.spread);
+			bool is_in_shadow = light_ptr->shadowed(shadow_ray, sr);
 
 			if (!is_in_shadow)
 			{
-				L += diffuse_brdf->f(sr, wo, wi)
+				L += diffuse_brdf.f(sr, wo, wi)
 						* light_ptr->L(sr)
 						* light_ptr->G(sr)
 						* ndotwi
@@ -121,12 +115,12 @@ Matte::path_shade(ShadeRec& sr) const
 
 	float pdf;
 	Vector3D wi, wo = -sr.ray.d;
-	RGBColor f = diffuse_brdf->sample_f(sr, wo, wi, pdf);
+	RGBColor f = diffuse_brdf.sample_f(sr, wo, wi, pdf);
 	float ndotwi = sr.normal * wi;
 	float x = ndotwi / pdf;
 
 	sr.reflected_dir = wi;
-	if (isnan(x))
+	if (std::isnan(x))
 	{
 		return f;
 	}
@@ -142,13 +136,13 @@ Matte::global_shade(ShadeRec& sr) const
 		L = area_light_shade(sr);
 	float pdf;
 	Vector3D wi, wo = -sr.ray.d;
-	RGBColor f = diffuse_brdf->sample_f(sr, wo, wi, pdf);
+	RGBColor f = diffuse_brdf.sample_f(sr, wo, wi, pdf);
 	float ndotwi = sr.normal * wi;
 	float x = ndotwi / pdf;
 
 	sr.depth++;
 	sr.reflected_dir = wi;
-	if (isnan(x))
+	if (std::isnan(x))
 		return L + f;
 	else
 		return L + f * (ndotwi / pdf);
@@ -156,48 +150,48 @@ Matte::global_shade(ShadeRec& sr) const
 
 /* NOTE: Phong */
 Phong::Phong(void):
-	ambient_brdf(new Lambertian),
-	diffuse_brdf(new Lambertian),
-	specular_brdf(new GlossySpecular)
+	ambient_brdf(),
+	diffuse_brdf(),
+	specular_brdf()
 {}
 
 Phong::Phong(const float ka_, const float kd_, const float ks_, const float es_, const RGBColor& c_):
-	ambient_brdf(new Lambertian),
-	diffuse_brdf(new Lambertian),
-	specular_brdf(new GlossySpecular)
+	ambient_brdf(),
+	diffuse_brdf(),
+	specular_brdf()
 {
-	ambient_brdf->set_kd(ka_);
-	ambient_brdf->set_color(c_);
-	diffuse_brdf->set_kd(kd_);
-	diffuse_brdf->set_color(c_);
-	specular_brdf->set_ks(ks_);
-	specular_brdf->set_color(color);
-	specular_brdf->set_e(es_);
+	ambient_brdf.set_kd(ka_);
+	ambient_brdf.set_color(c_);
+	diffuse_brdf.set_kd(kd_);
+	diffuse_brdf.set_color(c_);
+	specular_brdf.set_ks(ks_);
+	specular_brdf.set_color(color);
+	specular_brdf.set_e(es_);
 }
 
 void
 Phong::set_ka(const float ka_)
-{ ambient_brdf->set_kd(ka_); }
+{ ambient_brdf.set_kd(ka_); }
 void
 Phong::set_kd(const float kd_)
-{ diffuse_brdf->set_kd(kd_); }
+{ diffuse_brdf.set_kd(kd_); }
 void
 Phong::set_ks(const float ks_)
-{ specular_brdf->set_ks(ks_); }
+{ specular_brdf.set_ks(ks_); }
 void
 Phong::set_es(const float es_)
-{ specular_brdf->set_e(es_); }
+{ specular_brdf.set_e(es_); }
 void
 Phong::set_color(const RGBColor& c_)
 {
-	ambient_brdf->set_color(c_);
-	diffuse_brdf->set_color(c_);
-	specular_brdf->set_color(c_);
+	ambient_brdf.set_color(c_);
+	diffuse_brdf.set_color(c_);
+	specular_brdf.set_color(c_);
 }
 void
 Phong::set_sampler(Sampler* s_)
 {
-	specular_brdf->set_sampler(s_);
+	specular_brdf.set_sampler(s_);
 }
 
 RGBColor
@@ -213,12 +207,12 @@ Phong::area_light_shade(ShadeRec& sr) const
 		wi.normalize();
 		float ndotwi = sr.normal * wi;
 		if (ndotwi > 0.0f) {
-			Ray shadowRay(sr.hit_point, wi);
-			bool is_in_shadow = in_shadow(shadowRay);
+			Ray shadowRay(sr.hit_point, wi, sr.ray.footprint(sr.t), sr.ray.spread);
+			bool is_in_shadow = light_ptr->shadowed(shadowRay, sr);
 
 			if (!is_in_shadow)
-				L += (diffuse_brdf->f(sr, wo, wi)
-						+ specular_brdf->f(sr, wo, wi))
+				L += (diffuse_brdf.f(sr, wo, wi)
+						+ specular_brdf.f(sr, wo, wi))
 					* light_ptr->L(sr)
 					* light_ptr->G(sr)
 					* ndotwi
@@ -236,13 +230,13 @@ Phong::path_shade(ShadeRec& sr) const
 
 	float pdf;
 	Vector3D wi, wo = -sr.ray.d;
-	RGBColor f = specular_brdf->sample_f(sr, wo, wi, pdf);
+	RGBColor f = specular_brdf.sample_f(sr, wo, wi, pdf);
 	float ndotwi = sr.normal * wi;
 	sr.reflected_dir = wi;
 	float x = ndotwi / pdf;
 
 	sr.reflected_dir = wi;
-	if (isnan(x))
+	if (std::isnan(x))
 		return f;
 	else
 	{
@@ -291,12 +285,12 @@ Emissive::get_Le(ShadeRec& sr) const
 /* NOTE: implementation of Emissive */
 Reflective::Reflective(void):
 	Phong(),
-	reflective_brdf(new PerfectSpecular)
+	reflective_brdf()
 {}
 
 Reflective::Reflective(const float ka_, const float kd_, const float ks_, const float kr_, const float es_, const RGBColor& cd_, const RGBColor& cr_):
 	Phong(),
-	reflective_brdf(new PerfectSpecular)
+	reflective_brdf()
 {
 	Phong::set_ka(ka_);
 	Phong::set_kd(kd_);
@@ -310,13 +304,13 @@ Reflective::Reflective(const float ka_, const float kd_, const float ks_, const
 void
 Reflective::set_color(const RGBColor& c_)
 {
-	reflective_brdf->set_color(c_);
+	reflective_brdf.set_color(c_);
 }
 
 void
 Reflective::set_kr(const float kr_)
 {
-	reflective_brdf->set_kr(kr_);
+	reflective_brdf.set_kr(kr_);
 }
 
 RGBColor
@@ -327,7 +321,7 @@ Reflective::area_light_shade(ShadeRec& sr) const
 	Vector3D wo = -sr.ray.d;
 	Vector3D wi;
 	float dummy_pdf;
-	RGBColor fr = reflective_brdf->sample_f(sr, wo, wi, dummy_pdf);
+	RGBColor fr = reflective_brdf.sample_f(sr, wo, wi, dummy_pdf);
 	sr.reflected_dir = wi;
 
 	sr.color += L;
@@ -344,7 +338,7 @@ Reflective::path_shade(ShadeRec& sr) const
  *     Vector3D wo = -sr.ray.d;
  *     Vector3D wi;
  *     float dummy_pdf; [> always 1 in PerfectSpecular BRDf <]
- *     RGBColor fr = reflective_brdf->sample_f(sr, wo, wi, dummy_pdf);
+ *     RGBColor fr = reflective_brdf.sample_f(sr, wo, wi, dummy_pdf);
  *     sr.reflected_dir = wi;
  * 
  *     return fr * (sr.normal * wi);
@@ -357,7 +351,7 @@ Reflective::global_shade(ShadeRec& sr) const
 	Vector3D wo = -sr.ray.d;
 	Vector3D wi;
 	float dummy_pdf; /* always 1 in PerfectSpecular BRDf */
-	RGBColor fr = reflective_brdf->sample_f(sr, wo, wi, dummy_pdf);
+	RGBColor fr = reflective_brdf.sample_f(sr, wo, wi, dummy_pdf);
 
 	sr.reflected_dir = wi;
 	sr.depth++;
@@ -367,12 +361,12 @@ Reflective::global_shade(ShadeRec& sr) const
 /* NOTE: implementation of GlossyReflective */
 GlossyReflective::GlossyReflective(void):
 	Phong(),
-	glossy_specular_brdf(new GlossySpecular)
+	glossy_specular_brdf()
 {}
 
 GlossyReflective::GlossyReflective(const float ka_, const float kd_, const float ks_, const float kr_, float es_, const RGBColor& c_):
 	Phong(),
-	glossy_specular_brdf(new GlossySpecular)
+	glossy_specular_brdf()
 {
 	Phong::set_ka(ka_);
 	Phong::set_kd(kd_);
@@ -380,35 +374,36 @@ GlossyReflective::GlossyReflective(const float ka_, const float kd_, const float
 	Phong::set_es(es_);
 	set_color(c_);
 	set_kr(kr_);
-	glossy_specular_brdf->set_samples(100, es_);
+	glossy_specular_brdf.set_e(es_);
+	glossy_specular_brdf.set_samples(100, es_);
 }
 
 void
 GlossyReflective::set_kr(const float kr_)
 {
-	glossy_specular_brdf->set_ks(kr_);
+	glossy_specular_brdf.set_ks(kr_);
 }
 
 void
 GlossyReflective::set_color(const RGBColor& c_)
 {
 	Phong::set_color(c_);
-	glossy_specular_brdf->set_color(c_);
+	glossy_specular_brdf.set_color(c_);
 }
 
 void
 GlossyReflective::set_exponent(const float e_)
 {
-	glossy_specular_brdf->set_e(e_);
+	glossy_specular_brdf.set_e(e_);
 	Phong::set_es(e_);
-	glossy_specular_brdf->set_samples(100, e_);
+	glossy_specular_brdf.set_samples(100, e_);
 }
 
 void
 GlossyReflective::set_sampler(Sampler *s_)
 {
-	glossy_specular_brdf->set_sampler(s_);
-	glossy_specular_brdf->set_samples();
+	glossy_specular_brdf.set_sampler(s_);
+	glossy_specular_brdf.set_samples();
 }
 
 RGBColor
@@ -420,7 +415,7 @@ GlossyReflective::area_light_shade(ShadeRec& sr) const
 	wo.normalize();
 	Vector3D wi;
 	float pdf;
-	RGBColor fr(glossy_specular_brdf->sample_f(sr, wo, wi, pdf));
+	RGBColor fr(glossy_specular_brdf.sample_f(sr, wo, wi, pdf));
 	sr.reflected_dir = wi;
 
 	float ndotwi = (sr.normal * wi);
@@ -435,7 +430,7 @@ GlossyReflective::path_shade(ShadeRec& sr) const
 	Vector3D wo = -sr.ray.d;
 	Vector3D wi;
 	float pdf;
-	RGBColor fr = glossy_specular_brdf->sample_f(sr, wo, wi, pdf);
+	RGBColor fr = glossy_specular_brdf.sample_f(sr, wo, wi, pdf);
 
 	sr.reflected_dir = wi;
 	return fr * (sr.normal * wi) / pdf;
@@ -448,7 +443,7 @@ GlossyReflective::global_shade(ShadeRec& sr) const
 	Vector3D wo = -sr.ray.d;
 	Vector3D wi;
 	float pdf;
-	RGBColor fr = glossy_specular_brdf->sample_f(sr, wo, wi, pdf);
+	RGBColor fr = glossy_specular_brdf.sample_f(sr, wo, wi, pdf);
 
 	sr.reflected_dir = wi;
 
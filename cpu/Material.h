@@ -13,6 +13,15 @@
 #include "ShadeRec.h"
 #include <vector>
 
+/* index into the scene's MaterialRegistry; geometry stores this, not a pointer */
+#ifdef WIDE_MATERIAL_IDS
+typedef unsigned int MaterialId;
+#define MATERIAL_ID_MAX 0xffffffffu
+#else
+typedef unsigned short MaterialId;
+#define MATERIAL_ID_MAX 0xffffu
+#endif
+
 class Material
 {
 public:
@@ -37,7 +46,6 @@ class Matte: public Material
 public:
 	Matte(void);
 	Matte(const float, const float, const RGBColor&);
-	~Matte(void);
 
 	void set_ka(const float);
 	void set_kd(const float);
@@ -47,8 +55,8 @@ public:
 	virtual RGBColor path_shade(ShadeRec&) const;
 	virtual RGBColor global_shade(ShadeRec& sr) const;
 private:
-	Lambertian *ambient_brdf;
-	Lambertian *diffuse_brdf;
+	Lambertian ambient_brdf;
+	Lambertian diffuse_brdf;
 };
 
 class Phong: public Material
@@ -67,9 +75,9 @@ public:
 	void set_sampler(Sampler*);
 
 protected:
-	Lambertian *ambient_brdf;
-	Lambertian *diffuse_brdf;
-	GlossySpecular *specular_brdf;
+	Lambertian ambient_brdf;
+	Lambertian diffuse_brdf;
+	GlossySpecular specular_brdf;
 };
 
 class Emissive: public Material
@@ -97,7 +105,7 @@ public:
 	virtual RGBColor path_shade(ShadeRec&) const;
 	virtual RGBColor global_shade(ShadeRec& sr) const;
 private:
-	PerfectSpecular *reflective_brdf;
+	PerfectSpecular reflective_brdf;
 };
 
 class GlossyReflective: public Phong
@@ -114,7 +122,7 @@ public:
 	virtual RGBColor path_shade(ShadeRec& sr) const;
 	virtual RGBColor global_shade(ShadeRec& sr) const;
 private:
-	GlossySpecular *glossy_specular_brdf;
+	GlossySpecular glossy_specular_brdf;
 };
 
 #endif
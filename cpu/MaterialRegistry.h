@@ -0,0 +1,247 @@
+/* ====================================================
+#   File Name     : MaterialRegistry.h
+# ====================================================*/
+
+#ifndef _MATERIAL_REGISTRY_H
+#define _MATERIAL_REGISTRY_H
+
+#include "Arena.h"
+#include "Material.h"
+#include "RGBColor.h"
+
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+
+enum MaterialKind
+{
+    MATERIAL_NONE = 0,
+    MATERIAL_MATTE,
+    MATERIAL_PHONG,
+    MATERIAL_EMISSIVE,
+    MATERIAL_REFLECTIVE,
+    MATERIAL_GLOSSY_REFLECTIVE,
+    MATERIAL_CUSTOM              /* added by pointer, never shared */
+};
+
+/*
+ * Every parameter a built-in material is made from, packed in one flat
+ * record.  All fields are four bytes wide so there is no padding and two
+ * keys are equal exactly when their bytes are.
+ */
+struct MaterialKey
+{
+    int kind;
+    float ka, kd, ks, kr, e, ls;
+    float cd[3];                 /* diffuse / base color */
+    float cr[3];                 /* reflective color */
+
+    MaterialKey(int kind_ = MATERIAL_NONE)
+    {
+        memset(this, 0, sizeof(*this));
+        kind = kind_;
+    }
+
+    bool operator == (const MaterialKey& k) const
+    {
+        return !memcmp(this, &k, sizeof(*this));
+    }
+};
+
+struct MaterialKeyHash
+{
+    /* FNV-1a over the raw record */
+    size_t operator () (const MaterialKey& k) const
+    {
+        const unsigned char *p = (const unsigned char *)&k;
+        unsigned long long h = 14695981039346656037ull;
+        for (size_t i = 0; i < sizeof(k); i++)
+            h = (h ^ p[i]) * 1099511628211ull;
+        return (size_t)h;
+    }
+};
+
+/*
+ * Interns the scene's materials.  Asking twice for the same parameters
+ * returns the same MaterialId, so ten thousand identical spheres share one
+ * Matte instead of carrying ten thousand copies of it.  Geometry keeps the
+ * small index; the shading code looks the material up here.  The parameter
+ * records are kept next to the instances so the table can be written out
+ * and rebuilt without knowing the material classes.  Id 0 is a black
+ * material that unassigned objects fall back to.
+ */
+class MaterialRegistry
+{
+public:
+    MaterialRegistry(void):
+        arena(16 * 1024, MEM_MATERIALS),
+        table(),
+        keys(),
+        index(),
+        requests(0)
+    {
+        insert(MaterialKey(MATERIAL_NONE), arena.make<Material>());
+    }
+
+    MaterialId matte(const float ka, const float kd, const RGBColor& c)
+    {
+        MaterialKey k(MATERIAL_MATTE);
+        k.ka = ka;
+        k.kd = kd;
+        set(k.cd, c);
+        return intern(k);
+    }
+
+    MaterialId phong(const float ka, const float kd, const float ks, const float e, const RGBColor& c)
+    {
+        MaterialKey k(MATERIAL_PHONG);
+        k.ka = ka;
+        k.kd = kd;
+        k.ks = ks;
+        k.e = e;
+        set(k.cd, c);
+        return intern(k);
+    }
+
+    MaterialId emissive(const float ls, const RGBColor& c)
+    {
+        MaterialKey k(MATERIAL_EMISSIVE);
+        k.ls = ls;
+        set(k.cd, c);
+        return intern(k);
+    }
+
+    MaterialId reflective(const float ka, const float kd, const float ks, const float kr,
+            const float e, const RGBColor& cd, const RGBColor& cr)
+    {
+        MaterialKey k(MATERIAL_REFLECTIVE);
+        k.ka = ka;
+        k.kd = kd;
+        k.ks = ks;
+        k.kr = kr;
+        k.e = e;
+        set(k.cd, cd);
+        set(k.cr, cr);
+        return intern(k);
+    }
+
+    MaterialId glossy_reflective(const float ka, const float kd, const float ks, const float kr,
+            const float e, const RGBColor& c)
+    {
+        MaterialKey k(MATERIAL_GLOSSY_REFLECTIVE);
+        k.ka = ka;
+        k.kd = kd;
+        k.ks = ks;
+        k.kr = kr;
+        k.e = e;
+        set(k.cd, c);
+        return intern(k);
+    }
+
+    MaterialId intern(const MaterialKey& k)
+    {
+        requests++;
+        auto it = index.find(k);
+        if (it != index.end())
+            return it->second;
+        MaterialId id = insert(k, build(k));
+        index.emplace(k, id);
+        return id;
+    }
+
+    /* a material that has no parameter record; it gets an id of its own */
+    MaterialId add(Material *m)
+    {
+        requests++;
+        return insert(MaterialKey(MATERIAL_CUSTOM), m);
+    }
+
+    Material* operator [] (const MaterialId id) const
+    {
+        return table[id];
+    }
+
+    const MaterialKey& key(const MaterialId id) const
+    {
+        return keys[id];
+    }
+
+    /* the id of a material handed out earlier, 0 if it is not ours */
+    MaterialId find(const Material *m) const
+    {
+        for (size_t i = 0; i < table.size(); i++)
+            if (table[i] == m)
+                return (MaterialId)i;
+        return 0;
+    }
+
+    size_t size(void) const
+    {
+        return table.size();
+    }
+
+    /* how many materials were asked for, shared or not */
+    size_t num_requests(void) const
+    {
+        return requests;
+    }
+
+private:
+    MaterialRegistry(const MaterialRegistry&);
+    MaterialRegistry& operator = (const MaterialRegistry&);
+
+    static void set(float *dst, const RGBColor& c)
+    {
+        dst[0] = c.r;
+        dst[1] = c.g;
+        dst[2] = c.b;
+    }
+
+    static RGBColor color(const float *src)
+    {
+        return RGBColor(src[0], src[1], src[2]);
+    }
+
+    MaterialId insert(const MaterialKey& k, Material *m)
+    {
+        if (table.size() > (size_t)MATERIAL_ID_MAX) {
+            fprintf(stderr, "ERROR: more than %lu materials, build with WIDE_MATERIAL_IDS\n",
+                    (unsigned long)MATERIAL_ID_MAX + 1);
+            exit(1);
+        }
+        table.push_back(m);
+        keys.push_back(k);
+        return (MaterialId)(table.size() - 1);
+    }
+
+    Material* build(const MaterialKey& k)
+    {
+        switch (k.kind)
+        {
+            case MATERIAL_MATTE:
+                return arena.make<Matte>(k.ka, k.kd, color(k.cd));
+            case MATERIAL_PHONG:
+                return arena.make<Phong>(k.ka, k.kd, k.ks, k.e, color(k.cd));
+            case MATERIAL_EMISSIVE:
+                return arena.make<Emissive>(k.ls, color(k.cd));
+            case MATERIAL_REFLECTIVE:
+                return arena.make<Reflective>(k.ka, k.kd, k.ks, k.kr, k.e, color(k.cd), color(k.cr));
+            case MATERIAL_GLOSSY_REFLECTIVE:
+                return arena.make<GlossyReflective>(k.ka, k.kd, k.ks, k.kr, k.e, color(k.cd));
+            default:
+                return arena.make<Material>();
+        }
+    }
+
+private:
+    Arena arena;
+    tracked_vector<Material *, MEM_MATERIALS> table;
+    tracked_vector<MaterialKey, MEM_MATERIALS> keys;
+    std::unordered_map<MaterialKey, MaterialId, MaterialKeyHash, std::equal_to<MaterialKey>,
+        TrackedAllocator<std::pair<const MaterialKey, MaterialId>, MEM_MATERIALS> > index;
+    size_t requests;
+};
+
+#endif // _MATERIAL_REGISTRY_H
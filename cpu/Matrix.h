@@ -0,0 +1,131 @@
+/* ====================================================
+#   File Name     : Matrix.h
+# ====================================================*/
+
+#ifndef _MATRIX_H
+#define _MATRIX_H
+
+#include "Utilities.h"
+
+#include <cmath>
+
+/*
+ * Affine transform, the top three rows of a 4x4 matrix whose last row is
+ * (0 0 0 1).  Points get the translation, vectors do not, and normals go
+ * through the transpose of the inverse.
+ */
+class Matrix
+{
+public:
+    float m[3][4];
+
+    Matrix(void)
+    {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                m[i][j] = i == j ? 1.0f : 0.0f;
+    }
+
+    Matrix(const float *rows)
+    {
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                m[i][j] = rows[i * 4 + j];
+    }
+
+    static Matrix translation(const Vector3D& t)
+    {
+        Matrix r;
+        r.m[0][3] = t.x;
+        r.m[1][3] = t.y;
+        r.m[2][3] = t.z;
+        return r;
+    }
+
+    static Matrix scaling(const float sx, const float sy, const float sz)
+    {
+        Matrix r;
+        r.m[0][0] = sx;
+        r.m[1][1] = sy;
+        r.m[2][2] = sz;
+        return r;
+    }
+
+    /* about one of the axes, 0 for x, 1 for y, 2 for z, by an angle in degrees */
+    static Matrix rotation(const int axis, const float degrees)
+    {
+        float a = degrees * (float)M_PI / 180.0f;
+        float c = cosf(a), s = sinf(a);
+        int i = (axis + 1) % 3, j = (axis + 2) % 3;
+        Matrix r;
+        r.m[i][i] = c;
+        r.m[i][j] = -s;
+        r.m[j][i] = s;
+        r.m[j][j] = c;
+        return r;
+    }
+
+    /* this applied after b */
+    Matrix operator * (const Matrix& b) const
+    {
+        Matrix r;
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 4; j++)
+                r.m[i][j] = m[i][0] * b.m[0][j] + m[i][1] * b.m[1][j] + m[i][2] * b.m[2][j];
+            r.m[i][3] += m[i][3];
+        }
+        return r;
+    }
+
+    Point3D point(const Point3D& p) const
+    {
+        return Point3D(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+                m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+                m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+    }
+
+    Vector3D vector(const Vector3D& v) const
+    {
+        return Vector3D(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    /* for the inverse of the transform the normal belongs to */
+    Normal transposed_vector(const Normal& n) const
+    {
+        return Normal(m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+                m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+                m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z);
+    }
+
+    float determinant(void) const
+    {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+            - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+            + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    /* the caller checks determinant() != 0 first */
+    Matrix inverse(void) const
+    {
+        float inv_det = 1.0f / determinant();
+        Matrix r;
+        r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+        r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+        r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+        r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+        r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+        r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+        r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+        r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+        r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+        /* the translation undone: -R^-1 t */
+        for (int i = 0; i < 3; i++)
+            r.m[i][3] = -(r.m[i][0] * m[0][3] + r.m[i][1] * m[1][3] + r.m[i][2] * m[2][3]);
+        return r;
+    }
+};
+
+#endif // _MATRIX_H
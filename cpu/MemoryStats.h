@@ -0,0 +1,173 @@
+/* ====================================================
+#   File Name     : MemoryStats.h
+# ====================================================*/
+
+#ifndef _MEMORY_STATS_H
+#define _MEMORY_STATS_H
+
+#include <new>
+#include <atomic>
+#include <vector>
+#include <cstdio>
+#include <cstddef>
+#include <cstring>
+
+enum MemoryCategory
+{
+    MEM_GEOMETRY = 0,   /* objects and lights in the scene arena */
+    MEM_MESHES,         /* vertex, index and normal arrays */
+    MEM_ACCEL,          /* grid cell tables and object lists */
+    MEM_GRID_CELLS,     /* object lists of the grid cells */
+    MEM_MATERIALS,      /* the material registry */
+    MEM_SAMPLERS,       /* sample pattern tables */
+    MEM_FRAMEBUFFER,    /* accumulated image and tiles in flight */
+    MEM_SCRATCH,        /* path scratch that outgrew its inline buffer */
+    MEM_NUM_CATEGORIES
+};
+
+/*
+ * Live and peak byte counts of the renderer's own heap use, per subsystem.
+ * Containers that want to be counted use TrackedAllocator, arenas count
+ * their blocks.  The counters are atomic so any thread may allocate; the
+ * peaks are per category, taken independently.
+ */
+class MemoryStats
+{
+public:
+    static void add(MemoryCategory c, size_t bytes)
+    {
+        Counter& k = counters()[c];
+        size_t now = k.current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        size_t peak = k.peak.load(std::memory_order_relaxed);
+        while (now > peak && !k.peak.compare_exchange_weak(peak, now, std::memory_order_relaxed))
+            ;
+    }
+
+    static void sub(MemoryCategory c, size_t bytes)
+    {
+        counters()[c].current.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    static size_t current(MemoryCategory c)
+    {
+        return counters()[c].current.load(std::memory_order_relaxed);
+    }
+
+    static size_t peak(MemoryCategory c)
+    {
+        return counters()[c].peak.load(std::memory_order_relaxed);
+    }
+
+    static size_t total(void)
+    {
+        size_t sum = 0;
+        for (int c = 0; c < MEM_NUM_CATEGORIES; c++)
+            sum += current((MemoryCategory)c);
+        return sum;
+    }
+
+    static const char* name(MemoryCategory c)
+    {
+        static const char *names[MEM_NUM_CATEGORIES] = {
+            "geometry", "meshes", "accelerators", "grid cells",
+            "materials", "sampler tables", "framebuffer", "path scratch"
+        };
+        return names[c];
+    }
+
+    /* resident set of the whole process in bytes, now and at its peak */
+    static size_t process_rss(void)
+    {
+        return read_status("VmRSS:");
+    }
+
+    static size_t process_peak_rss(void)
+    {
+        /* the kernel updates the high-water mark lazily */
+        size_t hwm = read_status("VmHWM:");
+        size_t rss = process_rss();
+        return hwm > rss ? hwm : rss;
+    }
+
+    static void summary(const char *title)
+    {
+        printf("----------- Memory: %s -----------\n", title);
+        printf("%-16s %12s %12s\n", "", "live (KB)", "peak (KB)");
+        for (int c = 0; c < MEM_NUM_CATEGORIES; c++)
+            printf("%-16s %12.1f %12.1f\n", name((MemoryCategory)c),
+                    current((MemoryCategory)c) / 1024.0, peak((MemoryCategory)c) / 1024.0);
+        printf("%-16s %12.1f\n", "tracked total", total() / 1024.0);
+        printf("%-16s %12.1f %12.1f\n", "process RSS",
+                process_rss() / 1024.0, process_peak_rss() / 1024.0);
+    }
+
+private:
+    struct Counter
+    {
+        std::atomic<size_t> current;
+        std::atomic<size_t> peak;
+    };
+
+    /* trivially destructible, so still valid while statics are torn down */
+    static Counter* counters(void)
+    {
+        static Counter table[MEM_NUM_CATEGORIES];
+        return table;
+    }
+
+    static size_t read_status(const char *field)
+    {
+        FILE *f = fopen("/proc/self/status", "r");
+        if (!f)
+            return 0;
+        char line[256];
+        size_t kb = 0;
+        size_t len = strlen(field);
+        while (fgets(line, sizeof(line), f))
+            if (!strncmp(line, field, len)) {
+                sscanf(line + len, "%zu", &kb);
+                break;
+            }
+        fclose(f);
+        return kb * 1024;
+    }
+};
+
+/* std allocator that charges what it hands out to one category */
+template <typename T, MemoryCategory C>
+struct TrackedAllocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef TrackedAllocator<U, C> other;
+    };
+
+    TrackedAllocator() {}
+    template <typename U>
+    TrackedAllocator(const TrackedAllocator<U, C>&) {}
+
+    T* allocate(size_t n)
+    {
+        MemoryStats::add(C, n * sizeof(T));
+        return (T *)::operator new(n * sizeof(T));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        MemoryStats::sub(C, n * sizeof(T));
+        ::operator delete(p);
+    }
+
+    template <typename U>
+    bool operator == (const TrackedAllocator<U, C>&) const { return true; }
+    template <typename U>
+    bool operator != (const TrackedAllocator<U, C>&) const { return false; }
+};
+
+template <typename T, MemoryCategory C>
+using tracked_vector = std::vector<T, TrackedAllocator<T, C> >;
+
+#endif // _MEMORY_STATS_H
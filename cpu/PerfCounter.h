@@ -0,0 +1,71 @@
+/* ====================================================
+#   File Name     : PerfCounter.h
+# ====================================================*/
+
+#ifndef _PERF_COUNTER_H
+#define _PERF_COUNTER_H
+
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*
+ * Last-level cache misses of the calling thread between start() and
+ * stop(), from the kernel's perf events.  Virtual machines and locked
+ * down kernels often have no hardware counters; available() is false
+ * there and the count stays 0.
+ */
+class CacheMissCounter
+{
+public:
+    CacheMissCounter():
+        fd(-1)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~CacheMissCounter()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool available(void) const
+    {
+        return fd >= 0;
+    }
+
+    void start(void)
+    {
+        if (fd < 0)
+            return;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    unsigned long long stop(void)
+    {
+        unsigned long long count = 0;
+        if (fd < 0)
+            return 0;
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd, &count, sizeof(count)) != sizeof(count))
+            return 0;
+        return count;
+    }
+
+private:
+    int fd;
+};
+
+#endif // _PERF_COUNTER_H
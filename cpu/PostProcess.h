@@ -0,0 +1,318 @@
+/* ====================================================
+#   File Name     : PostProcess.h
+# ====================================================*/
+
+#ifndef _POSTPROCESS_H
+#define _POSTPROCESS_H
+
+#include <cmath>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+enum ToneOperator
+{
+    TONE_CLAMP = 0, TONE_REINHARD = 1, TONE_ACES = 2
+};
+
+inline bool
+tone_operator_from_name(const std::string& name, ToneOperator& tone)
+{
+    if (name == "reinhard")
+        tone = TONE_REINHARD;
+    else if (name == "aces")
+        tone = TONE_ACES;
+    else if (name == "clamp")
+        tone = TONE_CLAMP;
+    else
+        return false;
+    return true;
+}
+
+#define BLUE_NOISE_SIZE 64
+
+/*
+ * 64x64 blue-noise threshold mask built once with Ulichney's void-and-cluster
+ * method.  Each entry is the rank of its pixel divided by the pixel count, so
+ * the values are uniform in [0, 1) with no low-frequency structure.  The
+ * initial pattern comes from a private generator so building the mask never
+ * disturbs the renderer's random stream.
+ */
+class BlueNoise
+{
+public:
+    static const BlueNoise& get(void)
+    {
+        static const BlueNoise instance;
+        return instance;
+    }
+
+    float operator () (int x, int y) const
+    {
+        return mask[(y & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE + (x & (BLUE_NOISE_SIZE - 1))];
+    }
+
+private:
+    enum { N = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE };
+
+    BlueNoise():
+        mask(N),
+        kernel(N),
+        energy(N),
+        pattern(N)
+    {
+        /* toroidal gaussian, sigma = 1.5 */
+        for (int y = 0; y < BLUE_NOISE_SIZE; y++)
+            for (int x = 0; x < BLUE_NOISE_SIZE; x++)
+            {
+                int dx = std::min(x, BLUE_NOISE_SIZE - x);
+                int dy = std::min(y, BLUE_NOISE_SIZE - y);
+                kernel[y * BLUE_NOISE_SIZE + x] = expf(-(dx * dx + dy * dy) / (2.0f * 1.5f * 1.5f));
+            }
+
+        /* initial pattern: about a tenth of the pixels, then relax it */
+        unsigned int state = 0x1234567u;
+        int ones = 0;
+        std::fill(energy.begin(), energy.end(), 0.0f);
+        while (ones < N / 10)
+        {
+            state = state * 1664525u + 1013904223u;
+            int i = (state >> 8) % N;
+            if (!pattern[i]) {
+                toggle(i);
+                ones++;
+            }
+        }
+        for (int iter = 0; iter < N; iter++)
+        {
+            int cluster = find(true, true);
+            toggle(cluster);
+            int v = find(false, false);
+            toggle(v);
+            if (v == cluster)
+                break;
+        }
+        std::vector<char> initial(pattern);
+        std::vector<float> initial_energy(energy);
+
+        /* phase 1: remove the tightest clusters of the initial pattern */
+        for (int rank = ones - 1; rank >= 0; rank--)
+        {
+            int i = find(true, true);
+            toggle(i);
+            mask[i] = rank;
+        }
+
+        /* phase 2: fill the largest voids up to half full */
+        pattern = initial;
+        energy = initial_energy;
+        int rank = ones;
+        for (; rank < N / 2; rank++)
+        {
+            int i = find(false, false);
+            toggle(i);
+            mask[i] = rank;
+        }
+
+        /* phase 3: the zeros are now the minority; fill their tightest clusters */
+        std::fill(energy.begin(), energy.end(), 0.0f);
+        for (int i = 0; i < N; i++)
+            if (!pattern[i])
+                splat(i, 1.0f);
+        for (; rank < N; rank++)
+        {
+            int i = find(false, true);
+            pattern[i] = 1;
+            splat(i, -1.0f);
+            mask[i] = rank;
+        }
+
+        for (int i = 0; i < N; i++)
+            mask[i] = (mask[i] + 0.5f) / N;
+    }
+
+    void splat(int i, float sign)
+    {
+        int px = i % BLUE_NOISE_SIZE, py = i / BLUE_NOISE_SIZE;
+        for (int y = 0; y < BLUE_NOISE_SIZE; y++)
+        {
+            const float *k = &kernel[((y - py) & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE];
+            float *e = &energy[y * BLUE_NOISE_SIZE];
+            for (int x = 0; x < BLUE_NOISE_SIZE; x++)
+                e[x] += sign * k[(x - px) & (BLUE_NOISE_SIZE - 1)];
+        }
+    }
+
+    void toggle(int i)
+    {
+        pattern[i] = !pattern[i];
+        splat(i, pattern[i] ? 1.0f : -1.0f);
+    }
+
+    /* highest (or lowest) energy among the pixels whose bit equals `set` */
+    int find(bool set, bool highest) const
+    {
+        int best = -1;
+        for (int i = 0; i < N; i++)
+        {
+            if ((bool)pattern[i] != set)
+                continue;
+            if (best < 0 || (highest ? energy[i] > energy[best] : energy[i] < energy[best]))
+                best = i;
+        }
+        return best;
+    }
+
+private:
+    std::vector<float> mask;
+    std::vector<float> kernel;
+    std::vector<float> energy;
+    std::vector<char> pattern;
+};
+
+/*
+ * Display transform applied once per finished tile row: exposure, a tone
+ * operator, gamma, then blue-noise dithering down to 8 bits.  Every stage is
+ * per-value, so no global statistic of the image is needed and rows can be
+ * converted as soon as they are final.  The arithmetic runs four floats at a
+ * time with SSE2, gamma included, using polynomial log2/exp2.
+ */
+class PostProcess
+{
+public:
+    PostProcess():
+        exposure(1.0f),
+        tone(TONE_REINHARD),
+        gamma(2.2f),
+        inv_gamma(1.0f / 2.2f),
+        dither(true)
+    {}
+
+    void set_exposure(const float exposure_) { exposure = exposure_; }
+    void set_tone(const ToneOperator tone_) { tone = tone_; }
+    void set_dither(const bool dither_) { dither = dither_; }
+    void set_gamma(const float gamma_)
+    {
+        gamma = gamma_;
+        inv_gamma = 1.0f / gamma_;
+    }
+
+    /*
+     * Convert n interleaved RGB pixels to bytes.  (x, y) is the image
+     * position of the first pixel and only selects the dither threshold.
+     */
+    void process_row(const float *src, unsigned char *dst, int n, int x, int y) const
+    {
+        const BlueNoise& noise = BlueNoise::get();
+        const int block = 32;
+        float tmp[block * 3];
+
+        for (int p0 = 0; p0 < n; p0 += block)
+        {
+            int count = std::min(block, n - p0) * 3;
+            map(src + p0 * 3, tmp, count);
+            for (int k = 0; k < count; k++)
+            {
+                float t = dither ? noise(x + p0 + k / 3, y) : 0.5f;
+                int q = (int)(tmp[k] + t);
+                dst[p0 * 3 + k] = (unsigned char)(q > 255 ? 255 : q);
+            }
+        }
+    }
+
+private:
+    /* exposure, tone and gamma; the result is scaled to [0, 255] */
+    void map(const float *src, float *dst, int count) const
+    {
+        int k = 0;
+#if defined(__SSE2__)
+        const __m128 vexp = _mm_set1_ps(exposure);
+        const __m128 vinv_gamma = _mm_set1_ps(inv_gamma);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 tiny = _mm_set1_ps(1e-10f);
+        const __m128 scale = _mm_set1_ps(255.0f);
+        for (; k + 4 <= count; k += 4)
+        {
+            __m128 v = _mm_mul_ps(_mm_loadu_ps(src + k), vexp);
+            v = _mm_max_ps(v, zero);
+            if (tone == TONE_REINHARD)
+                v = _mm_div_ps(v, _mm_add_ps(v, one));
+            else if (tone == TONE_ACES)
+            {
+                __m128 num = _mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f)));
+                __m128 den = _mm_add_ps(_mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+                v = _mm_div_ps(num, den);
+            }
+            v = _mm_min_ps(_mm_max_ps(v, tiny), one);
+            v = exp2_ps(_mm_mul_ps(log2_ps(v), vinv_gamma));
+            _mm_storeu_ps(dst + k, _mm_mul_ps(v, scale));
+        }
+#endif
+        for (; k < count; k++)
+        {
+            /* written so NaN fails the test and goes to the bound, as it does in _mm_max_ps */
+            float v = src[k] * exposure;
+            v = v > 0.0f ? v : 0.0f;
+            if (tone == TONE_REINHARD)
+                v = v / (1.0f + v);
+            else if (tone == TONE_ACES)
+                v = (v * (2.51f * v + 0.03f)) / (v * (2.43f * v + 0.59f) + 0.14f);
+            v = v > 1e-10f ? v : 1e-10f;
+            v = std::min(v, 1.0f);
+            dst[k] = powf(v, inv_gamma) * 255.0f;
+        }
+    }
+
+#if defined(__SSE2__)
+    /* minimax fits, relative error below 1e-5 on normal positive inputs */
+    static __m128 log2_ps(__m128 x)
+    {
+        const __m128i exp_mask = _mm_set1_epi32(0x7F800000);
+        const __m128i mant_mask = _mm_set1_epi32(0x007FFFFF);
+        const __m128 one = _mm_set1_ps(1.0f);
+        __m128i i = _mm_castps_si128(x);
+        __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(_mm_and_si128(i, exp_mask), 23), _mm_set1_epi32(127)));
+        __m128 m = _mm_or_ps(_mm_castsi128_ps(_mm_and_si128(i, mant_mask)), one);
+
+        /* log2(m) / (m - 1) on [1, 2) */
+        __m128 p = _mm_set1_ps(0.0596515482674574969533f);
+        p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-0.465725644288844778798f));
+        p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(1.48116647521213171641f));
+        p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(-2.52074962577807006663f));
+        p = _mm_add_ps(_mm_mul_ps(p, m), _mm_set1_ps(2.8882704548164776201f));
+        return _mm_add_ps(_mm_mul_ps(p, _mm_sub_ps(m, one)), e);
+    }
+
+    static __m128 exp2_ps(__m128 x)
+    {
+        x = _mm_min_ps(x, _mm_set1_ps(129.0f));
+        x = _mm_max_ps(x, _mm_set1_ps(-126.99999f));
+        __m128i ipart = _mm_cvtps_epi32(_mm_sub_ps(x, _mm_set1_ps(0.5f)));
+        __m128 f = _mm_sub_ps(x, _mm_cvtepi32_ps(ipart));
+        __m128 expi = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(ipart, _mm_set1_epi32(127)), 23));
+
+        /* 2^f on [0, 1) */
+        __m128 p = _mm_set1_ps(1.8775767e-3f);
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(8.9893397e-3f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.5826318e-2f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.4015361e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9315308e-1f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.9999994e-1f));
+        return _mm_mul_ps(expi, p);
+    }
+#endif
+
+private:
+    float exposure;
+    ToneOperator tone;
+    float gamma;
+    float inv_gamma;
+    bool dither;
+};
+
+#endif // _POSTPROCESS_H
@@ -28,17 +28,8 @@ public:
         b(_b)
     {}
 
-    RGBColor(const RGBColor& c):
-        RGBColor(c.r, c.g, c.b)
-    {}
-
-    RGBColor& operator = (const RGBColor& rhs)
-    {
-        r = rhs.r;
-        g = rhs.g;
-        b = rhs.b;
-        return (*this);
-    }
+    RGBColor(const RGBColor& c) = default;
+    RGBColor& operator = (const RGBColor& rhs) = default;
 
     RGBColor operator * (const float k) const
     {
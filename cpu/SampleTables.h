@@ -0,0 +1,189 @@
+/* ====================================================
+#   File Name     : SampleTables.h
+# ====================================================*/
+
+#ifndef _SAMPLE_TABLES_H
+#define _SAMPLE_TABLES_H
+
+#include "Utilities.h"
+
+#define SAMPLE_SETS 83
+#define SAMPLE_PI 3.141592
+
+/*
+ * Just enough math to evaluate the sample mappings inside constant
+ * expressions: a private copy of the xorshift64* generator, and series /
+ * Newton forms of sin, cos and sqrt that are exact to float precision on
+ * the ranges the mappings use.
+ */
+namespace ct
+{
+    constexpr double sin(double x)
+    {
+        const double two_pi = 2 * 3.14159265358979323846;
+        x -= (long long)(x / two_pi) * two_pi;
+        if (x > two_pi / 2)
+            x -= two_pi;
+        if (x < -two_pi / 2)
+            x += two_pi;
+        double term = x, sum = x;
+        for (int n = 1; term > 1e-17 || term < -1e-17; n++)
+        {
+            term *= -x * x / ((2 * n) * (2 * n + 1));
+            sum += term;
+        }
+        return sum;
+    }
+
+    constexpr double cos(double x)
+    {
+        return sin(x + 3.14159265358979323846 / 2);
+    }
+
+    constexpr double sqrt(double x)
+    {
+        if (x <= 0)
+            return 0;
+        /* from above, Newton decreases monotonically until it converges */
+        double r = x > 1 ? x : 1;
+        for (;;)
+        {
+            double next = 0.5 * (r + x / r);
+            if (next >= r)
+                return r;
+            r = next;
+        }
+    }
+
+    struct Rng
+    {
+        unsigned long long state;
+
+        constexpr Rng(unsigned long long seed): state(seed) {}
+
+        constexpr unsigned int next(void)
+        {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return (unsigned int)((state * 0x2545F4914F6CDD1DULL) >> 32);
+        }
+
+        constexpr float uniform(void)
+        {
+            return (float)(next() >> 8) * (1.0f / 16777216.0f);
+        }
+    };
+}
+
+/*
+ * N-Rooks sample sets together with their concentric disk mapping and
+ * their cosine (e = 1) hemisphere mapping, all computed by the compiler.
+ * Instances are constexpr, so they end up in the read-only data of the
+ * binary: nothing runs at startup, and every renderer process on a node
+ * maps the same pages.
+ */
+template <int N>
+struct NRooksTable
+{
+    enum { SIZE = N * SAMPLE_SETS };
+
+    Point2D square[SIZE];
+    Point2D disk[SIZE];
+    Point3D hemisphere[SIZE];
+
+    constexpr NRooksTable(unsigned long long seed):
+        square{},
+        disk{},
+        hemisphere{}
+    {
+        ct::Rng rng(seed);
+        for (int p = 0; p < SAMPLE_SETS; p++)
+            for (int j = 0; j < N; j++)
+            {
+                square[p * N + j].x = (j + rng.uniform()) / N;
+                square[p * N + j].y = (j + rng.uniform()) / N;
+            }
+
+        /* shuffle the columns and the rows independently within each set */
+        for (int p = 0; p < SAMPLE_SETS; p++)
+            for (int i = N - 1; i > 0; i--)
+            {
+                int t = p * N + (int)(rng.next() % (i + 1));
+                float tmp = square[p * N + i].x;
+                square[p * N + i].x = square[t].x;
+                square[t].x = tmp;
+            }
+        for (int p = 0; p < SAMPLE_SETS; p++)
+            for (int i = N - 1; i > 0; i--)
+            {
+                int t = p * N + (int)(rng.next() % (i + 1));
+                float tmp = square[p * N + i].y;
+                square[p * N + i].y = square[t].y;
+                square[t].y = tmp;
+            }
+
+        for (int k = 0; k < SIZE; k++)
+        {
+            map_disk(square[k], disk[k]);
+            map_hemisphere(square[k], hemisphere[k]);
+        }
+    }
+
+    /* Shirley-Chiu concentric mapping, as Sampler::map_samples_to_unit_disk */
+    static constexpr void map_disk(const Point2D& p, Point2D& d)
+    {
+        double x = 2 * p.x - 1, y = 2 * p.y - 1;
+        double r = 0, phi = 0;
+        if (x > -y)
+        {
+            if (x > y) {
+                r = x;
+                phi = x != 0 ? y / x : 0;
+            }
+            else {
+                r = y;
+                phi = y != 0 ? 2 - x / y : 0;
+            }
+        }
+        else
+        {
+            if (x < y) {
+                r = -x;
+                phi = x != 0 ? 4 + y / x : 0;
+            }
+            else {
+                r = y;
+                phi = y != 0 ? 6 - x / y : 0;
+            }
+        }
+        phi *= SAMPLE_PI / 4.0;
+        d.x = (float)(r * ct::cos(phi));
+        d.y = (float)(r * ct::sin(phi));
+    }
+
+    static constexpr void map_hemisphere(const Point2D& p, Point3D& h)
+    {
+        double cos_phi = ct::cos(2 * SAMPLE_PI * p.x);
+        double sin_phi = ct::sin(2 * SAMPLE_PI * p.x);
+        double cos_theta = ct::sqrt(1 - p.y);
+        double sin_theta = ct::sqrt(1 - cos_theta * cos_theta);
+        h.x = (float)(sin_theta * cos_phi);
+        h.y = (float)(sin_theta * sin_phi);
+        h.z = (float)cos_theta;
+    }
+};
+
+/* a built-in table of one size, seen through plain pointers */
+struct SampleTableView
+{
+    int num_samples;
+    const Point2D *square;
+    const Point2D *disk;
+    const Point3D *hemisphere;   /* e = 1 */
+};
+
+/* null when no table of that size is compiled in */
+const SampleTableView* find_sample_table(int num_samples);
+
+#endif // _SAMPLE_TABLES_H
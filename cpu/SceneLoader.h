@@ -0,0 +1,1235 @@
+/* ====================================================
+#   File Name     : SceneLoader.h
+# ====================================================*/
+
+#ifndef _SCENE_LOADER_H
+#define _SCENE_LOADER_H
+
+#include "World.h"
+#include "camera.h"
+#include "Light.h"
+#include "sampler.h"
+#include "TaskGraph.h"
+#include "object/Grid.h"
+#include "object/Object.h"
+#include "object/Instance.h"
+#include "object/BVH.h"
+#include "object/Accelerator.h"
+#include "object/SphereCloud.h"
+#include "object/CompactMesh.h"
+#include "object/StreamedMesh.h"
+#include "object/LodMesh.h"
+#include "MappedFile.h"
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * Scene file, a superset of gpu/scene.txt.  Sections start with a [name]
+ * line; blank lines and lines starting with '#' are ignored anywhere.
+ * Ids in [object] are 1-based and 0 means "none", as on the GPU side.
+ *
+ *  [camera]    px py pz  dx dy dz  fov_h fov_v             (GPU form, radians)
+ *              px py pz  lx ly lz  ux uy uz  d zoom [w h s] (eye, lookat, up)
+ *  [bsdf]      0 r g b                       lambertian
+ *              1 r g b                       specular reflection
+ *              2 r g b                       specular transmission (reflects)
+ *              3 ka kd r g b                 matte
+ *              4 ka kd ks e r g b            phong
+ *              5 ls r g b                    emissive
+ *              6 ka kd ks kr e r g b cr cg cb  reflective
+ *              7 ka kd ks kr e r g b         glossy reflective
+ *  [bsdf-picker] b0 b1 b2  p0 p1 p2          the most likely bsdf is used
+ *  [shape]     0 cx cy cz r                  sphere
+ *              1 cx cy cz r                  sphere seen from inside
+ *              2 px py pz ax ay az bx by bz  rectangle
+ *              3 x0 y0 z0 x1 y1 z1 x2 y2 z2  triangle
+ *              4 px py pz nx ny nz           plane
+ *  [mesh]      nv nt [accel], then nv vertices and nt index triples
+ *              (0-based); each mesh is one more shape, numbered after the
+ *              [shape] ones in file order
+ *  [spheres]   n [file], then n lines cx cy cz r, or n records of four
+ *              floats in file (raw, next to the scene file if relative);
+ *              one shape holding them all, numbered like a mesh
+ *  [accel]     world auto|linear|grid|bvh    what the scene's top level uses
+ *              mesh auto|linear|grid|bvh     and meshes that name none
+ *  [instance]  shape tx ty tz [s [rx ry rz]]  a copy of a shape sharing its
+ *                                            geometry: rotated about x, y
+ *                                            then z (degrees), scaled, moved
+ *              shape m00 m01 .. m23          or by a 3x4 affine matrix;
+ *                                            one more shape, like a mesh
+ *  [light]     0 r g b                       emission of the objects using it;
+ *                                            spheres and rectangles also light
+ *              1 ls r g b x y z              point light
+ *  [ambient]   0 ls r g b                    constant
+ *              1 ls r g b mr mg mb           occluder, mr..mb when blocked
+ *  [background] r g b
+ *  [object]    shape bsdf-picker light       (bsdf index if no pickers)
+ *
+ * [texture] and [texture-mapping] are accepted and skipped.  The loader
+ * reads the file once, front to back, parsing numbers in place.
+ */
+/*
+ * A cursor over the NUL-terminated scene text with the number parsing the
+ * loader needs.  Separate from the loader so the bodies of big sections can
+ * be parsed off the main thread, each by its own cursor.
+ */
+struct SceneText
+{
+    const char *p;
+    int line;
+
+    SceneText(const char *p_ = nullptr, int line_ = 1):
+        p(p_),
+        line(line_)
+    {}
+
+    void skip_blank(void)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+            p++;
+    }
+
+    /* blanks, newlines and comments: the layout of mesh data is free */
+    void skip_space(void)
+    {
+        for (;;)
+        {
+            skip_blank();
+            if (*p == '#')
+                while (*p && *p != '\n')
+                    p++;
+            if (*p != '\n')
+                return;
+            p++;
+            line++;
+        }
+    }
+
+    bool at_eol(void) const
+    {
+        return *p == '\n' || *p == '\0' || *p == '#';
+    }
+
+    void next_line(void)
+    {
+        while (*p && *p != '\n')
+            p++;
+        if (*p == '\n') {
+            p++;
+            line++;
+        }
+    }
+
+    /* decimal with optional fraction and exponent, no locale, no copies */
+    bool parse_number(double& out)
+    {
+        const char *s = p;
+        bool neg = false;
+        if (*s == '-' || *s == '+')
+            neg = *s++ == '-';
+
+        unsigned long long mant = 0;
+        int digits = 0, scale = 0;
+        for (; *s >= '0' && *s <= '9'; s++, digits++)
+        {
+            if (mant < 100000000000000000ull)
+                mant = mant * 10 + (*s - '0');
+            else
+                scale++;
+        }
+        if (*s == '.')
+            for (s++; *s >= '0' && *s <= '9'; s++, digits++)
+                if (mant < 100000000000000000ull) {
+                    mant = mant * 10 + (*s - '0');
+                    scale--;
+                }
+        if (digits == 0)
+            return false;
+        if (*s == 'e' || *s == 'E')
+        {
+            const char *e = s + 1;
+            bool eneg = false;
+            if (*e == '-' || *e == '+')
+                eneg = *e++ == '-';
+            int ex = 0;
+            if (*e >= '0' && *e <= '9') {
+                for (; *e >= '0' && *e <= '9'; e++)
+                    ex = ex * 10 + (*e - '0');
+                scale += eneg ? -ex : ex;
+                s = e;
+            }
+        }
+
+        static const double pow10[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        double v = (double)mant;
+        int a = scale < 0 ? -scale : scale;
+        double f = a <= 22 ? pow10[a] : pow(10.0, a);
+        v = scale < 0 ? v / f : v * f;
+        out = neg ? -v : v;
+        p = s;
+        return true;
+    }
+
+    bool number(float& f)
+    {
+        skip_blank();
+        double v;
+        if (!parse_number(v))
+            return false;
+        f = (float)v;
+        return true;
+    }
+
+    bool integer(int& i)
+    {
+        skip_blank();
+        double v;
+        if (!parse_number(v) || v != (int)v)
+            return false;
+        i = (int)v;
+        return true;
+    }
+
+    bool vec(Vector3D& v)
+    {
+        return number(v.x) && number(v.y) && number(v.z);
+    }
+
+    bool color(RGBColor& c)
+    {
+        return number(c.r) && number(c.g) && number(c.b);
+    }
+
+    /* every number left on the line, up to max */
+    int numbers(float *dst, int max)
+    {
+        int n = 0;
+        for (skip_blank(); !at_eol() && n < max; skip_blank())
+            if (!number(dst[n++]))
+                return -1;
+        return n;
+    }
+
+    /* one blank separated token on the line */
+    bool word(std::string& w)
+    {
+        skip_blank();
+        const char *s = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#')
+            p++;
+        w.assign(s, p);
+        return !w.empty();
+    }
+
+    /* steps over one blank separated token, for sections parsed later */
+    bool skip_token(void)
+    {
+        skip_space();
+        if (*p == '\0')
+            return false;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#')
+            p++;
+        return true;
+    }
+};
+
+class SceneLoader: private SceneText
+{
+public:
+    SceneLoader(World& world_, Camera& camera_, Sampler *sampler_, TaskGraph& graph_):
+        SceneText(),
+        world(world_),
+        camera(camera_),
+        sampler_ptr(sampler_),
+        graph(graph_),
+        text(),
+        filename(),
+        has_camera(false),
+        warned_transmission(false),
+        dynamic(false),
+        bvh_builder(BVH_BINNED_SAH),
+        bvh_compressed(false),
+        reorder(true),
+        compact_meshes(false),
+        lod_meshes(false),
+        stream_budget(0),
+        chunk_dir(),
+        chunk_store(nullptr),
+        world_accel(ACCEL_AUTO),
+        mesh_accel(ACCEL_AUTO),
+        forced_world_accel(ACCEL_AUTO),
+        forced_mesh_accel(ACCEL_AUTO),
+        top_kind(ACCEL_LINEAR)
+    {}
+
+    /* the top level as a BVH, which can follow the objects when they move */
+    void set_dynamic(bool dynamic_)
+    {
+        dynamic = dynamic_;
+    }
+
+    void set_bvh_builder(BVHBuilder builder)
+    {
+        bvh_builder = builder;
+    }
+
+    /* quantized BVH nodes: less memory, but every update is a full build */
+    void set_bvh_compressed(bool compressed)
+    {
+        bvh_compressed = compressed;
+    }
+
+    /* meshes in Morton order, as Mesh::reorder() has them; off keeps the file's order */
+    void set_reorder(bool reorder_)
+    {
+        reorder = reorder_;
+    }
+
+    /* meshes as CompactMesh objects: quantized, with their own tree, no accelerator choice */
+    void set_compact_meshes(bool compact)
+    {
+        compact_meshes = compact;
+    }
+
+    /* meshes with coarser levels for rays too wide to see their detail; not with compact or streamed ones */
+    void set_lod(bool lod)
+    {
+        lod_meshes = lod;
+    }
+
+    /*
+     * Meshes as StreamedMesh objects, their pieces in a file in dir with
+     * no more than budget bytes of them in memory; 0 keeps meshes in memory.
+     */
+    void set_streaming(size_t budget, const char *dir)
+    {
+        stream_budget = budget;
+        chunk_dir = dir;
+    }
+
+    /* over what the scene file asks for; ACCEL_AUTO leaves it to the file */
+    void set_accelerators(AccelKind world_kind, AccelKind mesh_kind)
+    {
+        forced_world_accel = world_kind;
+        forced_mesh_accel = mesh_kind;
+    }
+
+    bool load(const char *filename_)
+    {
+        filename = filename_;
+        if (!read_file())
+            return false;
+
+        p = text.data();
+        line = 1;
+        Section section = SEC_NONE;
+        while (*p)
+        {
+            skip_blank();
+            if (at_eol()) {
+                next_line();
+                continue;
+            }
+            if (*p == '[') {
+                section = section_from_name();
+                next_line();
+                continue;
+            }
+
+            bool ok = true;
+            switch (section)
+            {
+                case SEC_CAMERA:      ok = parse_camera(); break;
+                case SEC_BSDF:        ok = parse_bsdf(); break;
+                case SEC_PICKER:      ok = parse_picker(); break;
+                case SEC_SHAPE:       ok = parse_shape(); break;
+                case SEC_MESH:        ok = parse_mesh(); break;
+                case SEC_SPHERES:     ok = parse_spheres(); break;
+                case SEC_INSTANCE:    ok = parse_instance(); break;
+                case SEC_LIGHT:       ok = parse_light(); break;
+                case SEC_AMBIENT:     ok = parse_ambient(); break;
+                case SEC_BACKGROUND:  ok = parse_background(); break;
+                case SEC_OBJECT:      ok = parse_object(); break;
+                case SEC_ACCEL:       ok = parse_accel(); break;
+                default:              break;
+            }
+            if (!ok)
+                return false;
+            next_line();
+        }
+        return finish();
+    }
+
+    bool camera_defined(void) const
+    {
+        return has_camera;
+    }
+
+    /* what finish() picked */
+    void print_accelerators(void) const
+    {
+        size_t meshes[ACCEL_BVH + 1] = {}, compact = 0, streamed = 0, lod = 0;
+        for (const MeshJob& job: mesh_jobs)
+        {
+            if (job.streamed)
+                streamed++;
+            else if (job.compact)
+                compact++;
+            else
+                meshes[job.kind]++;
+            if (job.lod && job.lod->num_levels() > 1)
+                lod++;
+        }
+        printf("Accelerators:           %s at the top", accelerator_name(top_kind));
+        for (int k = ACCEL_LINEAR; k <= ACCEL_BVH; k++)
+            if (meshes[k])
+                printf(", %zu %s mesh%s", meshes[k], accelerator_name((AccelKind)k), meshes[k] > 1 ? "es" : "");
+        if (compact)
+            printf(", %zu compact mesh%s", compact, compact > 1 ? "es" : "");
+        if (streamed)
+            printf(", %zu streamed mesh%s", streamed, streamed > 1 ? "es" : "");
+        if (lod)
+            printf(", %zu with coarser levels", lod);
+        printf("\n");
+    }
+
+private:
+    enum Section
+    {
+        SEC_NONE, SEC_SKIP, SEC_CAMERA, SEC_BSDF, SEC_PICKER, SEC_SHAPE, SEC_MESH,
+        SEC_SPHERES, SEC_INSTANCE, SEC_LIGHT, SEC_AMBIENT, SEC_BACKGROUND, SEC_OBJECT, SEC_ACCEL
+    };
+
+    enum ShapeKind
+    {
+        SHAPE_SPHERE = 0, SHAPE_INVSPHERE = 1, SHAPE_RECT = 2, SHAPE_TRIA = 3,
+        SHAPE_PLANE = 4, SHAPE_MESH = 5, SHAPE_INSTANCE = 6, SHAPE_CLOUD = 7
+    };
+
+    struct LightEntry
+    {
+        int type;
+        RGBColor L;
+    };
+
+    /*
+     * A [mesh] section on its way through the task graph.  Its accelerator
+     * is made once the triangles are read, so the instances placed before
+     * then are given it afterwards.
+     */
+    struct MeshJob
+    {
+        Mesh *mesh;
+        AccelKind kind;
+        Compound *accel;
+        CompactMesh *compact;   /* instead of the accelerator, when meshes are compact */
+        StreamedMesh *streamed; /* or when they are streamed */
+        LodMesh *lod;           /* around the accelerator, with the coarser levels */
+        int shape;
+        int nv, nt;
+        bool reorder;
+        SceneText body;         /* where the vertices start */
+        MaterialId material;
+        std::string error;      /* set by the parse task */
+        std::vector<Object *> triangles;
+        AccelStats stats;       /* of the triangles, for ACCEL_AUTO */
+        std::vector<Instance *> instances;
+        TaskId parsed;
+        TaskId bounded;
+
+        MeshJob(): mesh(nullptr), kind(ACCEL_AUTO), accel(nullptr), compact(nullptr), streamed(nullptr), lod(nullptr), shape(0), nv(0), nt(0), reorder(true), body(),
+            material(0), error(), triangles(), stats(), instances(), parsed(-1), bounded(-1) {}
+
+        /* the mesh as one object with its own tree, if it is not triangles in an accelerator */
+        Object* whole(void) const
+        {
+            return streamed ? (Object *)streamed : compact;
+        }
+    };
+
+    /* a [spheres] section, read and built by a task of its own */
+    struct CloudJob
+    {
+        SphereCloud *cloud;
+        int n;
+        SceneText body;         /* where the spheres start, unless they are in a file */
+        std::string path;
+        std::string error;      /* set by the task */
+        TaskId built;
+
+        CloudJob(): cloud(nullptr), n(0), body(), path(), error(), built(-1) {}
+    };
+
+    /* ------------------------------------------------------------ text */
+
+    bool read_file(void)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "ERROR: cannot open scene %s: %s\n", filename.c_str(), strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        text.resize((size_t)st.st_size + 1);
+        bool ok = read_exact(fd, text.data(), st.st_size);
+        close(fd);
+        text[st.st_size] = '\0';
+        if (!ok)
+            fprintf(stderr, "ERROR: cannot read scene %s\n", filename.c_str());
+        return ok;
+    }
+
+    bool error(const char *what)
+    {
+        fprintf(stderr, "ERROR: %s:%d: %s\n", filename.c_str(), line, what);
+        return false;
+    }
+
+    Section section_from_name(void)
+    {
+        const char *end = strchr(p, ']');
+        const char *nl = strchr(p, '\n');
+        if (!end || (nl && nl < end))
+            return SEC_SKIP;
+        std::string name(p + 1, end);
+        if (name == "camera")          return SEC_CAMERA;
+        if (name == "bsdf")            return SEC_BSDF;
+        if (name == "bsdf-picker")     return SEC_PICKER;
+        if (name == "shape")           return SEC_SHAPE;
+        if (name == "mesh")            return SEC_MESH;
+        if (name == "spheres")         return SEC_SPHERES;
+        if (name == "instance")        return SEC_INSTANCE;
+        if (name == "light")           return SEC_LIGHT;
+        if (name == "ambient")         return SEC_AMBIENT;
+        if (name == "background")      return SEC_BACKGROUND;
+        if (name == "object")          return SEC_OBJECT;
+        if (name == "accel")           return SEC_ACCEL;
+        if (name != "texture" && name != "texture-mapping")
+            fprintf(stderr, "%s:%d: unknown section [%s] skipped\n", filename.c_str(), line, name.c_str());
+        return SEC_SKIP;
+    }
+
+    /* ------------------------------------------------------- sections */
+
+    bool parse_camera(void)
+    {
+        float v[16];
+        int n = numbers(v, 16);
+        int w = 400, h = 400;
+        float s = 1;
+        if (n == 8)
+        {
+            /* position, direction and field of view, y up */
+            Point3D eye(v[0], v[1], v[2]);
+            Vector3D dir(v[3], v[4], v[5]);
+            float d = 0.5f * w / tanf(0.5f * v[6]);
+            camera = Camera(eye, eye + dir, Vector3D(0, 1, 0), 1, d, 1);
+        }
+        else if (n == 11 || n == 14)
+        {
+            if (n == 14) {
+                w = (int)v[11];
+                h = (int)v[12];
+                s = v[13];
+            }
+            camera = Camera(Point3D(v[0], v[1], v[2]), Point3D(v[3], v[4], v[5]),
+                    Vector3D(v[6], v[7], v[8]), 1, v[9], v[10]);
+        }
+        else
+            return error("camera needs 8, 11 or 14 numbers");
+        camera.set_viewplane(w, h, s);
+        has_camera = true;
+        return true;
+    }
+
+    bool parse_bsdf(void)
+    {
+        int type;
+        float ka = 0, kd = 0, ks = 0, kr = 0, e = 1, ls = 1;
+        RGBColor c, cr;
+        if (!integer(type))
+            return error("bad bsdf type");
+
+        bool ok;
+        MaterialRegistry& m = world.materials;
+        MaterialId id = 0;
+        switch (type)
+        {
+            case 0:
+                ok = color(c);
+                id = m.matte(1, 1, c);
+                break;
+            case 1:
+            case 2:
+                if (type == 2 && !warned_transmission) {
+                    fprintf(stderr, "%s:%d: no transmission on the CPU, treated as reflection\n", filename.c_str(), line);
+                    warned_transmission = true;
+                }
+                ok = color(c);
+                id = m.reflective(0, 0, 0, 1, 1, BLACK, c);
+                break;
+            case 3:
+                ok = number(ka) && number(kd) && color(c);
+                id = m.matte(ka, kd, c);
+                break;
+            case 4:
+                ok = number(ka) && number(kd) && number(ks) && number(e) && color(c);
+                id = m.phong(ka, kd, ks, e, c);
+                break;
+            case 5:
+                ok = number(ls) && color(c);
+                id = m.emissive(ls, c);
+                break;
+            case 6:
+                ok = number(ka) && number(kd) && number(ks) && number(kr) && number(e) && color(c) && color(cr);
+                id = m.reflective(ka, kd, ks, kr, e, c, cr);
+                break;
+            case 7:
+                ok = number(ka) && number(kd) && number(ks) && number(kr) && number(e) && color(c);
+                id = m.glossy_reflective(ka, kd, ks, kr, e, c);
+                break;
+            default:
+                return error("unknown bsdf type");
+        }
+        if (!ok)
+            return error("bad bsdf parameters");
+        bsdfs.push_back(id);
+        return true;
+    }
+
+    bool parse_picker(void)
+    {
+        int b[3];
+        float w[3];
+        if (!(integer(b[0]) && integer(b[1]) && integer(b[2]) && number(w[0]) && number(w[1]) && number(w[2])))
+            return error("bad bsdf-picker");
+        int best = 0;
+        for (int i = 1; i < 3; i++)
+            if (w[i] > w[best])
+                best = i;
+        if (b[best] < 0 || b[best] >= (int)bsdfs.size())
+            return error("bsdf-picker refers to an unknown bsdf");
+        pickers.push_back(bsdfs[b[best]]);
+        return true;
+    }
+
+    bool parse_shape(void)
+    {
+        int type;
+        Point3D a, b, c;
+        float r;
+        Object *obj;
+        if (!integer(type))
+            return error("bad shape type");
+        switch (type)
+        {
+            case SHAPE_SPHERE:
+            case SHAPE_INVSPHERE:
+                if (!(vec(a) && number(r)))
+                    return error("bad sphere");
+                if (type == SHAPE_SPHERE)
+                    obj = world.arena.make<Sphere>(a, r, 0);
+                else
+                    obj = world.arena.make<InvertedSphere>(a, r, 0);
+                break;
+            case SHAPE_RECT:
+                if (!(vec(a) && vec(b) && vec(c)))
+                    return error("bad rectangle");
+                obj = world.arena.make<Rectangle>(a, b, c);
+                break;
+            case SHAPE_TRIA:
+                if (!(vec(a) && vec(b) && vec(c)))
+                    return error("bad triangle");
+                obj = world.arena.make<Triangle>(a, b, c);
+                break;
+            case SHAPE_PLANE:
+                if (!(vec(a) && vec(b)))
+                    return error("bad plane");
+                b.normalize();
+                obj = world.arena.make<Plane>(a, b);
+                break;
+            default:
+                return error("unknown shape type");
+        }
+        obj->set_sampler(sampler_ptr);
+        shapes.push_back(obj);
+        shape_kinds.push_back(type);
+        shape_meshes.push_back(nullptr);
+        return true;
+    }
+
+    /*
+     * Only the counts are read here; the body is stepped over and parsed
+     * by a task, so the meshes of a file load side by side while the rest
+     * of it is read.  The mesh's accelerator is made once that is done and
+     * built in a second task once its material is known; a grid gets its
+     * bounds there and its cells in a third.
+     */
+    bool parse_mesh(void)
+    {
+        int nv, nt;
+        if (!(integer(nv) && integer(nt)) || nv < 3 || nt < 1)
+            return error("mesh needs a vertex and a triangle count");
+        std::string name;
+        AccelKind kind = ACCEL_AUTO;
+        if (!at_eol() && !(word(name) && accelerator_from_name(name.c_str(), kind)))
+            return error("unknown accelerator, expected auto, linear, grid or bvh");
+
+        mesh_jobs.emplace_back();
+        MeshJob& job = mesh_jobs.back();
+        job.mesh = world.arena.make<Mesh>();
+        job.kind = kind;
+        job.shape = shapes.size();
+        job.nv = nv;
+        job.nt = nt;
+        job.reorder = reorder;
+        if (stream_budget)
+        {
+            if (!chunk_store)
+            {
+                chunk_store = world.arena.make<ChunkStore>(stream_budget);
+                if (!chunk_store->open_file(chunk_dir)) {
+                    std::string what = "cannot make a file for streamed meshes in " + chunk_dir + ": " + strerror(errno);
+                    return error(what.c_str());
+                }
+            }
+            job.streamed = world.arena.make<StreamedMesh>(chunk_store);
+            job.streamed->set_sampler(sampler_ptr);
+        }
+        else if (compact_meshes) {
+            job.compact = world.arena.make<CompactMesh>();
+            job.compact->set_sampler(sampler_ptr);
+        }
+        else if (lod_meshes) {
+            job.lod = world.arena.make<LodMesh>();
+            job.lod->set_sampler(sampler_ptr);
+        }
+        next_line();
+        job.body = SceneText(p, line);
+        for (size_t i = 0; i < (size_t)(nv + nt) * 3; i++)
+            if (!skip_token())
+                return error("mesh data ends early");
+
+        MeshJob *j = &job;
+        job.parsed = graph.add([this, j] { parse_mesh_body(*j); });
+        shapes.push_back(nullptr);
+        shape_kinds.push_back(SHAPE_MESH);
+        shape_meshes.push_back(j);
+        return true;
+    }
+
+    /* like a mesh, the spheres are read by a task, which then builds the cloud */
+    bool parse_spheres(void)
+    {
+        int n;
+        if (!integer(n) || n < 1)
+            return error("spheres needs a count");
+
+        cloud_jobs.emplace_back();
+        CloudJob& job = cloud_jobs.back();
+        job.cloud = world.arena.make<SphereCloud>();
+        job.cloud->set_sampler(sampler_ptr);
+        job.n = n;
+        job.body = SceneText(p, line);
+        if (!at_eol())
+        {
+            word(job.path);
+            size_t slash = filename.find_last_of('/');
+            if (job.path[0] != '/' && slash != std::string::npos)
+                job.path = filename.substr(0, slash + 1) + job.path;
+        }
+        else
+        {
+            next_line();
+            job.body = SceneText(p, line);
+            for (size_t i = 0; i < (size_t)n * 4; i++)
+                if (!skip_token())
+                    return error("sphere data ends early");
+        }
+
+        CloudJob *j = &job;
+        job.built = graph.add([j] {
+            if (read_spheres(*j))
+                j->cloud->build();
+        });
+        shapes.push_back(job.cloud);
+        shape_kinds.push_back(SHAPE_CLOUD);
+        shape_meshes.push_back(nullptr);
+        return true;
+    }
+
+    static bool read_spheres(CloudJob& job)
+    {
+        SphereCloud *cloud = job.cloud;
+        cloud->resize(job.n);
+        if (!job.path.empty())
+        {
+            MappedFile file;
+            if (!file.open_file(job.path.c_str())) {
+                job.error = "cannot open " + job.path + ": " + strerror(errno);
+                return false;
+            }
+            if (file.get_size() != (size_t)job.n * 4 * sizeof(float)) {
+                job.error = job.path + " does not hold " + std::to_string(job.n) + " spheres";
+                return false;
+            }
+            const char *data = file.get_data();
+            for (int i = 0; i < job.n; i++)
+            {
+                float v[4];
+                memcpy(v, data + (size_t)i * sizeof(v), sizeof(v));
+                cloud->set_sphere(i, Point3D(v[0], v[1], v[2]), v[3]);
+            }
+            return true;
+        }
+
+        SceneText& t = job.body;
+        for (int i = 0; i < job.n; i++)
+        {
+            float v[4];
+            for (int k = 0; k < 4; k++)
+                if (t.skip_space(), !t.number(v[k])) {
+                    job.error = "bad sphere";
+                    return false;
+                }
+            cloud->set_sphere(i, Point3D(v[0], v[1], v[2]), v[3]);
+        }
+        return true;
+    }
+
+    bool parse_instance(void)
+    {
+        int s;
+        float v[12];
+        if (!integer(s))
+            return error("instance needs a shape id");
+        if (s < 1 || s > (int)shapes.size())
+            return error("instance refers to an unknown shape");
+        if (shape_kinds[s - 1] == SHAPE_PLANE)
+            return error("a plane cannot be instanced");
+
+        int n = numbers(v, 12);
+        Matrix transform;
+        if (n == 12)
+            transform = Matrix(v);
+        else if (n == 3 || n == 4 || n == 7)
+        {
+            if (n >= 4)
+                transform = Matrix::scaling(v[3], v[3], v[3]);
+            if (n == 7)
+                transform = Matrix::scaling(v[3], v[3], v[3]) * Matrix::rotation(2, v[6])
+                    * Matrix::rotation(1, v[5]) * Matrix::rotation(0, v[4]);
+            transform = Matrix::translation(Vector3D(v[0], v[1], v[2])) * transform;
+        }
+        else
+            return error("instance needs a translation [scale [rotation]] or a 3x4 matrix");
+        if (transform.determinant() == 0.0f)
+            return error("instance transform cannot be inverted");
+
+        Instance *inst = world.arena.make<Instance>(shapes[s - 1], transform);
+        inst->set_sampler(sampler_ptr);
+        if (shape_meshes[s - 1])
+            shape_meshes[s - 1]->instances.push_back(inst);
+        shapes.push_back(inst);
+        shape_kinds.push_back(SHAPE_INSTANCE);
+        shape_meshes.push_back(nullptr);
+        return true;
+    }
+
+    static void parse_mesh_body(MeshJob& job)
+    {
+        SceneText& t = job.body;
+        Mesh *mesh = job.mesh;
+        int nv = job.nv, nt = job.nt;
+        mesh->vertices.resize(nv);
+        mesh->indices.resize((size_t)nt * 3);
+        for (int i = 0; i < nv; i++)
+        {
+            t.skip_space();
+            Point3D& v = mesh->vertices[i];
+            if (!t.number(v.x) || (t.skip_space(), !t.number(v.y)) || (t.skip_space(), !t.number(v.z))) {
+                job.error = "bad mesh vertex";
+                return;
+            }
+        }
+        for (size_t i = 0; i < (size_t)nt * 3; i++)
+        {
+            t.skip_space();
+            int k;
+            if (!t.integer(k) || k < 0 || k >= nv) {
+                job.error = "bad mesh index";
+                return;
+            }
+            mesh->indices[i] = k;
+        }
+        mesh->points = mesh->vertices.data();
+        mesh->faces = mesh->indices.data();
+        if (job.whole())
+        {
+            /* it keeps its own copy of the data; a streamed mesh keeps it on disk */
+            CompactMesh whole;
+            CompactMesh *compact = job.compact ? job.compact : &whole;
+            compact->build(mesh->points, nv, mesh->indices.data(), nt);
+            tracked_vector<Point3D, MEM_MESHES>().swap(mesh->vertices);
+            tracked_vector<int, MEM_MESHES>().swap(mesh->indices);
+            mesh->points = nullptr;
+            mesh->faces = nullptr;
+            if (job.streamed && !job.streamed->build(whole))
+                job.error = "cannot write the mesh to disk";
+            return;
+        }
+        if (job.reorder)
+            mesh->reorder();
+        mesh->num_vertices = nv;
+        mesh->num_triangles = nt;
+        mesh->num_indices = nt * 3;
+
+        job.triangles.resize(nt);
+        for (int i = 0; i < nt; i++)
+            job.triangles[i] = mesh->triangles.make<MeshTriangle>(mesh, i);
+        if (job.lod)
+            job.lod->simplify(mesh->points, nv, mesh->indices.data(), nt);
+        if (job.kind == ACCEL_AUTO)
+        {
+            std::vector<BBox> boxes(nt);
+            for (int i = 0; i < nt; i++)
+                boxes[i] = job.triangles[i]->get_bounding_box();
+            job.stats = accelerator_stats(boxes);
+        }
+    }
+
+    bool parse_accel(void)
+    {
+        std::string what, name;
+        AccelKind kind;
+        if (!(word(what) && word(name)) || (what != "world" && what != "mesh"))
+            return error("accel needs world or mesh and a kind");
+        if (!accelerator_from_name(name.c_str(), kind))
+            return error("unknown accelerator, expected auto, linear, grid or bvh");
+        (what == "world" ? world_accel : mesh_accel) = kind;
+        return true;
+    }
+
+    bool parse_light(void)
+    {
+        int type;
+        LightEntry l;
+        if (!integer(type))
+            return error("bad light type");
+        l.type = type;
+        if (type == 0)
+        {
+            if (!color(l.L))
+                return error("bad emission");
+        }
+        else if (type == 1)
+        {
+            float ls;
+            Point3D at;
+            if (!(number(ls) && color(l.L) && vec(at)))
+                return error("bad point light");
+            world.add_light(world.arena.make<PointLight>(ls, l.L, at));
+        }
+        else
+            return error("unknown light type");
+        lights.push_back(l);
+        return true;
+    }
+
+    bool parse_ambient(void)
+    {
+        int type;
+        float ls;
+        RGBColor c, min_amount;
+        if (!(integer(type) && number(ls) && color(c)))
+            return error("bad ambient light");
+        if (type == 0)
+            world.ambient_ptr = world.arena.make<Ambient>(ls, c);
+        else if (type == 1)
+        {
+            if (!color(min_amount))
+                return error("bad ambient occluder");
+            AmbientOccluder *occluder = world.arena.make<AmbientOccluder>(ls, c, min_amount);
+            occluder->set_sampler(sampler_ptr);
+            world.ambient_ptr = occluder;
+        }
+        else
+            return error("unknown ambient type");
+        return true;
+    }
+
+    bool parse_background(void)
+    {
+        if (!color(world.background_color))
+            return error("bad background color");
+        return true;
+    }
+
+    bool parse_object(void)
+    {
+        int s, m, l;
+        if (!(integer(s) && integer(m) && integer(l)))
+            return error("object needs shape, bsdf and light ids");
+        if (s < 1 || s > (int)shapes.size())
+            return error("object refers to an unknown shape");
+
+        const std::vector<MaterialId>& materials = pickers.empty() ? bsdfs : pickers;
+        Object *obj = shapes[s - 1];    /* null for a mesh, which is never a light */
+        if (l > 0)
+        {
+            if (l > (int)lights.size() || lights[l - 1].type != 0)
+                return error("object refers to an unknown emission");
+            MaterialId ems = world.materials.emissive(1, lights[l - 1].L);
+            set_material(s - 1, ems);
+            int kind = shape_kinds[s - 1];
+            if (kind == SHAPE_RECT || kind == SHAPE_SPHERE || kind == SHAPE_INVSPHERE)
+            {
+                AreaLight *light = world.arena.make<AreaLight>();
+                light->set_object(obj);
+                light->set_material(world.materials[ems]);
+                world.add_light(light);
+            }
+        }
+        else if (m > 0)
+        {
+            if (m > (int)materials.size())
+                return error("object refers to an unknown bsdf");
+            set_material(s - 1, materials[m - 1]);
+        }
+
+        if (shape_kinds[s - 1] == SHAPE_PLANE)
+            world.add_object(obj);
+        else
+            bounded.push_back(s - 1);
+        return true;
+    }
+
+    /*
+     * A mesh's triangles may not exist yet; they get it with their bounds.
+     * An instance keeps its own, leaving the shape it shares untouched.
+     */
+    void set_material(int shape, MaterialId id)
+    {
+        if (shape_meshes[shape])
+            shape_meshes[shape]->material = id;
+        else if (shape_kinds[shape] == SHAPE_INSTANCE)
+            ((Instance *)shapes[shape])->set_instance_material(id);
+        else
+            shapes[shape]->set_material(id);
+    }
+
+    /* the command line first, then the mesh's own, then the file's default, then the triangles */
+    AccelKind mesh_accelerator(const MeshJob& job) const
+    {
+        if (forced_mesh_accel != ACCEL_AUTO)
+            return forced_mesh_accel;
+        if (job.kind != ACCEL_AUTO)
+            return job.kind;
+        if (mesh_accel != ACCEL_AUTO)
+            return mesh_accel;
+        return choose_accelerator(job.stats);
+    }
+
+    /* whatever its kind; a grid or BVH in a mesh only gets its bounds, the rest comes later */
+    void build_accelerator(Compound *accel, AccelKind kind, bool nested)
+    {
+        if (kind == ACCEL_BVH) {
+            ((BVH *)accel)->set_builder(bvh_builder, &graph.get_pool());
+            ((BVH *)accel)->set_compressed(bvh_compressed);
+        }
+        if (kind == ACCEL_GRID && nested)
+            ((Grid *)accel)->defer_cells();
+        else if (kind == ACCEL_BVH && nested)
+            ((BVH *)accel)->defer_build();
+        else
+            accel->build();
+    }
+
+    /* what build_accelerator() left to the first ray, built now */
+    static void complete_accelerator(Compound *accel, AccelKind kind)
+    {
+        if (kind == ACCEL_GRID)
+            ((Grid *)accel)->ensure_cells();
+        else if (kind == ACCEL_BVH)
+            ((BVH *)accel)->ensure_built();
+    }
+
+    /*
+     * Every mesh gets its accelerator once its triangles are read, and its
+     * instances are pointed at it.  The bounded objects then go into the
+     * top level, by default a grid or BVH as their boxes suggest, always a
+     * BVH in a dynamic scene; it is built by a task that waits for the
+     * bounds of every mesh.  Neither the choice nor load() waits for the
+     * meshes' own grid cells and BVH trees: they are built by tasks of
+     * their own, the biggest mesh first, while the render starts.  A ray
+     * that reaches one still being built waits for it, and one that
+     * reaches a mesh no task has got to yet builds it itself.
+     */
+    bool finish(void)
+    {
+        if (bounded.empty() && world.obj_ptrs.empty())
+            return error("no object defined");
+
+        for (CloudJob& job: cloud_jobs)
+        {
+            graph.wait(job.built);
+            if (!job.error.empty()) {
+                line = job.body.line;
+                return error(job.error.c_str());
+            }
+        }
+
+        for (MeshJob& job: mesh_jobs)
+        {
+            graph.wait(job.parsed);
+            if (!job.error.empty()) {
+                line = job.body.line;
+                return error(job.error.c_str());
+            }
+            if (job.whole())
+            {
+                shapes[job.shape] = job.whole();
+                for (Instance *inst: job.instances)
+                    inst->set_object(job.whole());
+                continue;
+            }
+            job.kind = mesh_accelerator(job);
+            job.accel = make_accelerator(job.kind, world.arena);
+            for (Object *triangle: job.triangles)
+                job.accel->add_object(triangle);
+            std::vector<Object *>().swap(job.triangles);
+            Object *shape = job.accel;
+            if (job.lod) {
+                job.lod->set_full(job.accel);
+                shape = job.lod;
+            }
+            shapes[job.shape] = shape;
+            for (Instance *inst: job.instances)
+                inst->set_object(shape);
+        }
+
+        std::vector<TaskId> bounds;
+        for (MeshJob& job: mesh_jobs)
+        {
+            MeshJob *j = &job;
+            job.bounded = graph.add([this, j] {
+                if (j->whole()) {
+                    j->whole()->set_material(j->material);
+                    return;
+                }
+                j->accel->set_material(j->material);
+                if (j->lod)
+                    j->lod->set_material(j->material);
+                build_accelerator(j->accel, j->kind, true);
+            });
+            bounds.push_back(job.bounded);
+        }
+
+        std::vector<Object *> objects;
+        for (int s: bounded)
+            objects.push_back(shapes[s]);
+        AccelKind kind = forced_world_accel != ACCEL_AUTO ? forced_world_accel : world_accel;
+        if (dynamic)
+        {
+            if (kind != ACCEL_AUTO && kind != ACCEL_BVH)
+                fprintf(stderr, "%s: a scene that moves needs a BVH at the top, not a %s\n",
+                        filename.c_str(), accelerator_name(kind));
+            kind = ACCEL_BVH;
+        }
+        if (kind == ACCEL_AUTO)
+        {
+            /* the choice goes by the boxes of the meshes too */
+            for (TaskId b: bounds)
+                graph.wait(b);
+            kind = choose_accelerator(objects);
+        }
+        if (objects.empty())
+            kind = ACCEL_LINEAR;
+        top_kind = kind;
+        Compound *top_accel = kind == ACCEL_LINEAR ? nullptr : make_accelerator(kind, world.arena);
+
+        /* linear at the top is the world's own list */
+        TaskId top = graph.add([this, top_accel, kind, objects] {
+            if (top_accel == nullptr) {
+                for (Object *obj: objects)
+                    world.add_object(obj);
+                return;
+            }
+            for (Object *obj: objects)
+                top_accel->add_object(obj);
+            build_accelerator(top_accel, kind, false);
+            world.add_object(top_accel);
+        }, bounds);
+
+        graph.wait(top);
+
+        std::vector<const MeshJob *> deferred;
+        for (const MeshJob& job: mesh_jobs)
+            if (job.accel && (job.kind == ACCEL_GRID || job.kind == ACCEL_BVH))
+                deferred.push_back(&job);
+        std::stable_sort(deferred.begin(), deferred.end(),
+                [](const MeshJob *a, const MeshJob *b) { return a->nt > b->nt; });
+        for (const MeshJob *j: deferred)
+        {
+            /* the loader is gone by the time these run */
+            Compound *accel = j->accel;
+            AccelKind kind = j->kind;
+            graph.add([accel, kind] { complete_accelerator(accel, kind); });
+        }
+
+        if (world.ambient_ptr == nullptr)
+            world.ambient_ptr = world.arena.make<Ambient>(0, BLACK);
+        return true;
+    }
+
+private:
+    World& world;
+    Camera& camera;
+    Sampler *sampler_ptr;
+    TaskGraph& graph;
+
+    std::vector<char> text;
+    std::string filename;
+    bool has_camera;
+    bool warned_transmission;
+    bool dynamic;
+    BVHBuilder bvh_builder;
+    bool bvh_compressed;
+    bool reorder;
+    bool compact_meshes;
+    bool lod_meshes;
+    size_t stream_budget;
+    std::string chunk_dir;
+    ChunkStore *chunk_store;            /* every streamed mesh's pieces, made with the first */
+    AccelKind world_accel;              /* as the scene file has them */
+    AccelKind mesh_accel;
+    AccelKind forced_world_accel;       /* as the command line has them */
+    AccelKind forced_mesh_accel;
+    AccelKind top_kind;
+
+    std::vector<MaterialId> bsdfs;
+    std::vector<MaterialId> pickers;
+    std::vector<Object *> shapes;
+    std::vector<int> shape_kinds;
+    std::vector<MeshJob *> shape_meshes;    /* null for the plain shapes */
+    std::deque<MeshJob> mesh_jobs;          /* stable addresses for the tasks */
+    std::deque<CloudJob> cloud_jobs;
+    std::vector<LightEntry> lights;
+    std::vector<int> bounded;               /* shapes, as a mesh's is made late */
+};
+
+#endif // _SCENE_LOADER_H
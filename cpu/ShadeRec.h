@@ -24,34 +24,14 @@ struct ShadeRec
     Vector3D    dir;
     float       t;
 
-    ShadeRec() {}
-
-    ShadeRec(const ShadeRec& sr):
-        hit_an_object(sr.hit_an_object),
-        hit_point(sr.hit_point),
-        local_hit_point(sr.local_hit_point),
-        normal(sr.normal),
-        reflected_dir(sr.reflected_dir),
-        color(sr.color),
-        ray(sr.ray),
-        depth(sr.depth),
-        dir(sr.dir)
+    ShadeRec():
+        hit_an_object(false),
+        depth(0)
     {}
 
-    ShadeRec& operator = (const ShadeRec& rhs)
-    {
-        hit_an_object = rhs.hit_an_object;
-        hit_point = rhs.hit_point;
-        local_hit_point = rhs.local_hit_point;
-        normal = rhs.normal;
-        reflected_dir = rhs.reflected_dir;
-        color = rhs.color;
-        ray = rhs.ray;
-        depth = rhs.depth;
-        dir = rhs.dir;
-        return (*this);
-    }
-
+    /* plain member-wise copies keep ShadeRec trivially copyable */
+    ShadeRec(const ShadeRec& sr) = default;
+    ShadeRec& operator = (const ShadeRec& rhs) = default;
 };
 
 #endif // _SHADEREC_H
@@ -0,0 +1,859 @@
+/* ====================================================
+#   File Name     : Snapshot.h
+# ====================================================*/
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include "World.h"
+#include "camera.h"
+#include "Light.h"
+#include "sampler.h"
+#include "Checkpoint.h"
+#include "MappedFile.h"
+#include "MaterialRegistry.h"
+#include "object/Grid.h"
+#include "object/Object.h"
+#include "object/Instance.h"
+#include "object/BVH.h"
+#include "object/SphereCloud.h"
+#include "object/CompactMesh.h"
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <unordered_map>
+
+#define SNAPSHOT_MAGIC   0x4e534652u /* "RFSN" */
+#define SNAPSHOT_VERSION 5u
+#define SNAPSHOT_ALIGN   4096        /* every section starts on a page */
+
+enum SnapshotSection
+{
+    SNAP_MATERIALS = 0,  /* MaterialKey, id order, id 0 included */
+    SNAP_OBJECTS,        /* ObjectRecord, children before their parents, a run of mesh triangles as one */
+    SNAP_LIGHTS,         /* LightRecord */
+    SNAP_TOP,            /* unsigned int: the objects of World::obj_ptrs */
+    SNAP_CHILDREN,       /* unsigned int: the objects of each compound */
+    SNAP_GRIDS,          /* GridRecord */
+    SNAP_CELL_STARTS,    /* unsigned int: per grid, num_cells + 1 */
+    SNAP_CELL_ITEMS,     /* unsigned int: per grid, indices into its children */
+    SNAP_MESHES,         /* MeshRecord */
+    SNAP_VERTICES,       /* Point3D */
+    SNAP_INDICES,        /* int: per mesh, three vertices a triangle */
+    SNAP_BVHS,           /* BVHRecord */
+    SNAP_BVH_NODES,      /* BVHNode: per BVH, its node table */
+    SNAP_BVH_REFS,       /* unsigned int: per BVH, indices into its children */
+    SNAP_BVH_QNODES,     /* BVHQNode: per compressed BVH, its records */
+    SNAP_CLOUDS,         /* CloudRecord */
+    SNAP_CLOUD_SPHERES,  /* float: per sphere cloud, x, y, z and radius runs */
+    SNAP_BOX_NODES,      /* BoxNode: per sphere cloud or compact mesh, its tree */
+    SNAP_COMPACT_MESHES, /* CompactRecord */
+    SNAP_CLUSTERS,       /* MeshCluster: per compact mesh */
+    SNAP_POSITIONS,      /* unsigned short: per compact mesh, three a vertex */
+    SNAP_CORNERS,        /* unsigned char: per compact mesh, three a triangle */
+    SNAP_NUM_SECTIONS
+};
+
+struct SnapshotSectionEntry
+{
+    unsigned long long offset;
+    unsigned long long count;
+    unsigned int stride;       /* sizeof the record, checked on load */
+    unsigned int reserved;
+};
+
+struct CameraRecord
+{
+    float position[3];
+    float lookat[3];
+    float up[3];
+    float exposure_time;
+    float s, d, zoom;
+    int width, height;
+};
+
+struct MeshRecord
+{
+    unsigned long long first_vertex;
+    unsigned long long first_index;
+    unsigned int num_vertices;
+    unsigned int num_triangles;
+};
+
+struct SnapshotHeader
+{
+    unsigned int magic;
+    unsigned int version;
+    unsigned int header_size;
+    int ambient;               /* index into the lights, -1 for none */
+    unsigned long long file_size;
+    CameraRecord camera;
+    float background[3];
+    unsigned int reserved;
+    SnapshotSectionEntry sections[SNAP_NUM_SECTIONS];
+};
+
+/*
+ * A built scene written out as flat arrays and mapped back in.  Records
+ * refer to each other by index, never by pointer, so the file is used in
+ * place: the bulky parts, mesh vertices and indices, the grids' cell
+ * tables, the BVHs' nodes, the sphere clouds and the compact meshes, are
+ * read straight from the mapping and only fault in as rays reach them.
+ * What is rebuilt on load is one small object per record, the mesh
+ * triangles made from the mapped indices, and the material table, all
+ * linear passes with no parsing and no accelerator construction.
+ *
+ * Like a checkpoint, a snapshot is meant for the build that wrote it: the
+ * records are stored as they are in memory, and the version and record
+ * sizes are checked but the contents are trusted.
+ */
+class SceneSnapshot
+{
+public:
+    SceneSnapshot():
+        file(),
+        map(nullptr),
+        map_size(0)
+    {}
+
+    static bool write(const char *filename, const World& world, const Camera& camera)
+    {
+        Writer w(world);
+        if (!w.collect())
+            return false;
+
+        SnapshotHeader h;
+        memset(&h, 0, sizeof(h));
+        h.magic = SNAPSHOT_MAGIC;
+        h.version = SNAPSHOT_VERSION;
+        h.header_size = sizeof(h);
+        h.ambient = w.ambient;
+        save_camera(camera, h.camera);
+        h.background[0] = world.background_color.r;
+        h.background[1] = world.background_color.g;
+        h.background[2] = world.background_color.b;
+
+        const void *data[SNAP_NUM_SECTIONS];
+        section(h, SNAP_MATERIALS, data, w.materials);
+        section(h, SNAP_OBJECTS, data, w.objects);
+        section(h, SNAP_LIGHTS, data, w.lights);
+        section(h, SNAP_TOP, data, w.top);
+        section(h, SNAP_CHILDREN, data, w.children);
+        section(h, SNAP_GRIDS, data, w.grids);
+        section(h, SNAP_CELL_STARTS, data, w.starts);
+        section(h, SNAP_CELL_ITEMS, data, w.items);
+        section(h, SNAP_MESHES, data, w.meshes);
+        section(h, SNAP_VERTICES, data, w.vertices);
+        section(h, SNAP_INDICES, data, w.indices);
+        section(h, SNAP_BVHS, data, w.bvhs);
+        section(h, SNAP_BVH_NODES, data, w.bvh_nodes);
+        section(h, SNAP_BVH_REFS, data, w.bvh_refs);
+        section(h, SNAP_BVH_QNODES, data, w.bvh_qnodes);
+        section(h, SNAP_CLOUDS, data, w.clouds);
+        section(h, SNAP_CLOUD_SPHERES, data, w.cloud_spheres);
+        section(h, SNAP_BOX_NODES, data, w.box_nodes);
+        section(h, SNAP_COMPACT_MESHES, data, w.compact_meshes);
+        section(h, SNAP_CLUSTERS, data, w.clusters);
+        section(h, SNAP_POSITIONS, data, w.positions);
+        section(h, SNAP_CORNERS, data, w.corners);
+
+        static const char zeros[SNAPSHOT_ALIGN] = {};
+        struct iovec iov[2 * SNAP_NUM_SECTIONS + 1];
+        int n = 0;
+        unsigned long long at = sizeof(h);
+        iov[n++] = { (void *)&h, sizeof(h) };
+        for (int s = 0; s < SNAP_NUM_SECTIONS; s++)
+        {
+            SnapshotSectionEntry& e = h.sections[s];
+            unsigned long long start = (at + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+            iov[n++] = { (void *)zeros, (size_t)(start - at) };
+            iov[n++] = { (void *)data[s], (size_t)(e.count * e.stride) };
+            e.offset = start;
+            at = start + e.count * e.stride;
+        }
+        h.file_size = at;
+
+        /* the same write-and-rename as the checkpoints */
+        std::string tmp = std::string(filename) + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "ERROR: cannot open snapshot %s: %s\n", tmp.c_str(), strerror(errno));
+            return false;
+        }
+        bool ok = write_all(fd, iov, n) && fsync(fd) == 0;
+        close(fd);
+        if (ok && rename(tmp.c_str(), filename) != 0)
+            ok = false;
+        if (!ok) {
+            fprintf(stderr, "ERROR: cannot write snapshot %s: %s\n", filename, strerror(errno));
+            unlink(tmp.c_str());
+        }
+        return ok;
+    }
+
+    /* into an empty world; the mapping stays alive as long as this object */
+    bool load(const char *filename, World& world, Camera& camera, Sampler *sampler_ptr)
+    {
+        if (!map_file(filename))
+            return false;
+        const SnapshotHeader& h = *(const SnapshotHeader *)map;
+        if (!check(filename, h))
+            return false;
+        if (world.materials.size() != 1 || !world.obj_ptrs.empty() || !world.light_ptrs.empty()) {
+            fprintf(stderr, "ERROR: a snapshot is loaded into an empty world\n");
+            return false;
+        }
+
+        const MaterialKey *materials = array<MaterialKey>(h, SNAP_MATERIALS);
+        for (unsigned long long i = 1; i < h.sections[SNAP_MATERIALS].count; i++)
+            if (world.materials.intern(materials[i]) != (MaterialId)i) {
+                fprintf(stderr, "ERROR: snapshot %s repeats a material\n", filename);
+                return false;
+            }
+
+        const MeshRecord *mesh_records = array<MeshRecord>(h, SNAP_MESHES);
+        const Point3D *vertices = array<Point3D>(h, SNAP_VERTICES);
+        const int *indices = array<int>(h, SNAP_INDICES);
+        std::vector<Mesh *> meshes(h.sections[SNAP_MESHES].count);
+        for (size_t i = 0; i < meshes.size(); i++)
+        {
+            const MeshRecord& m = mesh_records[i];
+            if (!valid_mesh(h, m, indices)) {
+                fprintf(stderr, "ERROR: snapshot %s: bad mesh record %zu\n", filename, i);
+                return false;
+            }
+            meshes[i] = world.arena.make<Mesh>();
+            meshes[i]->points = vertices + m.first_vertex;
+            meshes[i]->faces = indices + m.first_index;
+            meshes[i]->num_vertices = m.num_vertices;
+            meshes[i]->num_triangles = m.num_triangles;
+            meshes[i]->num_indices = m.num_triangles * 3;
+        }
+
+        const ObjectRecord *records = array<ObjectRecord>(h, SNAP_OBJECTS);
+        const unsigned int *children = array<unsigned int>(h, SNAP_CHILDREN);
+        const GridRecord *grids = array<GridRecord>(h, SNAP_GRIDS);
+        const unsigned int *starts = array<unsigned int>(h, SNAP_CELL_STARTS);
+        const unsigned int *items = array<unsigned int>(h, SNAP_CELL_ITEMS);
+        const BVHRecord *bvhs = array<BVHRecord>(h, SNAP_BVHS);
+        const BVHNode *bvh_nodes = array<BVHNode>(h, SNAP_BVH_NODES);
+        const unsigned int *bvh_refs = array<unsigned int>(h, SNAP_BVH_REFS);
+        const BVHQNode *bvh_qnodes = array<BVHQNode>(h, SNAP_BVH_QNODES);
+        const CloudRecord *clouds = array<CloudRecord>(h, SNAP_CLOUDS);
+        const float *cloud_spheres = array<float>(h, SNAP_CLOUD_SPHERES);
+        const BoxNode *box_nodes = array<BoxNode>(h, SNAP_BOX_NODES);
+        const CompactRecord *compact_meshes = array<CompactRecord>(h, SNAP_COMPACT_MESHES);
+        const MeshCluster *clusters = array<MeshCluster>(h, SNAP_CLUSTERS);
+        const unsigned short *positions = array<unsigned short>(h, SNAP_POSITIONS);
+        const unsigned char *corners = array<unsigned char>(h, SNAP_CORNERS);
+        std::vector<Object *> objects(h.sections[SNAP_OBJECTS].count);
+        for (size_t i = 0; i < objects.size(); i++)
+        {
+            const ObjectRecord& r = records[i];
+            Object *obj = linked(h, r, records, children, meshes, i) ? restore(r, world, meshes, objects, sampler_ptr) : nullptr;
+            if (obj == nullptr) {
+                fprintf(stderr, "ERROR: snapshot %s: bad object record %zu\n", filename, i);
+                return false;
+            }
+            if (r.kind == OBJECT_COMPOUND || r.kind == OBJECT_GRID || r.kind == OBJECT_BVH)
+            {
+                /* a run stands for its triangles, which restore() made side by side */
+                Compound *compound = (Compound *)obj;
+                compound->reserve_objects(num_children(r, records, children));
+                for (unsigned int k = 0; k < r.count; k++)
+                {
+                    const ObjectRecord& c = records[children[r.ref + k]];
+                    Object *child = objects[children[r.ref + k]];
+                    if (c.kind != OBJECT_MESH_TRIANGLES)
+                        compound->add_object(child);
+                    else
+                        for (unsigned int j = 0; j < c.count; j++)
+                            compound->add_object((MeshTriangle *)child + j);
+                }
+                if (r.kind == OBJECT_GRID) {
+                    const GridRecord& g = grids[r.index[0]];
+                    ((Grid *)obj)->use_cells(g, starts + g.first_start, items + g.first_item);
+                }
+                /* the builder and the compression still apply to updates */
+                if (r.kind == OBJECT_BVH) {
+                    BVH *bvh = (BVH *)obj;
+                    const BVHRecord& b = bvhs[r.index[2]];
+                    bvh->set_builder((BVHBuilder)r.index[0]);
+                    bvh->set_compressed(r.index[1] != 0);
+                    bvh->use_tree(b, bvh_nodes + b.first_node, bvh_refs + b.first_ref, bvh_qnodes + b.first_qnode);
+                }
+            }
+            if (r.kind == OBJECT_SPHERE_CLOUD) {
+                const CloudRecord& c = clouds[r.index[0]];
+                ((SphereCloud *)obj)->use_arrays(c, cloud_spheres + c.first_sphere, box_nodes + c.first_node);
+            }
+            if (r.kind == OBJECT_COMPACT_MESH) {
+                const CompactRecord& m = compact_meshes[r.index[0]];
+                ((CompactMesh *)obj)->use_arrays(m, box_nodes + m.first_node, clusters + m.first_cluster,
+                        positions + m.first_position, corners + m.first_corner);
+            }
+            obj->set_material(r.material);
+            objects[i] = obj;
+        }
+
+        const unsigned int *top = array<unsigned int>(h, SNAP_TOP);
+        for (unsigned long long i = 0; i < h.sections[SNAP_TOP].count; i++)
+            world.add_object(objects[top[i]]);
+
+        const LightRecord *lights = array<LightRecord>(h, SNAP_LIGHTS);
+        for (unsigned long long i = 0; i < h.sections[SNAP_LIGHTS].count; i++)
+        {
+            Light *light = restore(lights[i], world, objects, sampler_ptr);
+            if (light == nullptr) {
+                fprintf(stderr, "ERROR: snapshot %s: bad light record %llu\n", filename, i);
+                return false;
+            }
+            if ((long long)i == h.ambient)
+                world.ambient_ptr = light;
+            else
+                world.add_light(light);
+        }
+
+        const CameraRecord& c = h.camera;
+        camera = Camera(Point3D(c.position[0], c.position[1], c.position[2]),
+                Point3D(c.lookat[0], c.lookat[1], c.lookat[2]),
+                Vector3D(c.up[0], c.up[1], c.up[2]), c.exposure_time, c.d, c.zoom);
+        camera.set_viewplane(c.width, c.height, c.s);
+        world.background_color = RGBColor(h.background[0], h.background[1], h.background[2]);
+        return true;
+    }
+
+    size_t mapped_bytes(void) const
+    {
+        return map_size;
+    }
+
+private:
+    SceneSnapshot(const SceneSnapshot&);
+    SceneSnapshot& operator = (const SceneSnapshot&);
+
+    /* flattens the world, giving every object, mesh and grid an index */
+    struct Writer
+    {
+        const World& world;
+        std::vector<MaterialKey> materials;
+        std::vector<ObjectRecord> objects;
+        std::vector<LightRecord> lights;
+        std::vector<unsigned int> top;
+        std::vector<unsigned int> children;
+        std::vector<GridRecord> grids;
+        std::vector<unsigned int> starts;
+        std::vector<unsigned int> items;
+        std::vector<MeshRecord> meshes;
+        std::vector<Point3D> vertices;
+        std::vector<int> indices;
+        std::vector<BVHRecord> bvhs;
+        std::vector<BVHNode> bvh_nodes;
+        std::vector<unsigned int> bvh_refs;
+        std::vector<BVHQNode> bvh_qnodes;
+        std::vector<CloudRecord> clouds;
+        std::vector<float> cloud_spheres;
+        std::vector<BoxNode> box_nodes;
+        std::vector<CompactRecord> compact_meshes;
+        std::vector<MeshCluster> clusters;
+        std::vector<unsigned short> positions;
+        std::vector<unsigned char> corners;
+        std::unordered_map<const Object *, unsigned int> object_index;
+        std::unordered_map<const Mesh *, unsigned int> mesh_index;
+        int ambient;
+
+        Writer(const World& world_):
+            world(world_),
+            ambient(-1)
+        {}
+
+        bool collect(void)
+        {
+            for (size_t i = 0; i < world.materials.size(); i++)
+            {
+                const MaterialKey& k = world.materials.key((MaterialId)i);
+                if (k.kind == MATERIAL_CUSTOM) {
+                    fprintf(stderr, "ERROR: material %zu has no parameters to save\n", i);
+                    return false;
+                }
+                materials.push_back(k);
+            }
+
+            for (Object *obj: world.obj_ptrs)
+            {
+                unsigned int k;
+                if (!add(obj, k))
+                    return false;
+                top.push_back(k);
+            }
+            for (Light *light: world.light_ptrs)
+                if (!add(light))
+                    return false;
+            if (world.ambient_ptr)
+            {
+                ambient = lights.size();
+                if (!add(world.ambient_ptr))
+                    return false;
+            }
+            return true;
+        }
+
+        /* post-order, so a compound's children always come first */
+        bool add(const Object *obj, unsigned int& index)
+        {
+            auto it = object_index.find(obj);
+            if (it != object_index.end()) {
+                index = it->second;
+                return true;
+            }
+
+            ObjectRecord r;
+            memset(&r, 0, sizeof(r));
+            if (!obj->save(r)) {
+                const char *hint = "";
+                const char *kind = obj->snapshot_kind(hint);
+                fprintf(stderr, "ERROR: %s cannot be saved in a snapshot%s\n", kind, hint);
+                return false;
+            }
+            r.material = obj->material_id;
+
+            if (r.kind == OBJECT_COMPOUND || r.kind == OBJECT_GRID || r.kind == OBJECT_BVH)
+            {
+                const Compound *compound = (const Compound *)obj;
+                std::vector<unsigned int> list;
+                for (const Object *child: compound->get_objects())
+                {
+                    if (extend_run(child, list))
+                        continue;
+                    unsigned int k;
+                    if (!add(child, k))
+                        return false;
+                    list.push_back(k);
+                }
+                r.ref = children.size();
+                r.count = list.size();
+                children.insert(children.end(), list.begin(), list.end());
+            }
+            if (r.kind == OBJECT_GRID)
+            {
+                /* a deferred grid is built now; its cells are what gets saved */
+                Grid *grid = (Grid *)obj;
+                grid->ensure_cells();
+                GridRecord g;
+                grid->save(g);
+                int num_cells = grid->num_cells();
+                const unsigned int *s = grid->get_cell_starts();
+                g.first_start = starts.size();
+                g.first_item = items.size();
+                starts.insert(starts.end(), s, s + num_cells + 1);
+                items.insert(items.end(), grid->get_cell_items(), grid->get_cell_items() + s[num_cells]);
+                r.index[0] = grids.size();
+                grids.push_back(g);
+            }
+            if (r.kind == OBJECT_BVH)
+            {
+                /* so is a deferred BVH's tree */
+                BVH *bvh = (BVH *)obj;
+                bvh->ensure_built();
+                BVHRecord b;
+                bvh->save(b);
+                b.first_node = bvh_nodes.size();
+                b.first_ref = bvh_refs.size();
+                b.first_qnode = bvh_qnodes.size();
+                bvh_nodes.insert(bvh_nodes.end(), bvh->get_nodes(), bvh->get_nodes() + b.num_nodes);
+                bvh_refs.insert(bvh_refs.end(), bvh->get_references(), bvh->get_references() + b.num_refs);
+                bvh_qnodes.insert(bvh_qnodes.end(), bvh->get_qnodes(), bvh->get_qnodes() + b.num_qnodes);
+                r.index[2] = bvhs.size();
+                bvhs.push_back(b);
+            }
+            if (r.kind == OBJECT_SPHERE_CLOUD)
+            {
+                const SphereCloud *cloud = (const SphereCloud *)obj;
+                CloudRecord c;
+                cloud->save(c);
+                c.first_sphere = cloud_spheres.size();
+                c.first_node = box_nodes.size();
+                for (int a = 0; a < 4; a++)
+                    cloud_spheres.insert(cloud_spheres.end(), cloud->get_spheres(a), cloud->get_spheres(a) + c.stride);
+                box_nodes.insert(box_nodes.end(), cloud->get_nodes(), cloud->get_nodes() + c.num_nodes);
+                r.index[0] = clouds.size();
+                clouds.push_back(c);
+            }
+            if (r.kind == OBJECT_COMPACT_MESH)
+            {
+                const CompactMesh *mesh = (const CompactMesh *)obj;
+                CompactRecord m;
+                mesh->save(m);
+                m.first_node = box_nodes.size();
+                m.first_cluster = clusters.size();
+                m.first_position = positions.size();
+                m.first_corner = corners.size();
+                box_nodes.insert(box_nodes.end(), mesh->get_nodes(), mesh->get_nodes() + m.num_nodes);
+                clusters.insert(clusters.end(), mesh->get_clusters(), mesh->get_clusters() + m.num_clusters);
+                positions.insert(positions.end(), mesh->get_positions(), mesh->get_positions() + m.num_positions);
+                corners.insert(corners.end(), mesh->get_corners(), mesh->get_corners() + m.num_corners);
+                r.index[0] = compact_meshes.size();
+                compact_meshes.push_back(m);
+            }
+            if (r.kind == OBJECT_MESH_TRIANGLES)
+                r.ref = add(((const MeshTriangle *)obj)->get_mesh());
+            /* shared by every instance of it, so written once */
+            if (r.kind == OBJECT_INSTANCE && !add(((const Instance *)obj)->get_object(), r.ref))
+                return false;
+
+            index = objects.size();
+            /* a run grows after this, so it is never shared */
+            if (r.kind != OBJECT_MESH_TRIANGLES)
+                object_index[obj] = index;
+            objects.push_back(r);
+            return true;
+        }
+
+        /* a mesh triangle that follows the one the compound's last run ends with joins it */
+        bool extend_run(const Object *child, const std::vector<unsigned int>& list)
+        {
+            if (list.empty() || objects[list.back()].kind != OBJECT_MESH_TRIANGLES)
+                return false;
+            ObjectRecord& run = objects[list.back()];
+            ObjectRecord r;
+            memset(&r, 0, sizeof(r));
+            if (!child->save(r) || r.kind != OBJECT_MESH_TRIANGLES || child->material_id != run.material
+                    || r.index[0] != run.index[0] + (int)run.count
+                    || add(((const MeshTriangle *)child)->get_mesh()) != run.ref)
+                return false;
+            run.count++;
+            return true;
+        }
+
+        unsigned int add(const Mesh *mesh)
+        {
+            auto it = mesh_index.find(mesh);
+            if (it != mesh_index.end())
+                return it->second;
+            MeshRecord m;
+            m.first_vertex = vertices.size();
+            m.first_index = indices.size();
+            m.num_vertices = mesh->num_vertices;
+            m.num_triangles = mesh->num_triangles;
+            vertices.insert(vertices.end(), mesh->points, mesh->points + mesh->num_vertices);
+            indices.insert(indices.end(), mesh->faces, mesh->faces + mesh->num_indices);
+            unsigned int index = meshes.size();
+            mesh_index[mesh] = index;
+            meshes.push_back(m);
+            return index;
+        }
+
+        bool add(const Light *light)
+        {
+            LightRecord r;
+            memset(&r, 0, sizeof(r));
+            if (!light->save(r)) {
+                fprintf(stderr, "ERROR: a light of the scene cannot be saved\n");
+                return false;
+            }
+            if (r.kind == LIGHT_AREA)
+            {
+                const AreaLight *area = (const AreaLight *)light;
+                if (!add(area->get_object(), r.ref))
+                    return false;
+                r.material = world.materials.find(area->get_material());
+            }
+            if (r.kind == LIGHT_ENVIRONMENT)
+                r.material = world.materials.find(((const EnviormentLight *)light)->get_material());
+            lights.push_back(r);
+            return true;
+        }
+    };
+
+    template <typename T>
+    static void section(SnapshotHeader& h, int s, const void **data, const std::vector<T>& v)
+    {
+        h.sections[s].count = v.size();
+        h.sections[s].stride = sizeof(T);
+        data[s] = v.data();
+    }
+
+    template <typename T>
+    const T* array(const SnapshotHeader& h, int s) const
+    {
+        return (const T *)(map + h.sections[s].offset);
+    }
+
+    static void save_camera(const Camera& camera, CameraRecord& c)
+    {
+        put(c.position, camera.position);
+        put(c.lookat, camera.lookat);
+        put(c.up, camera.up);
+        c.exposure_time = camera.exposure_time;
+        c.s = camera.s;
+        c.d = camera.d;
+        c.zoom = camera.zoom;
+        c.width = camera.width;
+        c.height = camera.height;
+    }
+
+    static void put(float *dst, const Vector3D& v)
+    {
+        dst[0] = v.x;
+        dst[1] = v.y;
+        dst[2] = v.z;
+    }
+
+    bool map_file(const char *filename)
+    {
+        if (!file.open_file(filename)) {
+            fprintf(stderr, "ERROR: cannot map snapshot %s: %s\n", filename, strerror(errno));
+            return false;
+        }
+        if (file.get_size() < sizeof(SnapshotHeader)) {
+            fprintf(stderr, "ERROR: %s is not a scene snapshot\n", filename);
+            return false;
+        }
+        map = file.get_data();
+        map_size = file.get_size();
+        return true;
+    }
+
+    bool check(const char *filename, const SnapshotHeader& h) const
+    {
+        static const unsigned int strides[SNAP_NUM_SECTIONS] = {
+            sizeof(MaterialKey), sizeof(ObjectRecord), sizeof(LightRecord),
+            sizeof(unsigned int), sizeof(unsigned int), sizeof(GridRecord),
+            sizeof(unsigned int), sizeof(unsigned int), sizeof(MeshRecord), sizeof(Point3D), sizeof(int),
+            sizeof(BVHRecord), sizeof(BVHNode), sizeof(unsigned int), sizeof(BVHQNode),
+            sizeof(CloudRecord), sizeof(float), sizeof(BoxNode), sizeof(CompactRecord),
+            sizeof(MeshCluster), sizeof(unsigned short), sizeof(unsigned char)
+        };
+        if (h.magic != SNAPSHOT_MAGIC) {
+            fprintf(stderr, "ERROR: %s is not a scene snapshot\n", filename);
+            return false;
+        }
+        bool ok = h.version == SNAPSHOT_VERSION && h.header_size == sizeof(h)
+            && h.file_size == map_size;
+        for (int s = 0; ok && s < SNAP_NUM_SECTIONS; s++)
+        {
+            const SnapshotSectionEntry& e = h.sections[s];
+            ok = e.stride == strides[s] && e.offset % SNAPSHOT_ALIGN == 0
+                && e.offset <= map_size && e.count <= (map_size - e.offset) / e.stride;
+        }
+        if (!ok)
+            fprintf(stderr, "ERROR: snapshot %s is damaged or from another version\n", filename);
+        return ok;
+    }
+
+    /* its vertices and indices within their sections, and every index one of its vertices */
+    static bool valid_mesh(const SnapshotHeader& h, const MeshRecord& m, const int *indices)
+    {
+        unsigned long long num_indices = (unsigned long long)m.num_triangles * 3;
+        if (m.first_vertex + m.num_vertices > h.sections[SNAP_VERTICES].count
+                || m.first_index + num_indices > h.sections[SNAP_INDICES].count)
+            return false;
+        for (unsigned long long k = 0; k < num_indices; k++)
+            if (indices[m.first_index + k] < 0 || (unsigned int)indices[m.first_index + k] >= m.num_vertices)
+                return false;
+        return true;
+    }
+
+    /* what a compound holds once its runs are counted triangle by triangle */
+    static unsigned long long num_children(const ObjectRecord& r, const ObjectRecord *records, const unsigned int *children)
+    {
+        unsigned long long n = 0;
+        for (unsigned int k = 0; k < r.count; k++)
+        {
+            const ObjectRecord& c = records[children[r.ref + k]];
+            n += c.kind == OBJECT_MESH_TRIANGLES ? c.count : 1;
+        }
+        return n;
+    }
+
+    /* references only to records already restored, and within their sections */
+    bool linked(const SnapshotHeader& h, const ObjectRecord& r, const ObjectRecord *records,
+            const unsigned int *children, const std::vector<Mesh *>& meshes, size_t i) const
+    {
+        if (r.material >= h.sections[SNAP_MATERIALS].count)
+            return false;
+        if (r.kind == OBJECT_MESH_TRIANGLES)
+        {
+            if (r.ref >= meshes.size() || r.count == 0 || r.index[0] < 0
+                    || (unsigned long long)r.index[0] + r.count > (unsigned long long)meshes[r.ref]->num_triangles)
+                return false;
+        }
+        if (r.kind == OBJECT_COMPOUND || r.kind == OBJECT_GRID || r.kind == OBJECT_BVH)
+        {
+            if ((unsigned long long)r.ref + r.count > h.sections[SNAP_CHILDREN].count)
+                return false;
+            for (unsigned int k = 0; k < r.count; k++)
+                if (children[r.ref + k] >= i)
+                    return false;
+        }
+        if (r.kind == OBJECT_GRID)
+        {
+            if ((unsigned int)r.index[0] >= h.sections[SNAP_GRIDS].count)
+                return false;
+            const GridRecord& g = array<GridRecord>(h, SNAP_GRIDS)[r.index[0]];
+            unsigned long long num_cells = (unsigned long long)g.nx * g.ny * g.nz;
+            if (g.first_start + num_cells + 1 > h.sections[SNAP_CELL_STARTS].count)
+                return false;
+            unsigned int num_items = array<unsigned int>(h, SNAP_CELL_STARTS)[g.first_start + num_cells];
+            if (g.first_item + num_items > h.sections[SNAP_CELL_ITEMS].count)
+                return false;
+        }
+        if (r.kind == OBJECT_BVH)
+        {
+            if (r.index[0] < BVH_BINNED_SAH || r.index[0] > BVH_SBVH
+                    || (unsigned int)r.index[2] >= h.sections[SNAP_BVHS].count)
+                return false;
+            const BVHRecord& b = array<BVHRecord>(h, SNAP_BVHS)[r.index[2]];
+            if (b.num_objects != num_children(r, records, children) || b.first_node + b.num_nodes > h.sections[SNAP_BVH_NODES].count
+                    || b.first_ref + b.num_refs > h.sections[SNAP_BVH_REFS].count
+                    || b.first_qnode + b.num_qnodes > h.sections[SNAP_BVH_QNODES].count)
+                return false;
+        }
+        if (r.kind == OBJECT_SPHERE_CLOUD)
+        {
+            if ((unsigned int)r.index[0] >= h.sections[SNAP_CLOUDS].count)
+                return false;
+            const CloudRecord& c = array<CloudRecord>(h, SNAP_CLOUDS)[r.index[0]];
+            if ((c.count && c.stride < c.count + CLOUD_BATCH - 1) || c.stride > h.sections[SNAP_CLOUD_SPHERES].count
+                    || c.first_sphere + 4 * c.stride > h.sections[SNAP_CLOUD_SPHERES].count
+                    || c.first_node + c.num_nodes > h.sections[SNAP_BOX_NODES].count)
+                return false;
+        }
+        if (r.kind == OBJECT_COMPACT_MESH)
+        {
+            if ((unsigned int)r.index[0] >= h.sections[SNAP_COMPACT_MESHES].count)
+                return false;
+            const CompactRecord& m = array<CompactRecord>(h, SNAP_COMPACT_MESHES)[r.index[0]];
+            if (m.first_node + m.num_nodes > h.sections[SNAP_BOX_NODES].count
+                    || m.first_cluster + m.num_clusters > h.sections[SNAP_CLUSTERS].count
+                    || m.first_position + m.num_positions > h.sections[SNAP_POSITIONS].count
+                    || m.first_corner + m.num_corners > h.sections[SNAP_CORNERS].count)
+                return false;
+        }
+        if (r.kind == OBJECT_INSTANCE)
+        {
+            if (r.ref >= i || (unsigned int)r.index[0] >= h.sections[SNAP_MATERIALS].count)
+                return false;
+        }
+        return true;
+    }
+
+    static Object* restore(const ObjectRecord& r, World& world, const std::vector<Mesh *>& meshes,
+            const std::vector<Object *>& objects, Sampler *sampler_ptr)
+    {
+        const float *p = r.p;
+        Object *obj = nullptr;
+        switch (r.kind)
+        {
+            case OBJECT_SPHERE:
+                obj = world.arena.make<Sphere>(Point3D(p[0], p[1], p[2]), p[3], r.material);
+                break;
+            case OBJECT_INVERTED_SPHERE:
+                obj = world.arena.make<InvertedSphere>(Point3D(p[0], p[1], p[2]), p[3], r.material);
+                break;
+            case OBJECT_PLANE:
+                obj = world.arena.make<Plane>(Point3D(p[0], p[1], p[2]), Normal(p[3], p[4], p[5]));
+                break;
+            case OBJECT_RECTANGLE:
+                obj = world.arena.make<Rectangle>(Point3D(p[0], p[1], p[2]),
+                        Vector3D(p[3], p[4], p[5]), Vector3D(p[6], p[7], p[8]));
+                break;
+            case OBJECT_TRIANGLE:
+                obj = world.arena.make<Triangle>(Point3D(p[0], p[1], p[2]),
+                        Point3D(p[3], p[4], p[5]), Point3D(p[6], p[7], p[8]));
+                break;
+            case OBJECT_MESH_TRIANGLES:
+            {
+                /*
+                 * Side by side in the mesh's own arena, made from the mapped
+                 * indices.  There is nothing for a triangle's destructor to
+                 * do, so they go without the arena's finalizers.
+                 */
+                Mesh *mesh = meshes[r.ref];
+                MeshTriangle *tri = (MeshTriangle *)mesh->triangles.allocate(r.count * sizeof(MeshTriangle),
+                        alignof(MeshTriangle));
+                for (unsigned int j = 0; j < r.count; j++)
+                {
+                    new (tri + j) MeshTriangle(mesh, r.index[0] + j);
+                    tri[j].set_material(r.material);
+                    tri[j].set_sampler(sampler_ptr);
+                }
+                obj = tri;
+                break;
+            }
+            case OBJECT_COMPOUND:
+                obj = world.arena.make<Compound>();
+                break;
+            case OBJECT_GRID:
+                obj = world.arena.make<Grid>();
+                break;
+            case OBJECT_BVH:
+                obj = world.arena.make<BVH>();
+                break;
+            case OBJECT_SPHERE_CLOUD:
+                obj = world.arena.make<SphereCloud>();
+                break;
+            case OBJECT_COMPACT_MESH:
+                obj = world.arena.make<CompactMesh>();
+                break;
+            case OBJECT_INSTANCE:
+            {
+                Matrix transform(p);
+                if (transform.determinant() == 0.0f)
+                    return nullptr;
+                obj = world.arena.make<Instance>(objects[r.ref], transform, r.index[0]);
+                break;
+            }
+            default:
+                return nullptr;
+        }
+        obj->set_sampler(sampler_ptr);
+        return obj;
+    }
+
+    static Light* restore(const LightRecord& r, World& world, const std::vector<Object *>& objects,
+            Sampler *sampler_ptr)
+    {
+        RGBColor c(r.color[0], r.color[1], r.color[2]);
+        Light *light = nullptr;
+        switch (r.kind)
+        {
+            case LIGHT_AMBIENT:
+                light = world.arena.make<Ambient>(r.ls, c);
+                break;
+            case LIGHT_POINT:
+                light = world.arena.make<PointLight>(r.ls, c, Vector3D(r.p[0], r.p[1], r.p[2]));
+                break;
+            case LIGHT_AREA:
+                if (r.ref >= objects.size() || r.material >= world.materials.size())
+                    return nullptr;
+                light = world.arena.make<AreaLight>(objects[r.ref], world.materials[r.material]);
+                break;
+            case LIGHT_AMBIENT_OCCLUDER:
+                light = world.arena.make<AmbientOccluder>(r.ls, c, RGBColor(r.p[0], r.p[1], r.p[2]));
+                break;
+            case LIGHT_ENVIRONMENT:
+                if (r.material >= world.materials.size())
+                    return nullptr;
+                light = world.arena.make<EnviormentLight>(sampler_ptr, world.materials[r.material]);
+                break;
+            default:
+                return nullptr;
+        }
+        light->set_sampler(sampler_ptr);
+        return light;
+    }
+
+private:
+    MappedFile file;
+    const char *map;
+    size_t map_size;
+};
+
+#endif // _SNAPSHOT_H
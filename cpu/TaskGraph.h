@@ -0,0 +1,238 @@
+/* ====================================================
+#   File Name     : TaskGraph.h
+# ====================================================*/
+
+#ifndef _TASK_GRAPH_H
+#define _TASK_GRAPH_H
+
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <initializer_list>
+#include <condition_variable>
+
+/* a fixed set of worker threads taking jobs from one queue */
+class ThreadPool
+{
+public:
+    ThreadPool(int num_threads = 0):
+        stopping(false)
+    {
+        if (num_threads <= 0)
+            num_threads = std::thread::hardware_concurrency();
+        if (num_threads <= 0)
+            num_threads = 1;
+        for (int i = 0; i < num_threads; i++)
+            workers.emplace_back([this] { work(); });
+    }
+
+    /* finishes everything queued before the threads go */
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& t: workers)
+            t.join();
+    }
+
+    void submit(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        wake.notify_one();
+    }
+
+    int num_threads(void) const
+    {
+        return workers.size();
+    }
+
+    /*
+     * fn(i) for every i in [0, n), spread over the workers and the calling
+     * thread.  The caller takes items as well and waits only for the ones
+     * others have taken, so a job may call this without tying up the pool.
+     */
+    void parallel_for(size_t n, std::function<void(size_t)> fn)
+    {
+        struct Loop
+        {
+            std::function<void(size_t)> fn;
+            size_t n;
+            std::atomic<size_t> next, done;
+            std::mutex mutex;
+            std::condition_variable finished;
+        };
+        if (n == 0)
+            return;
+        std::shared_ptr<Loop> loop = std::make_shared<Loop>();
+        loop->fn = std::move(fn);
+        loop->n = n;
+        loop->next = 0;
+        loop->done = 0;
+        auto run = [loop] {
+            for (size_t i; (i = loop->next++) < loop->n; )
+            {
+                loop->fn(i);
+                if (++loop->done == loop->n) {
+                    std::lock_guard<std::mutex> lock(loop->mutex);
+                    loop->finished.notify_all();
+                }
+            }
+        };
+        for (size_t k = 1; k < n && k <= workers.size(); k++)
+            submit(run);
+        run();
+        std::unique_lock<std::mutex> lock(loop->mutex);
+        loop->finished.wait(lock, [&loop] { return loop->done == loop->n; });
+    }
+
+private:
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator = (const ThreadPool&);
+
+    void work(void)
+    {
+        for (;;)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()> > jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+};
+
+typedef int TaskId;
+
+/*
+ * Tasks with dependencies, run on a ThreadPool.  A task is handed to the
+ * pool as soon as everything it depends on has finished, so tasks can be
+ * added while earlier ones are already running: a loader adds the work
+ * for each asset as it comes across it, and independent assets proceed
+ * side by side.  Waiting for one task leaves the rest of the graph running,
+ * which is how rendering starts before every last piece is built.
+ */
+class TaskGraph
+{
+public:
+    TaskGraph(ThreadPool& pool_):
+        pool(pool_),
+        tasks(),
+        num_done(0)
+    {}
+
+    /* waits for everything, the pool may not outlive the work it was given */
+    ~TaskGraph()
+    {
+        wait_all();
+    }
+
+    TaskId add(std::function<void()> fn, std::initializer_list<TaskId> deps = {})
+    {
+        return add(std::move(fn), std::vector<TaskId>(deps));
+    }
+
+    TaskId add(std::function<void()> fn, const std::vector<TaskId>& deps)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        TaskId id = tasks.size();
+        tasks.emplace_back();
+        Task& t = tasks.back();
+        t.fn = std::move(fn);
+        for (TaskId d: deps)
+            if (!tasks[d].done) {
+                tasks[d].successors.push_back(id);
+                t.waiting++;
+            }
+        if (t.waiting == 0)
+            start(id);
+        return id;
+    }
+
+    ThreadPool& get_pool(void)
+    {
+        return pool;
+    }
+
+    void wait(TaskId id)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this, id] { return tasks[id].done; });
+    }
+
+    void wait_all(void)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this] { return num_done == tasks.size(); });
+    }
+
+private:
+    TaskGraph(const TaskGraph&);
+    TaskGraph& operator = (const TaskGraph&);
+
+    struct Task
+    {
+        std::function<void()> fn;
+        std::vector<TaskId> successors;
+        int waiting;
+        bool done;
+
+        Task(): waiting(0), done(false) {}
+    };
+
+    /* with the lock held */
+    void start(TaskId id)
+    {
+        pool.submit([this, id] { run(id); });
+    }
+
+    void run(TaskId id)
+    {
+        std::function<void()> fn;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            fn = std::move(tasks[id].fn);
+        }
+        fn();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Task& t = tasks[id];
+        t.done = true;
+        num_done++;
+        for (TaskId s: t.successors)
+            if (--tasks[s].waiting == 0)
+                start(s);
+        finished.notify_all();
+    }
+
+private:
+    ThreadPool& pool;
+    std::deque<Task> tasks;   /* stable under push_back */
+    size_t num_done;
+    std::mutex mutex;
+    std::condition_variable finished;
+};
+
+#endif // _TASK_GRAPH_H
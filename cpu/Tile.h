@@ -0,0 +1,55 @@
+/* ====================================================
+#   File Name     : Tile.h
+# ====================================================*/
+
+#ifndef _TILE_H
+#define _TILE_H
+
+#include "RGBColor.h"
+#include "MemoryStats.h"
+
+#include <vector>
+
+#define TILE_SIZE 32
+
+/*
+ * A rectangular block of the camera raster.  Rows count from the bottom of
+ * the image like the camera does; the colors are kept row-major so a
+ * finished tile can be handed to an output without reshuffling.
+ */
+struct Tile
+{
+    int r0, c0;         /* first raster row and column */
+    int rows, cols;
+    tracked_vector<float, MEM_FRAMEBUFFER> data;
+
+    Tile():
+        r0(0), c0(0),
+        rows(0), cols(0),
+        data()
+    {}
+
+    void reset(int r0_, int c0_, int rows_, int cols_)
+    {
+        r0 = r0_;
+        c0 = c0_;
+        rows = rows_;
+        cols = cols_;
+        data.resize((size_t)rows * cols * 3);
+    }
+
+    void set(int i, int j, const RGBColor& color)
+    {
+        float *p = &data[((size_t)i * cols + j) * 3];
+        p[0] = color.r;
+        p[1] = color.g;
+        p[2] = color.b;
+    }
+
+    const float* row(int i) const
+    {
+        return &data[(size_t)i * cols * 3];
+    }
+};
+
+#endif // _TILE_H
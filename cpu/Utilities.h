@@ -15,19 +15,11 @@ class Vector2D
 public:
 	float x, y;
 
-	Vector2D() {}
-	Vector2D(float a): Vector2D(a, a) {}
-	Vector2D(float x_, float y_): x(x_), y(y_) {}
-	Vector2D(const Vector2D& v):
-        Vector2D(v.x, v.y)
-    {}
-
-	Vector2D& operator = (const Vector2D& rhs)
-    {
-        x = rhs.x;
-        y = rhs.y;
-        return (*this);
-    }
+	Vector2D() = default;
+	constexpr Vector2D(float a): Vector2D(a, a) {}
+	constexpr Vector2D(float x_, float y_): x(x_), y(y_) {}
+	Vector2D(const Vector2D& v) = default;
+	Vector2D& operator = (const Vector2D& rhs) = default;
 
 	Vector2D operator * (const float a) const {
 		return Vector2D(x * a, y * a);
@@ -39,24 +31,15 @@ class Vector3D
 public:
 	float x, y, z;
 
-	Vector3D() {}
-	Vector3D(float a): Vector3D(a, a, a) {}
-	Vector3D(float x_, float y_, float z_):
+	Vector3D() = default;
+	constexpr Vector3D(float a): Vector3D(a, a, a) {}
+	constexpr Vector3D(float x_, float y_, float z_):
         x(x_),
         y(y_),
         z(z_)
     {}
-	Vector3D(const Vector3D& v):
-        Vector3D(v.x, v.y, v.z)
-    {}
-
-	Vector3D& operator = (const Vector3D& rhs)
-    {
-        x = rhs.x;
-        y = rhs.y;
-        z = rhs.z;
-        return (*this);
-    }
+	Vector3D(const Vector3D& v) = default;
+	Vector3D& operator = (const Vector3D& rhs) = default;
 
 	Vector3D operator* (const float a) const {
 		return Vector3D(x * a, y * a, z * a);
@@ -122,23 +105,43 @@ class Ray
 public:
 	Vector3D d;
 	Point3D o;
+	/*
+	 * The ray's footprint as a cone: its width at o and how much that grows
+	 * per unit of t.  Both 0 ask for every detail, as rays without a pixel
+	 * behind them do.
+	 */
+	float width;
+	float spread;
+
+	Ray():
+        width(0),
+        spread(0)
+    {}
 
-	Ray() {}
+	Ray(const Ray& r) = default;
 
-	Ray(const Ray& r):
-        Ray(r.o, r.d)
+	Ray(const Point3D& o_, const Point3D& d_):
+        o(o_),
+        d(d_),
+        width(0),
+        spread(0)
     {}
 
-	Ray(const Point3D& o_, const Point3D& d_):
+	Ray(const Point3D& o_, const Point3D& d_, float width_, float spread_):
+        d(d_),
         o(o_),
-        d(d_)
+        width(width_),
+        spread(spread_)
     {}
 
-	Ray& operator = (const Ray& rhs) {
-		o = rhs.o; d = rhs.d;
-		return (*this);
+	/* how wide the ray is at t */
+	float footprint(float t) const
+	{
+		return width + spread * t;
 	}
 
+	Ray& operator = (const Ray& rhs) = default;
+
 };
 
 class ViewPlane
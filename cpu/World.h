@@ -8,11 +8,15 @@
 #ifndef  _WORLD_H
 #define  _WORLD_H
 
+#include "Arena.h"
 #include "Light.h"
+#include "MaterialRegistry.h"
 #include "RGBColor.h"
 #include "Utilities.h"
+#include "ShadeRec.h"
 #include "object/Object.h"
 
+#include <cfloat>
 #include <vector>
 
 class World
@@ -21,22 +25,18 @@ public:
 	RGBColor background_color;
 	std::vector<Object *> obj_ptrs;
 	std::vector<Light *> light_ptrs;
-	AmbientOccluder *ambient_ptr;
+	Light *ambient_ptr;
+	/* owns every object and light of the scene */
+	Arena arena;
+	MaterialRegistry materials;
 
     World(void):
-        background_color(BLACK)
+        background_color(BLACK),
+        ambient_ptr(nullptr),
+        arena(1 << 20, MEM_GEOMETRY),
+        materials()
     {}
 
-    ~World(void)
-    {
-        for (int i = 0; i < obj_ptrs.size(); i++) {
-            delete obj_ptrs[i];
-        }
-        for (int i = 0; i < light_ptrs.size(); i++) {
-            delete light_ptrs[i];
-        }
-    }
-
     void add_object(Object *obj_ptr)
     {
         obj_ptrs.push_back(obj_ptr);
@@ -46,6 +46,48 @@ public:
         light_ptrs.push_back(light_ptr);
     }
 
+    /*
+     * The nearest object along the ray, null if there is none; sr gets the
+     * hit the way the tracers shade it.  Whatever accelerator the scene was
+     * given sits in obj_ptrs, so this is the one place rays meet it.
+     */
+    Object* hit(const Ray& ray, ShadeRec& sr)
+    {
+        float tmin = FLT_MAX, t;
+        Normal normal;
+        Point3D local_hit_point;
+        Object *nearest = nullptr;
+        for (Object *obj: obj_ptrs)
+        {
+            if (obj->hit(ray, t, sr) && t < tmin)
+            {
+                tmin = t;
+                nearest = obj;
+                normal = sr.normal;
+                local_hit_point = sr.local_hit_point;
+            }
+        }
+        if (nearest)
+        {
+            sr.hit_an_object = true;
+            sr.t = tmin;
+            sr.hit_point = ray.o + ray.d * tmin;
+            sr.normal = normal;
+            sr.local_hit_point = local_hit_point;
+        }
+        return nearest;
+    }
+
+    /* anything along the ray before max_t */
+    bool shadow_hit(const Ray& ray, float max_t)
+    {
+        float t = FLT_MAX;
+        for (Object *obj: obj_ptrs)
+            if (obj->shadow_hit(ray, t) && t < max_t)
+                return true;
+        return false;
+    }
+
 };
 
 #endif // _WORLD_H
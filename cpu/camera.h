@@ -14,10 +14,15 @@
 #include "RGBColor.h"
 #include "Utilities.h"
 #include "ShadeRec.h"
+#include "Framebuffer.h"
+#include "MappedImage.h"
+#include "Tile.h"
+#include "Checkpoint.h"
 
 #include <vector>
 #include <cfloat>
 #include <iostream>
+#include <ctime>
 
 extern World world;
 
@@ -25,8 +30,16 @@ extern World world;
 const Vector3D UP(0, 0, 1);
 extern NRooks sampler;
 
+/* one bounce of a camera path, kept in the thread's scratch arena */
+struct PathVertex
+{
+    ShadeRec sr;
+    RGBColor f; /* weight of the radiance arriving from the next vertex */
+};
+
 class Camera
 {
+	friend class SceneSnapshot;
 public:
     Camera():
         position(Point3D(200, 200, 200)),
@@ -37,7 +50,16 @@ public:
         s(1),
         exposure_time(0.01),
         d(100),
-        zoom(1)
+        zoom(1),
+        output_file("result.ppm"),
+        stream_ptr(nullptr),
+        num_passes(1),
+        checkpoint_interval(600),
+        last_checkpoint(0),
+        resume_requested(false),
+        render_seed(0),
+        scene_id(0),
+        zoom_applied(false)
     {
         compute_uvw();
     }
@@ -49,7 +71,16 @@ public:
         width(200),
         height(200),
         s(1),
-        exposure_time(0.01)
+        exposure_time(0.01),
+        output_file("result.ppm"),
+        stream_ptr(nullptr),
+        num_passes(1),
+        checkpoint_interval(600),
+        last_checkpoint(0),
+        resume_requested(false),
+        render_seed(0),
+        scene_id(0),
+        zoom_applied(false)
     {
         compute_uvw();
     }
@@ -63,7 +94,16 @@ public:
         up(up_),
         width(200),
         height(200),
-        zoom(zoom_)
+        zoom(zoom_),
+        output_file("result.ppm"),
+        stream_ptr(nullptr),
+        num_passes(1),
+        checkpoint_interval(600),
+        last_checkpoint(0),
+        resume_requested(false),
+        render_seed(0),
+        scene_id(0),
+        zoom_applied(false)
     {
         compute_uvw();
     }
@@ -82,11 +122,61 @@ public:
         width = w_;
         height = h_;
         s = s_;
+    }
+
+    /* change the resolution while keeping the horizontal field of view */
+    void set_resolution(int w_, int h_)
+    {
+        s = s * width / w_;
+        width = w_;
+        height = h_;
+    }
+
+    void set_postprocess(const PostProcess& post_)
+    {
+        post = post_;
+    }
+
+    /* write finished tiles straight into a mapped image instead of keeping them */
+    void set_stream(MappedImage *stream_ptr_)
+    {
+        stream_ptr = stream_ptr_;
+    }
+
+    void set_output(const std::string& filename)
+    {
+        output_file = filename;
+    }
+
+    /* progressive rendering: every pass adds sampler.num_samples per pixel */
+    void set_passes(int n)
+    {
+        num_passes = n;
+    }
 
-        pixels = std::vector<std::vector<float>>(height);
-        maxval = FLT_MIN;
+    /* save the accumulation every `interval` seconds, checked after every row of tiles */
+    void set_checkpoint(const std::string& filename, float interval)
+    {
+        checkpoint_file = filename;
+        checkpoint_interval = interval;
+    }
+
+    /* what a checkpoint must match besides the camera: the seed and scene_identity() */
+    void set_render_identity(unsigned long long seed_, unsigned long long scene_)
+    {
+        render_seed = seed_;
+        scene_id = scene_;
     }
 
+    /* pick up from the checkpoint file, if there is a matching one */
+    void set_resume(bool resume_)
+    {
+        resume_requested = resume_;
+    }
+
+    int get_width(void) const { return width; }
+    int get_height(void) const { return height; }
+
     void set_up(const Vector3D& up_)
     {
         up = up_;
@@ -94,40 +184,89 @@ public:
     }
 
     void render_scene(int algo = 0)
+    {
+        /* once, so that the scene can be rendered again, frame after frame */
+        if (!zoom_applied) {
+            s /= zoom;
+            zoom_applied = true;
+        }
+
+        int first_pass = 0, first_row = 0;
+        if (stream_ptr == nullptr)
+        {
+            framebuffer.resize(width, height);
+            if (resume_requested)
+                first_pass = resume(first_row);
+        }
+
+        printf("Number of samples:      %d x %d passes\n", sampler.num_samples, num_passes);
+        last_checkpoint = time(nullptr);
+        for (int pass = first_pass; pass < num_passes; pass++)
+        {
+            render_pass(pass, pass == first_pass ? first_row : 0);
+            checkpoint(pass + 1, 0, pass + 1 == num_passes);
+        }
+
+        if (stream_ptr)
+            stream_ptr->close_image();
+        else
+            print();
+    }
+
+    /* from the row of tiles starting at first_row, where a resumed pass left off */
+    void render_pass(int pass, int first_row = 0)
+    {
+        Tile tile;
+        for (int r0 = first_row; r0 < height; r0 += TILE_SIZE)
+        {
+            for (int c0 = 0; c0 < width; c0 += TILE_SIZE)
+            {
+                tile.reset(r0, c0, std::min(TILE_SIZE, height - r0), std::min(TILE_SIZE, width - c0));
+                render_tile(tile);
+                commit_tile(tile);
+            }
+            float done = pass + (float)std::min(r0 + TILE_SIZE, height) / height;
+            fprintf(stderr, "\rProcess:                %3.2f", done / num_passes * 100);
+            /* so that a single long pass is saved as it goes, too */
+            if (r0 + TILE_SIZE < height)
+                checkpoint(pass, r0 + TILE_SIZE, false);
+        }
+    }
+
+    void render_tile(Tile& tile)
     {
         RGBColor L;
         Ray ray;
-        int depth = 0;
-        s /= zoom;
-
         ray.o = position;
+        /* a pixel's width per unit of distance, for the objects that choose their detail by it */
+        ray.spread = s / d;
         float x, y;
         Point2D sp;
+        ScratchArena& scratch = ScratchArena::local();
 
-        printf("Number of samples:      %d\n", sampler.num_samples);
-        for (int r = 0; r < height; r++)
+        for (int i = 0; i < tile.rows; i++)
         {
-            for (int c = 0; c < width; c++)
+            int r = tile.r0 + i;
+            for (int j = 0; j < tile.cols; j++)
             {
+                int c = tile.c0 + j;
                 L = BLACK;
-                for (int j = 0; j < sampler.num_samples; j++)
+                for (int k = 0; k < sampler.num_samples; k++)
                 {
                     sp = sampler.sample_unit_square();
                     x = s * (c - 0.5f * width + sp.x);
                     y = s * (r - 0.5f * height + sp.y);
                     ray.d = ray_direction(x, y);
+                    scratch.reset();
                     // L += trace_ray(ray);
                     L += trace_path(ray, 0);
                     // L += trace_path_global(ray, 0);
                 }
 
                 L /= sampler.num_samples;
-                add_pixel(r, c, L);
+                tile.set(i, j, L);
             }
-            fprintf(stderr, "\rProcess:                %3.2f", ((float)(r + 1) / height * 100));
         }
-
-        print();
     }
 
     Vector3D ray_direction(const float xv, const float yv) const
@@ -143,72 +282,48 @@ public:
     {
         ShadeRec sr;
         sr.color = BLACK;
-        float t;
-        Normal normal;
-        Point3D local_hit_point;
-        float tmin = FLT_MAX;
-        int num_objects = world.obj_ptrs.size();
-        Object* nearest_object;
-        for (int i = 0; i < num_objects; i++)
-        {
-            if (world.obj_ptrs[i]->hit(ray, t, sr) && t < tmin)
-            {
-                sr.hit_an_object = true;
-                tmin = t;
-                sr.hit_point = ray.o + ray.d * t;
-                nearest_object = world.obj_ptrs[i];
-                local_hit_point = sr.local_hit_point;
-                normal = sr.normal;
-            }
-        }
-
-        if (sr.hit_an_object)
+        Object *nearest_object = world.hit(ray, sr);
+        if (nearest_object)
         {
-            sr.t = tmin;
-            sr.normal = normal;
-            sr.local_hit_point = local_hit_point;
             sr.ray = ray;
-            sr.color = nearest_object->material_ptr->area_light_shade(sr);
+            sr.color = world.materials[nearest_object->material_id]->area_light_shade(sr);
         }
         return sr.color;
     }
 
+    /*
+     * Iterative path tracing: the bounces are recorded in scratch memory and
+     * folded back to front afterwards, which evaluates exactly the same sum
+     * as the recursive form without a call frame per bounce.
+     */
     RGBColor trace_path(const Ray& ray, const int depth)
     {
         if (depth >= MAX_DEPTH)
             return BLACK;
 
-        ShadeRec sr;
-        Normal normal;
-        Point3D local_hit_point;
-        float tmin = FLT_MAX, t;
-        Object *nearest_object;
-        size_t num_objects = world.obj_ptrs.size();
-        for (int i = 0; i < num_objects; i++)
+        PathVertex *path = ScratchArena::local().alloc<PathVertex>(MAX_DEPTH - depth);
+        RGBColor L = BLACK;
+        Ray r = ray;
+        int n = 0;
+        for (; depth + n < MAX_DEPTH; n++)
         {
-            if (world.obj_ptrs[i]->hit(ray, t, sr) && t < tmin)
+            ShadeRec& sr = path[n].sr;
+            Object *nearest_object = world.hit(r, sr);
+            if (!nearest_object)
             {
-                sr.hit_an_object = true;
-                tmin = t;
-                sr.hit_point = ray.o + ray.d * t;
-                nearest_object = world.obj_ptrs[i];
-                local_hit_point = sr.local_hit_point;
-                normal = sr.normal;
+                L = world.background_color;
+                break;
             }
-        }
 
-        if (sr.hit_an_object)
-        {
-            sr.t = tmin;
-            normal.normalize();
-            sr.normal = normal;
-            sr.local_hit_point = local_hit_point;
-            sr.ray = ray;
-            RGBColor traced_color = nearest_object->material_ptr->path_shade(sr);
-            Ray reflected_ray(sr.hit_point, sr.reflected_dir);
-            return traced_color * trace_path(reflected_ray, depth + 1) + sr.color;
+            sr.normal.normalize();
+            sr.ray = r;
+            path[n].f = world.materials[nearest_object->material_id]->path_shade(sr);
+            r = Ray(sr.hit_point, sr.reflected_dir, r.footprint(sr.t), r.spread);
         }
-        return world.background_color;
+
+        while (n-- > 0)
+            L = path[n].f * L + path[n].sr.color;
+        return L;
     }
 
     RGBColor trace_path_global(const Ray& ray, const int depth)
@@ -216,34 +331,14 @@ public:
         if (depth >= MAX_DEPTH)
             return trace_ray(ray);
         ShadeRec sr;
-        Normal normal;
-        Point3D local_hit_point;
-        float tmin = FLT_MAX, t;
-        Object *nearest_object;
-        size_t num_objects = world.obj_ptrs.size();
-        for (int i = 0; i < num_objects; i++)
-        {
-            if (world.obj_ptrs[i]->hit(ray, t, sr) && t < tmin)
-            {
-                sr.hit_an_object = true;
-                tmin = t;
-                sr.hit_point = ray.o + ray.d * t;
-                nearest_object = world.obj_ptrs[i];
-                local_hit_point = sr.local_hit_point;
-                normal = sr.normal;
-            }
-        }
-
-        if (sr.hit_an_object)
+        Object *nearest_object = world.hit(ray, sr);
+        if (nearest_object)
         {
-            sr.t = tmin;
-            normal.normalize();
-            sr.normal = normal;
-            sr.local_hit_point = local_hit_point;
+            sr.normal.normalize();
             sr.depth = depth;
             sr.ray = ray;
             /* TODO: change path_shade to global_shade */
-            RGBColor traced_color = nearest_object->material_ptr->global_shade(sr);
+            RGBColor traced_color = world.materials[nearest_object->material_id]->global_shade(sr);
             Ray reflected_ray(sr.hit_point, sr.reflected_dir);
             return traced_color * trace_path_global(reflected_ray, sr.depth + 1);
         }
@@ -253,34 +348,98 @@ public:
 protected:
     void add_pixel(int r, int c, RGBColor& color)
     {
-        // max_to_one(color);
-        maxval = std::max(maxval, color.r);
-        pixels[r].push_back(color.r);
-        maxval = std::max(maxval, color.g);
-        pixels[r].push_back(color.g);
-        maxval = std::max(maxval, color.b);
-        pixels[r].push_back(color.b);
+        framebuffer.add_samples(r, c, color, sampler.num_samples);
     }
 
-    void print() {
-        FILE *fp;
-        fp = fopen("result.ppm", "wb");
-        if (!fp) {
-            fprintf(stderr, "ERROR: cannot open output file: %s\n", strerror(errno));
+    /* when the interval is up, or now if forced; the rows are those of the pass after passes_done */
+    void checkpoint(int passes_done, int rows_done, bool force)
+    {
+        if (checkpoint_file.empty() || (!force && difftime(time(nullptr), last_checkpoint) < checkpoint_interval))
             return;
+        write_checkpoint(checkpoint_file, render_params(passes_done, rows_done), sampler_states(), framebuffer);
+        last_checkpoint = time(nullptr);
+    }
+
+    RenderParams render_params(int passes_done, int rows_done) const
+    {
+        RenderParams params;
+        memset(&params, 0, sizeof(params));
+        params.magic = CHECKPOINT_MAGIC;
+        params.version = CHECKPOINT_VERSION;
+        params.width = width;
+        params.height = height;
+        params.num_samples = sampler.num_samples;
+        params.max_depth = MAX_DEPTH;
+        params.num_passes = num_passes;
+        params.passes_done = passes_done;
+        params.rows_done = rows_done;
+        params.s = s;
+        params.d = d;
+        params.zoom = zoom;
+        params.position[0] = position.x; params.position[1] = position.y; params.position[2] = position.z;
+        params.lookat[0] = lookat.x; params.lookat[1] = lookat.y; params.lookat[2] = lookat.z;
+        params.rand_state = get_rand_state();
+        params.seed = render_seed;
+        params.scene = scene_id;
+        params.num_samplers = Sampler::live_samplers().size();
+        return params;
+    }
+
+    std::vector<SamplerState> sampler_states(void) const
+    {
+        std::vector<SamplerState> states;
+        capture_samplers(states);
+        return states;
+    }
+
+    /* returns the number of passes already in the restored accumulation, and the rows of the next */
+    int resume(int& rows_done)
+    {
+        rows_done = 0;
+        RenderParams saved;
+        std::vector<SamplerState> states;
+        Framebuffer restored;
+        if (!read_checkpoint(checkpoint_file, saved, states, restored)) {
+            fprintf(stderr, "No checkpoint to resume from, starting a new render\n");
+            return 0;
+        }
+        if (!same_render(saved, render_params(0, 0)) || saved.rows_done < 0 || saved.rows_done >= height
+                || saved.rows_done % TILE_SIZE != 0) {
+            fprintf(stderr, "Checkpoint %s belongs to another render, starting a new one\n", checkpoint_file.c_str());
+            return 0;
         }
 
-        fprintf(fp, "P6\n");
-        fprintf(fp, "%d %d\n%d\n", width, height, 255);
-        printf("\nBrightest value:        %f\n", maxval);
-        for(int r = pixels.size() - 1; r >= 0; r--) {
-            for(int c = 0; c < pixels[r].size(); c++) {
-                fprintf(fp, "%c", (unsigned char)(int)(pixels[r][c] / maxval * 255));
+        framebuffer = restored;
+        set_rand_state(saved.rand_state);
+        restore_samplers(states);
+        rows_done = saved.rows_done;
+        if (rows_done)
+            printf("Resumed in pass:        %d, from row %d\n", saved.passes_done + 1, rows_done);
+        else
+            printf("Resumed after pass:     %d\n", saved.passes_done);
+        return saved.passes_done;
+    }
+
+    void commit_tile(const Tile& tile)
+    {
+        if (stream_ptr) {
+            stream_ptr->write_tile(tile);
+            return;
+        }
+        for (int i = 0; i < tile.rows; i++)
+        {
+            const float *p = tile.row(i);
+            for (int j = 0; j < tile.cols; j++, p += 3)
+            {
+                RGBColor color(p[0], p[1], p[2]);
+                add_pixel(tile.r0 + i, tile.c0 + j, color);
             }
         }
-        fprintf(fp, "\n");
-        fclose(fp);
+    }
 
+    void print() {
+        printf("\n");
+        framebuffer.save(output_file, post);
     }
 
 protected:
@@ -296,8 +455,20 @@ protected:
 	float zoom;
 
 	/* printer */
-	std::vector<std::vector<float>> pixels;
-	float maxval;
+	Framebuffer framebuffer;
+	PostProcess post;
+	std::string output_file;
+	MappedImage *stream_ptr;
+
+	/* progressive rendering */
+	int num_passes;
+	std::string checkpoint_file;
+	float checkpoint_interval;
+	time_t last_checkpoint;
+	bool resume_requested;
+	unsigned long long render_seed;
+	unsigned long long scene_id;
+	bool zoom_applied;
 };
 
 #endif
@@ -15,24 +15,30 @@
 #include "Material.h"
 #include "Utilities.h"
 #include "object/Object.h"
+#include "SceneLoader.h"
+#include "Snapshot.h"
+#include "TaskGraph.h"
+#include "object/BVH.h"
+#include "object/Accelerator.h"
+#include "object/Instance.h"
+#include "PerfCounter.h"
+
+#include <chrono>
+#include <random>
 
 /* global variables */
 World world;
 Camera camera;
 NRooks sampler;
 
-bool in_shadow(const Ray& ray) {
-float t = FLT_MAX;
-for (auto& obj: world.obj_ptrs)
-    if(obj->shadow_hit(ray, t))
-        return true;
-return false;
+bool in_shadow(const Ray& ray, const float max_t) {
+    return world.shadow_hit(ray, max_t);
 }
 
 void
 add_ambient_occ()
 {
-	AmbientOccluder* occluder_ptr = new AmbientOccluder(10, RGBColor(1, 1, 1), RGBColor(0.1, 0.1, 0.1));
+	AmbientOccluder* occluder_ptr = world.arena.make<AmbientOccluder>(10, RGBColor(1, 1, 1), RGBColor(0.1, 0.1, 0.1));
 	occluder_ptr->set_sampler(&sampler);
 	world.ambient_ptr = occluder_ptr;
 }
@@ -40,42 +46,35 @@ add_ambient_occ()
 void
 add_env_light()
 {
-	Emissive *e = new Emissive(1, WHITE);
-	world.add_light(new EnviormentLight(&sampler, e));
+	MaterialId e = world.materials.emissive(1, WHITE);
+	world.add_light(world.arena.make<EnviormentLight>(&sampler, world.materials[e]));
 }
 
 void
 add_area_light()
 {
-	AreaLight *light_ptr2 = new AreaLight;
-	Rectangle *rect_ptr = new Rectangle(Point3D(250, 250, 300), Vector3D(30, 0, -9), Vector3D(0, -30, 1));
-	Emissive *ems_ptr = new Emissive(300.0, RGBColor(1, 1, 1));
-	rect_ptr->set_material(ems_ptr);
+	AreaLight *light_ptr2 = world.arena.make<AreaLight>();
+	Rectangle *rect_ptr = world.arena.make<Rectangle>(Point3D(250, 250, 300), Vector3D(30, 0, -9), Vector3D(0, -30, 1));
+	MaterialId ems = world.materials.emissive(300.0, RGBColor(1, 1, 1));
+	rect_ptr->set_material(ems);
 	rect_ptr->set_sampler(&sampler);
 	light_ptr2->set_object(rect_ptr);
-	light_ptr2->set_material(ems_ptr);
+	light_ptr2->set_material(world.materials[ems]);
 	world.add_light(light_ptr2);
 }
 
 void
 add_pyramid_grid()
 {
-	Grid *grid = new Grid;
-
-	Matte *matte_ptr = new Matte;
-	matte_ptr->set_ka(0.1f);
-	matte_ptr->set_kd(0.9f);
-	matte_ptr->set_color(RGBColor(0.4, 1, 0.58f));
-	Triangle *triandle_ptr = new Triangle(Point3D(0, 0, 50), Point3D(60, 60, 5), Point3D(0, 55, 10));
-	triandle_ptr->set_material(matte_ptr);
+	Grid *grid = world.arena.make<Grid>();
+
+	MaterialId matte = world.materials.matte(0.1f, 0.9f, RGBColor(0.4, 1, 0.58f));
+	Triangle *triandle_ptr = world.arena.make<Triangle>(Point3D(0, 0, 50), Point3D(60, 60, 5), Point3D(0, 55, 10));
+	triandle_ptr->set_material(matte);
 	grid->add_object(triandle_ptr);
 
-	Matte *matte_ptr3 = new Matte;
-	matte_ptr3->set_ka(0.1f);
-	matte_ptr3->set_kd(0.9f);
-	matte_ptr3->set_color(RGBColor(0.4, 1, 0.58f));
-	Triangle *triandle_ptr3 = new Triangle(Point3D(0, 0, 50), Point3D(50, 0, 10), Point3D(60, 60, 5));
-	triandle_ptr3->set_material(matte_ptr3);
+	Triangle *triandle_ptr3 = world.arena.make<Triangle>(Point3D(0, 0, 50), Point3D(50, 0, 10), Point3D(60, 60, 5));
+	triandle_ptr3->set_material(matte);
 	grid->add_object(triandle_ptr3);
 
 	grid->setup_cells();
@@ -88,15 +87,15 @@ void add_random_balls()
 	float volume = 4;
 	float radius = 10;
 
-	Grid *grid_ptr = new Grid;
+	Grid *grid_ptr = world.arena.make<Grid>();
 
 	for (int i = 0; i < num_spheres; i++)
 	{
-		Matte *reflect_ptr = new Matte(0.6, 0.6, RGBColor(rand_float(), rand_float(), rand_float()));
+		MaterialId reflect = world.materials.matte(0.6, 0.6, RGBColor(rand_float(), rand_float(), rand_float()));
 
-	// GlossyReflective *reflect_ptr = new GlossyReflective(0, 0, 0, 1, 100, WHITE);
+	// MaterialId reflect = world.materials.glossy_reflective(0, 0, 0, 1, 100, WHITE);
 
-		Sphere *sphere_ptr = new Sphere(Point3D(50.0 * rand_float(), 50.0 * rand_float(), 10.0 * rand_float() + 5), radius, reflect_ptr);
+		Sphere *sphere_ptr = world.arena.make<Sphere>(Point3D(50.0 * rand_float(), 50.0 * rand_float(), 10.0 * rand_float() + 5), radius, reflect);
 
 		grid_ptr->add_object(sphere_ptr);
 	}
@@ -107,11 +106,11 @@ void add_random_balls()
 
 void add_plane()
 {
-	GlossyReflective *reflect_ptr = new GlossyReflective(0, 0, 0, 1, 100, WHITE);
-	// Reflective *reflect_ptr = new Reflective(0, 0, 0.2, 0.8, 20, WHITE, WHITE);
+	MaterialId reflect = world.materials.glossy_reflective(0, 0, 0, 1, 100, WHITE);
+	// MaterialId reflect = world.materials.reflective(0, 0, 0.2, 0.8, 20, WHITE, WHITE);
 
-	Plane *plane_ptr = new Plane(Point3D(0, 0, 0), Normal(0, 0, 1));
-	plane_ptr->set_material(reflect_ptr);
+	Plane *plane_ptr = world.arena.make<Plane>(Point3D(0, 0, 0), Normal(0, 0, 1));
+	plane_ptr->set_material(reflect);
 	world.add_object(plane_ptr);
 }
 
@@ -134,49 +133,43 @@ test_cornell_box()
 	camera = Camera(Point3D(400, 0, 0), Point3D(300, 0, 0), Vector3D(0, 0, 1), 1.5, 400, 1);
 	camera.set_viewplane(400, 300, 1.0);
 
-	AreaLight *light_ptr = new AreaLight;
-	Rectangle *rect_ptr = new Rectangle(Point3D(300, -10, 140), Vector3D(14, 20, 1), Vector3D(-5, 1, -20));
-	Emissive *ems_ptr = new Emissive(200.0, RGBColor(1, 1, 1));
-	rect_ptr->set_material(ems_ptr);
+	MaterialId ems = world.materials.emissive(200.0, RGBColor(1, 1, 1));
+
+	AreaLight *light_ptr = world.arena.make<AreaLight>();
+	Rectangle *rect_ptr = world.arena.make<Rectangle>(Point3D(300, -10, 140), Vector3D(14, 20, 1), Vector3D(-5, 1, -20));
+	rect_ptr->set_material(ems);
 	rect_ptr->set_sampler(&sampler);
 	light_ptr->set_object(rect_ptr);
-	light_ptr->set_material(ems_ptr);
+	light_ptr->set_material(world.materials[ems]);
 	world.add_light(light_ptr);
 
-	AreaLight *light_ptr2 = new AreaLight;
-	Rectangle *rect_ptr2 = new Rectangle(Point3D(300, -120, -140), Vector3D(14, -20, -1), Vector3D(5, 1, 20));
-	Emissive *ems_ptr2 = new Emissive(200.0, RGBColor(1, 1, 1));
-	rect_ptr2->set_material(ems_ptr2);
+	AreaLight *light_ptr2 = world.arena.make<AreaLight>();
+	Rectangle *rect_ptr2 = world.arena.make<Rectangle>(Point3D(300, -120, -140), Vector3D(14, -20, -1), Vector3D(5, 1, 20));
+	rect_ptr2->set_material(ems);
 	rect_ptr2->set_sampler(&sampler);
 	light_ptr2->set_object(rect_ptr2);
-	light_ptr2->set_material(ems_ptr2);
+	light_ptr2->set_material(world.materials[ems]);
 	world.add_light(light_ptr2);
 
 	add_ambient_occ();
 
-	Plane *plane_left = new Plane(Point3D(0, -230, 0), Normal(0, 1, 0));
-	Matte *mat_left = new Matte(0.2, 0.6, RGBColor(0.75, 0.75, 0.65));
-	plane_left->set_material(mat_left);
+	Plane *plane_left = world.arena.make<Plane>(Point3D(0, -230, 0), Normal(0, 1, 0));
+	plane_left->set_material(world.materials.matte(0.2, 0.6, RGBColor(0.75, 0.75, 0.65)));
 
-	Plane *plane_right = new Plane(Point3D(0, 230, 0), Normal(0, -1, 0));
-	Matte *mat_right = new Matte(0.2, 0.6, RGBColor(0.75, 0.75, 0.65));
-	plane_right->set_material(mat_right);
+	Plane *plane_right = world.arena.make<Plane>(Point3D(0, 230, 0), Normal(0, -1, 0));
+	plane_right->set_material(world.materials.matte(0.2, 0.6, RGBColor(0.75, 0.75, 0.65)));
 
-	Plane *plane_up = new Plane(Point3D(0, 0, 150), Normal(0, 0, -1));
-	Matte *mat_up = new Matte(0.2, 0.6, RGBColor(0.75, 0.25, 0.25));
-	plane_up->set_material(mat_up);
+	Plane *plane_up = world.arena.make<Plane>(Point3D(0, 0, 150), Normal(0, 0, -1));
+	plane_up->set_material(world.materials.matte(0.2, 0.6, RGBColor(0.75, 0.25, 0.25)));
 
-	Plane *plane_down = new Plane(Point3D(0, 0, -150), Normal(0, 0, 1));
-	Matte *mat_down = new Matte(0.2, 0.6, RGBColor(0.25, 0.25, 0.75));
-	plane_down->set_material(mat_down);
+	Plane *plane_down = world.arena.make<Plane>(Point3D(0, 0, -150), Normal(0, 0, 1));
+	plane_down->set_material(world.materials.matte(0.2, 0.6, RGBColor(0.25, 0.25, 0.75)));
 
-	Plane *plane_back = new Plane(Point3D(-300, 0, 0), Normal(1, 0, 0));
-	Matte *mat_back = new Matte(0.2, 0.25, RGBColor(0.75, 0.75, 0.55));
-	plane_back->set_material(mat_back);
+	Plane *plane_back = world.arena.make<Plane>(Point3D(-300, 0, 0), Normal(1, 0, 0));
+	plane_back->set_material(world.materials.matte(0.2, 0.25, RGBColor(0.75, 0.75, 0.55)));
 
-	Plane *plane_front= new Plane(Point3D(400, 0, 0), Normal(-1, 0, 0));
-	Matte *mat_front= new Matte(0, 0, WHITE * 0.1);
-	plane_front->set_material(mat_front);
+	Plane *plane_front= world.arena.make<Plane>(Point3D(400, 0, 0), Normal(-1, 0, 0));
+	plane_front->set_material(world.materials.matte(0, 0, WHITE * 0.1));
 
 	world.add_object(plane_up);
 	world.add_object(plane_down);
@@ -185,28 +178,362 @@ test_cornell_box()
 	world.add_object(plane_back);
 	world.add_object(plane_front);
 
-	GlossyReflective *reflect_ptr = new GlossyReflective;
-	reflect_ptr->set_ka(0);
-	reflect_ptr->set_kd(0.2);
-	reflect_ptr->set_ks(0.2);
-	reflect_ptr->set_exponent(1000000);
-	reflect_ptr->set_kr(0.4);
-	reflect_ptr->set_color(WHITE * 0.6);
-	Sphere *sphere_ptr = new Sphere(Point3D(-150, -20, -90), 60, reflect_ptr);
+	MaterialId reflect = world.materials.glossy_reflective(0, 0.2, 0.2, 0.4, 1000000, WHITE * 0.6);
+	Sphere *sphere_ptr = world.arena.make<Sphere>(Point3D(-150, -20, -90), 60, reflect);
 
 	world.add_object(sphere_ptr);
 }
 
+/*
+ * Turntable: every instance in a top-level BVH turns about its own z axis,
+ * then the BVH follows by a refit rather than a new build.
+ */
+void
+spin_instances(float degrees)
+{
+	Matrix turn = Matrix::rotation(2, degrees);
+	for (Object *obj: world.obj_ptrs)
+	{
+		BVH *bvh = dynamic_cast<BVH *>(obj);
+		if (bvh == nullptr)
+			continue;
+		for (Object *child: bvh->get_objects())
+		{
+			Instance *inst = dynamic_cast<Instance *>(child);
+			if (inst)
+				inst->set_transform(inst->get_transform() * turn);
+		}
+		auto start = std::chrono::steady_clock::now();
+		int rebuilt = bvh->update();
+		std::chrono::duration<double, std::milli> ms = std::chrono::steady_clock::now() - start;
+		printf("BVH update:             %.2f ms, %d subtrees rebuilt\n", ms.count(), rebuilt);
+	}
+}
+
+/* the scene's bounded objects, with compounds, grids and BVHs opened up */
+void
+collect_primitives(Object *obj, std::vector<Object *>& prims)
+{
+	if (dynamic_cast<Plane *>(obj))
+		return;
+	Compound *compound = dynamic_cast<Compound *>(obj);
+	if (compound == nullptr) {
+		prims.push_back(obj);
+		return;
+	}
+	for (Object *child: compound->get_objects())
+		collect_primitives(child, prims);
+}
+
+/*
+ * The BVH builders over the same objects: how long each takes to build
+ * against how fast the same random rays go through what it built, with
+ * full nodes and then compressed ones, and the cache misses per ray where
+ * the CPU's counters can be read.
+ */
+bool
+bench_bvh_builders(ThreadPool& pool, int num_rays)
+{
+	std::vector<Object *> prims;
+	for (Object *obj: world.obj_ptrs)
+		collect_primitives(obj, prims);
+	if (prims.empty())
+	{
+		fprintf(stderr, "ERROR: the scene has no bounded objects to build a BVH over\n");
+		return false;
+	}
+	printf("BVH builders over %zu objects, %d threads, %d rays\n", prims.size(), pool.num_threads(), num_rays);
+	CacheMissCounter misses;
+	printf("%-18s %10s %10s %10s %10s %10s %10s %12s\n", "builder", "build ms", "nodes", "node KB", "refs", "Mrays/s", "hits",
+			"misses/ray");
+
+	const BVHBuilder builders[] = { BVH_BINNED_SAH, BVH_LBVH, BVH_SBVH };
+	const char *names[] = { "binned-sah", "lbvh", "sbvh" };
+	std::vector<Ray> rays;
+	for (int run = 0; run < 6; run++)
+	{
+		int b = run / 2;
+		BVH bvh;
+		for (Object *obj: prims)
+			bvh.add_object(obj);
+		bvh.set_builder(builders[b], &pool);
+		bvh.set_compressed(run % 2);
+		auto start = std::chrono::steady_clock::now();
+		bvh.build();
+		std::chrono::duration<double, std::milli> build_ms = std::chrono::steady_clock::now() - start;
+
+		/* from anywhere in the scene's box, in any direction */
+		if (rays.empty())
+		{
+			BBox box = bvh.get_bounding_box();
+			std::mt19937 rng(1);
+			std::uniform_real_distribution<float> u(0.0f, 1.0f);
+			for (int k = 0; k < num_rays; k++)
+			{
+				Point3D o(box.x0 + u(rng) * (box.x1 - box.x0), box.y0 + u(rng) * (box.y1 - box.y0),
+						box.z0 + u(rng) * (box.z1 - box.z0));
+				float z = 1.0f - 2.0f * u(rng), phi = 2.0f * (float)M_PI * u(rng);
+				float r = sqrtf(std::max(0.0f, 1.0f - z * z));
+				rays.push_back(Ray(o, Vector3D(r * cosf(phi), r * sinf(phi), z)));
+			}
+		}
+
+		int hits = 0;
+		misses.start();
+		start = std::chrono::steady_clock::now();
+		for (const Ray& ray: rays)
+		{
+			ShadeRec sr;
+			float t;
+			hits += bvh.hit(ray, t, sr);
+		}
+		std::chrono::duration<double> trace_s = std::chrono::steady_clock::now() - start;
+		unsigned long long missed = misses.stop();
+		std::string name = std::string(names[b]) + (run % 2 ? " packed" : "");
+		printf("%-18s %10.1f %10zu %10zu %10zu %10.3f %10d", name.c_str(), build_ms.count(), bvh.num_nodes(),
+				bvh.node_bytes() / 1024, bvh.num_references(), rays.size() / trace_s.count() * 1e-6, hits);
+		if (misses.available())
+			printf(" %12.2f\n", (double)missed / rays.size());
+		else
+			printf(" %12s\n", "-");
+	}
+	return true;
+}
+
+/* result.ppm becomes result-0003.ppm for frame 3 */
+std::string
+frame_name(const std::string& output, int frame)
+{
+	char number[16];
+	snprintf(number, sizeof(number), "-%04d", frame);
+	size_t dot = output.find_last_of('.');
+	if (dot == std::string::npos || output.find('/', dot) != std::string::npos)
+		return output + number;
+	return output.substr(0, dot) + number + output.substr(dot);
+}
+
 int
 main(int argc, char ** argv)
 {
+	const char *output = "result.ppm";
+	bool stream = false;
+	PostProcess post;
+	int res_w = 0, res_h = 0;
+	int passes = 1;
+	const char *checkpoint = nullptr;
+	float checkpoint_interval = 600;
+	bool resume = false;
+	unsigned long long seed = 0;
+	const char *scene = nullptr;
+	const char *snapshot = nullptr;
+	const char *save_snapshot = nullptr;
+	int threads = 0;
+	int frames = 1;
+	float spin = 0;
+	bool spin_set = false;
+	BVHBuilder bvh_builder = BVH_BINNED_SAH;
+	bool bvh_compressed = false;
+	bool keep_order = false;
+	bool compact_meshes = false;
+	bool mesh_lod = false;
+	float stream_mb = 0;
+	const char *chunk_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	AccelKind accel = ACCEL_AUTO, mesh_accel = ACCEL_AUTO;
+	int bench_rays = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			output = argv[++i];
+		else if (!strcmp(argv[i], "-r") && i + 2 < argc) {
+			res_w = atoi(argv[++i]);
+			res_h = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "--stream"))
+			stream = true;
+		else if (!strcmp(argv[i], "--exposure") && i + 1 < argc)
+			post.set_exposure(atof(argv[++i]));
+		else if (!strcmp(argv[i], "--tone") && i + 1 < argc) {
+			const char *name = argv[++i];
+			ToneOperator tone;
+			if (!tone_operator_from_name(name, tone)) {
+				fprintf(stderr, "ERROR: unknown tone operator %s, expected reinhard, aces or clamp\n", name);
+				return 1;
+			}
+			post.set_tone(tone);
+		}
+		else if (!strcmp(argv[i], "--gamma") && i + 1 < argc)
+			post.set_gamma(atof(argv[++i]));
+		else if (!strcmp(argv[i], "--no-dither"))
+			post.set_dither(false);
+		else if (!strcmp(argv[i], "--passes") && i + 1 < argc)
+			passes = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc)
+			checkpoint = argv[++i];
+		else if (!strcmp(argv[i], "--checkpoint-interval") && i + 1 < argc)
+			checkpoint_interval = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--resume"))
+			resume = true;
+		else if (!strcmp(argv[i], "--seed") && i + 1 < argc)
+			seed = strtoull(argv[++i], nullptr, 10);
+		else if (!strcmp(argv[i], "--scene") && i + 1 < argc)
+			scene = argv[++i];
+		else if (!strcmp(argv[i], "--snapshot") && i + 1 < argc)
+			snapshot = argv[++i];
+		else if (!strcmp(argv[i], "--save-snapshot") && i + 1 < argc)
+			save_snapshot = argv[++i];
+		else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+			threads = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--accel-cache") && i + 1 < argc)
+			AccelCache::set_directory(argv[++i]);
+		else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+			frames = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "--bvh-builder") && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (!strcmp(name, "sah"))
+				bvh_builder = BVH_BINNED_SAH;
+			else if (!strcmp(name, "lbvh"))
+				bvh_builder = BVH_LBVH;
+			else if (!strcmp(name, "sbvh"))
+				bvh_builder = BVH_SBVH;
+			else {
+				fprintf(stderr, "ERROR: unknown BVH builder %s, expected sah, lbvh or sbvh\n", name);
+				return 1;
+			}
+		}
+		else if ((!strcmp(argv[i], "--accel") || !strcmp(argv[i], "--mesh-accel")) && i + 1 < argc) {
+			const char *name = argv[++i];
+			if (!accelerator_from_name(name, !strcmp(argv[i - 1], "--accel") ? accel : mesh_accel)) {
+				fprintf(stderr, "ERROR: unknown accelerator %s, expected auto, linear, grid or bvh\n", name);
+				return 1;
+			}
+		}
+		else if (!strcmp(argv[i], "--bvh-compress"))
+			bvh_compressed = true;
+		else if (!strcmp(argv[i], "--keep-order"))
+			keep_order = true;
+		else if (!strcmp(argv[i], "--compact-meshes"))
+			compact_meshes = true;
+		else if (!strcmp(argv[i], "--mesh-lod"))
+			mesh_lod = true;
+		else if (!strcmp(argv[i], "--stream-meshes") && i + 1 < argc)
+			stream_mb = atof(argv[++i]);
+		else if (!strcmp(argv[i], "--chunk-dir") && i + 1 < argc)
+			chunk_dir = argv[++i];
+		else if (!strcmp(argv[i], "--bvh-bench"))
+			bench_rays = i + 1 < argc && isdigit(argv[i + 1][0]) ? atoi(argv[++i]) : 200000;
+		else if (!strcmp(argv[i], "--spin") && i + 1 < argc) {
+			spin = atof(argv[++i]);
+			spin_set = true;
+		}
+	}
+
+	if (stream && (passes > 1 || checkpoint))
+	{
+		fprintf(stderr, "ERROR: --stream writes each tile once; it cannot be combined with --passes or --checkpoint\n");
+		return 1;
+	}
+	if (stream && image_format_from_name(output) != IMAGE_PPM)
+	{
+		fprintf(stderr, "ERROR: --stream writes an 8-bit PPM; %s would need PFM or raw floats, so render it without --stream\n", output);
+		return 1;
+	}
+	if (resume && !checkpoint)
+	{
+		fprintf(stderr, "ERROR: --resume needs --checkpoint <file>\n");
+		return 1;
+	}
+	if (frames < 1)
+		frames = 1;
+	if (frames > 1 && (stream || checkpoint))
+	{
+		fprintf(stderr, "ERROR: --frames renders one image after another; it cannot be combined with --stream or --checkpoint\n");
+		return 1;
+	}
+	if (!spin_set)
+		spin = 360.0f / frames;
 
+	seed_rand(seed);
     sampler = NRooks(100);
 	sampler.map_samples_to_hemisphere(1);
 
-    test_path_tracing();
+	/* scene construction runs here; what is left of it goes on during the render */
+	ThreadPool pool(threads);
+	TaskGraph graph(pool);
+
+	/* the mapping backs the scene's geometry until the end of main */
+	SceneSnapshot mapped;
+	if (snapshot)
+	{
+		if (!mapped.load(snapshot, world, camera, &sampler))
+			return 1;
+	}
+	else if (scene)
+	{
+		SceneLoader loader(world, camera, &sampler, graph);
+		loader.set_dynamic(frames > 1);
+		loader.set_bvh_builder(bvh_builder);
+		loader.set_bvh_compressed(bvh_compressed);
+		loader.set_reorder(!keep_order);
+		loader.set_compact_meshes(compact_meshes);
+		loader.set_lod(mesh_lod);
+		loader.set_streaming((size_t)(stream_mb * 1048576), chunk_dir);
+		loader.set_accelerators(accel, mesh_accel);
+		if (!loader.load(scene))
+			return 1;
+		loader.print_accelerators();
+		if (!loader.camera_defined())
+		{
+			fprintf(stderr, "ERROR: %s has no [camera]\n", scene);
+			return 1;
+		}
+	}
+	else
+		test_path_tracing();
+	if (save_snapshot && !SceneSnapshot::write(save_snapshot, world, camera))
+		return 1;
+	if (bench_rays > 0)
+		return bench_bvh_builders(pool, bench_rays) ? 0 : 1;
     // test_cornell_box();
-	camera.render_scene();
+	camera.set_output(output);
+	if (res_w > 0 && res_h > 0)
+		camera.set_resolution(res_w, res_h);
+
+	camera.set_postprocess(post);
+	camera.set_passes(passes);
+	if (checkpoint)
+	{
+		unsigned long long scene_id;
+		const char *source = snapshot ? snapshot : scene;
+		if (!scene_identity(source, scene_id))
+		{
+			fprintf(stderr, "ERROR: cannot read %s back to identify the checkpoint's scene: %s\n", source, strerror(errno));
+			return 1;
+		}
+		camera.set_checkpoint(checkpoint, checkpoint_interval);
+		camera.set_render_identity(seed, scene_id);
+		camera.set_resume(resume);
+	}
+
+	MappedImage image;
+	if (stream)
+	{
+		if (!image.open_image(output, camera.get_width(), camera.get_height()))
+			return 1;
+		image.set_postprocess(post);
+		camera.set_stream(&image);
+	}
+
+	MemoryStats::summary("scene ready");
+	for (int f = 0; f < frames; f++)
+	{
+		if (f > 0)
+			spin_instances(spin);
+		if (frames > 1)
+			camera.set_output(frame_name(output, f));
+		camera.render_scene();
+	}
+	MemoryStats::summary("end of render");
+	ChunkStore::summary();
 	return 0;
 }
 
@@ -0,0 +1,163 @@
+/* ====================================================
+#   File Name     : Accelerator.h
+# ====================================================*/
+
+#ifndef _ACCELERATOR_H
+#define _ACCELERATOR_H
+
+#include "BBox.h"
+#include "Object.h"
+#include "Grid.h"
+#include "BVH.h"
+#include "../Arena.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+/*
+ * The structures a set of objects can be traced through.  All of them are
+ * a Compound: objects go in with add_object(), build() readies it, and
+ * hit() and shadow_hit() find the nearest one, so a mesh or the scene's top
+ * level can use any of them.
+ */
+enum AccelKind
+{
+    ACCEL_AUTO,     /* picked from the objects by choose_accelerator() */
+    ACCEL_LINEAR,   /* every object tested, for a handful of them */
+    ACCEL_GRID,     /* uniform grid: objects of one size spread evenly */
+    ACCEL_BVH       /* bounding volume hierarchy: anything else */
+};
+
+/* up to this many objects, a linear scan beats any structure */
+const size_t ACCEL_LINEAR_MAX = 4;
+/*
+ * A grid wants its occupied cells to be about as many as the objects, not
+ * the objects bunched in a few of them, and no more cells per object than
+ * keep its cell lists within reason.  Measured on the test scenes, a BVH
+ * won wherever the first fell below 0.6.
+ */
+const float ACCEL_GRID_MIN_OCCUPANCY = 0.6f;
+const float ACCEL_GRID_MAX_CELLS = 512.0f;
+
+inline const char*
+accelerator_name(AccelKind kind)
+{
+    static const char *names[] = { "auto", "linear", "grid", "bvh" };
+    return names[kind];
+}
+
+inline bool
+accelerator_from_name(const char *name, AccelKind& kind)
+{
+    for (int k = ACCEL_AUTO; k <= ACCEL_BVH; k++)
+        if (!strcmp(name, accelerator_name((AccelKind)k))) {
+            kind = (AccelKind)k;
+            return true;
+        }
+    return false;
+}
+
+/*
+ * What the choice goes by, measured against the grid the objects would get:
+ * how many of its cells an object's box covers on average, and how many
+ * cells hold an object's centre compared to the number of objects.  Sizes
+ * spread over orders of magnitude drive the first up, objects bunched on
+ * a surface or in a corner of the box drive the second down.
+ */
+struct AccelStats
+{
+    size_t count;
+    float cells_per_object;
+    float occupancy;
+
+    AccelStats(void):
+        count(0),
+        cells_per_object(0),
+        occupancy(0)
+    {}
+};
+
+inline AccelStats
+accelerator_stats(const std::vector<BBox>& boxes)
+{
+    AccelStats stats;
+    stats.count = boxes.size();
+    if (boxes.empty())
+        return stats;
+
+    float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (const BBox& b: boxes)
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], (&b.x0)[a]);
+            hi[a] = std::max(hi[a], (&b.x1)[a]);
+        }
+
+    /* the grid's own resolution, as Grid::setup_cells() works it out */
+    float w[3], n[3];
+    float volume = 1;
+    for (int a = 0; a < 3; a++) {
+        w[a] = std::max(hi[a] - lo[a], 1e-6f);
+        volume *= w[a];
+    }
+    float s = powf(volume / boxes.size(), 0.33333f);
+    for (int a = 0; a < 3; a++)
+        n[a] = std::min(GRID_MULTIPLIER * w[a] / s + 1, 1024.0f);
+
+    double cells = 0;
+    std::vector<bool> occupied((size_t)n[0] * (size_t)n[1] * (size_t)n[2]);
+    size_t num_occupied = 0;
+    for (const BBox& b: boxes)
+    {
+        double covered = 1;
+        size_t index = 0, stride = 1;
+        for (int a = 0; a < 3; a++)
+        {
+            float c0 = ((&b.x0)[a] - lo[a]) / w[a] * n[a], c1 = ((&b.x1)[a] - lo[a]) / w[a] * n[a];
+            covered *= std::min(floorf(c1), n[a] - 1) - std::min(floorf(c0), n[a] - 1) + 1;
+            index += std::min((size_t)(0.5f * (c0 + c1)), (size_t)n[a] - 1) * stride;
+            stride *= (size_t)n[a];
+        }
+        cells += covered;
+        if (!occupied[index]) {
+            occupied[index] = true;
+            num_occupied++;
+        }
+    }
+    stats.cells_per_object = cells / boxes.size();
+    stats.occupancy = (float)num_occupied / std::min(boxes.size(), occupied.size());
+    return stats;
+}
+
+inline AccelKind
+choose_accelerator(const AccelStats& stats)
+{
+    if (stats.count <= ACCEL_LINEAR_MAX)
+        return ACCEL_LINEAR;
+    if (stats.cells_per_object <= ACCEL_GRID_MAX_CELLS && stats.occupancy >= ACCEL_GRID_MIN_OCCUPANCY)
+        return ACCEL_GRID;
+    return ACCEL_BVH;
+}
+
+inline AccelKind
+choose_accelerator(const std::vector<Object *>& objects)
+{
+    std::vector<BBox> boxes(objects.size());
+    for (size_t k = 0; k < objects.size(); k++)
+        boxes[k] = objects[k]->get_bounding_box();
+    return choose_accelerator(accelerator_stats(boxes));
+}
+
+/* an empty one of the kind, which must not be ACCEL_AUTO */
+inline Compound*
+make_accelerator(AccelKind kind, Arena& arena)
+{
+    if (kind == ACCEL_GRID)
+        return arena.make<Grid>();
+    if (kind == ACCEL_BVH)
+        return arena.make<BVH>();
+    return arena.make<Compound>();
+}
+
+#endif // _ACCELERATOR_H
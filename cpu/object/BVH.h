@@ -0,0 +1,1473 @@
+/* ====================================================
+#   File Name     : BVH.h
+# ====================================================*/
+
+#ifndef _BVH_H
+#define _BVH_H
+
+#include "BBox.h"
+#include "Object.h"
+#include "Morton.h"
+#include "BoxTree.h"
+#include "../Utilities.h"
+#include "../TaskGraph.h"
+#include "../AccelCache.h"
+#include "../MappedFile.h"
+
+#include <cfloat>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+/* objects per leaf at most, and the bins a split is chosen from */
+const int BVH_LEAF_SIZE = 4;
+const int BVH_BINS = 16;
+/* relative cost of stepping into a node against testing one object */
+const float BVH_TRAVERSAL_COST = 1.0f;
+/* a subtree is rebuilt once its cost grows by this factor after a refit */
+const float BVH_REBUILD_THRESHOLD = 1.5f;
+/* deeper than this, nodes are split in halves, which bounds the depth at twice it */
+const int BVH_SAH_DEPTH = 32;
+const int BVH_STACK_SIZE = 2 * BVH_SAH_DEPTH;
+/* subtrees over fewer objects are built by one task from start to end */
+const unsigned int BVH_PARALLEL_GRAIN = 4096;
+/* SBVH: references it may add, as a fraction of the objects */
+const float BVH_SPLIT_BUDGET = 0.3f;
+/* SBVH: spatial splits are tried where children overlap by this much of the root's area */
+const float BVH_SPLIT_ALPHA = 1e-5f;
+
+enum BVHBuilder
+{
+    BVH_BINNED_SAH,  /* top-down binned SAH, subtrees in parallel: for final renders */
+    BVH_LBVH,        /* Morton order, every node at once: quicker, somewhat slower to trace */
+    BVH_SBVH         /* binned SAH with spatial splits: for long thin or large overlapping objects */
+};
+
+/*
+ * One node of the tree.  Every node covers the objects order[first] ..
+ * order[first + count - 1]; an interior node also has two children, and
+ * left is 0 for a leaf, the root never being anybody's child.
+ */
+struct BVHNode
+{
+    float bbox[6];
+    unsigned int left, right;
+    unsigned int first, count;
+};
+
+/*
+ * The compressed form: one record per interior node, holding its two
+ * children.  A child's box is kept in 255ths of this node's box, rounded
+ * outwards, so that it is decoded from the box the parent decoded and is
+ * never smaller than the real one.  child[] is the child's own record, or
+ * where a leaf's objects start in order[] when count is not 0.
+ */
+struct BVHQNode
+{
+    unsigned char box[2][6];
+    unsigned short count[2];
+    unsigned int child[2];
+};
+
+/* a built BVH as it is stored in a scene snapshot or the accelerator cache */
+struct BVHRecord
+{
+    float root_box[6];
+    unsigned int root_count;
+    unsigned int num_objects;
+    unsigned long long first_node, num_nodes;    /* into the snapshot's node table */
+    unsigned long long first_ref, num_refs;      /* into its reference table */
+    unsigned long long first_qnode, num_qnodes;  /* into its compressed node table */
+};
+
+/*
+ * Bounding volume hierarchy over the objects added to it, for scenes that
+ * move.  After the objects change place (an instance gets a new transform,
+ * say) update() refits the boxes bottom-up, which costs one pass over the
+ * nodes, and rebuilds only the subtrees whose surface area heuristic cost
+ * has grown past BVH_REBUILD_THRESHOLD of what it was when they were built.
+ * A rebuilt subtree's nodes go at the end of the table; the ones it
+ * replaced are squeezed out once they make up half of it.
+ *
+ * Given a pool, builds run on it: the binned SAH builder splits the top
+ * serially and hands the subtrees below BVH_PARALLEL_GRAIN objects out as
+ * tasks, the LBVH builder sorts the objects along a Morton curve and then
+ * works out every node independently of the others (Karras, 2012).
+ *
+ * The SBVH builder (Stich et al., 2009) also weighs cutting a node in two
+ * at a plane, objects crossing it going to both sides with their boxes
+ * clipped.  An object can then sit in several leaves, so order[] holds
+ * references rather than a permutation; BVH_SPLIT_BUDGET caps how many
+ * more there may be.  It runs on the calling thread.
+ *
+ * Compressed, the tree is traced from BVHQNode records and the full nodes
+ * are let go after each build, so it takes about a third of the memory but
+ * can no longer be refitted: update() rebuilds it whole.
+ *
+ * Like a grid's cells, the tables traced are reached through plain
+ * pointers, so a tree from a mapped snapshot or the accelerator cache is
+ * used where it lies.  Such a tree is copied out before it is refitted.
+ */
+class BVH: public Compound
+{
+public:
+    BVH(void):
+        nodes(),
+        built_cost(),
+        cost(),
+        order(),
+        boxes(),
+        num_garbage(0),
+        built_objects(0),
+        split_budget(0),
+        root_area(0),
+        builder(BVH_BINNED_SAH),
+        pool(nullptr),
+        num_used(0),
+        compressed(false),
+        qnodes(),
+        root_count(0),
+        tree(nullptr),
+        refs(nullptr),
+        qtree(nullptr),
+        tree_size(0),
+        refs_size(0),
+        qtree_size(0),
+        cache_file(),
+        ready(true),
+        build_mutex()
+    {
+        empty_box(root_box);
+        empty_box(deferred_box);
+    }
+
+    /* for the next build(); without a pool it runs on the calling thread */
+    void set_builder(BVHBuilder builder_, ThreadPool *pool_ = nullptr)
+    {
+        builder = builder_;
+        pool = pool_;
+    }
+
+    /* for the next build() */
+    void set_compressed(bool compressed_)
+    {
+        compressed = compressed_;
+    }
+
+    virtual BBox get_bounding_box(void)
+    {
+        if (!ready.load(std::memory_order_acquire))
+            return BBox(deferred_box[0], deferred_box[1], deferred_box[2], deferred_box[3], deferred_box[4], deferred_box[5]);
+        if (tree_size == 0 && root_box[0] > root_box[3])
+            return BBox();
+        const float *b = tree_size == 0 ? root_box : tree[0].bbox;
+        return BBox(b[0], b[1], b[2], b[3], b[4], b[5]);
+    }
+
+    /*
+     * Bounds now, the tree when the first ray enters them, as
+     * Grid::defer_cells() does.  For meshes nested in another accelerator,
+     * so that the top level can be chosen and built from the bounds alone.
+     * The bounds are kept apart from the tree's, which a build running
+     * beside the render rewrites while rays still read these.
+     */
+    void defer_build(void)
+    {
+        empty_box(deferred_box);
+        for (Object *obj: object_ptrs) {
+            float b[6];
+            set_box(b, obj->get_bounding_box());
+            grow_box(deferred_box, b);
+        }
+        ready.store(false, std::memory_order_release);
+    }
+
+    /* build now if defer_build() left it for later */
+    void ensure_built(void)
+    {
+        if (!ready.load(std::memory_order_acquire))
+            build_deferred();
+    }
+
+    void build(void)
+    {
+        build_tree();
+        ready.store(true, std::memory_order_release);
+    }
+
+    /* adopt a tree built earlier, e.g. the one of a mapped snapshot */
+    void use_tree(const BVHRecord& r, const BVHNode *nodes_, const unsigned int *refs_, const BVHQNode *qnodes_)
+    {
+        nodes.clear();
+        built_cost.clear();
+        cost.clear();
+        order.clear();
+        qnodes.clear();
+        num_garbage = 0;
+        built_objects = r.num_objects;
+        memcpy(root_box, r.root_box, sizeof(root_box));
+        root_count = r.root_count;
+        tree = nodes_;
+        refs = refs_;
+        qtree = qnodes_;
+        tree_size = r.num_nodes;
+        refs_size = r.num_refs;
+        qtree_size = r.num_qnodes;
+        ready.store(true, std::memory_order_release);
+    }
+
+    void save(BVHRecord& r) const
+    {
+        memset(&r, 0, sizeof(r));
+        memcpy(r.root_box, root_box, sizeof(root_box));
+        r.root_count = root_count;
+        r.num_objects = built_objects;
+        r.num_nodes = tree_size;
+        r.num_refs = refs_size;
+        r.num_qnodes = qtree_size;
+    }
+
+    const BVHNode* get_nodes(void) const
+    {
+        return tree;
+    }
+
+    const unsigned int* get_references(void) const
+    {
+        return refs;
+    }
+
+    const BVHQNode* get_qnodes(void) const
+    {
+        return qtree;
+    }
+
+    /* new boxes for the same tree; returns the root's cost */
+    float refit(void)
+    {
+        /* not built yet: only the bounds are out of date */
+        if (!ready.load(std::memory_order_acquire)) {
+            defer_build();
+            return 0;
+        }
+        own_tree();
+        /* a compressed tree has let its full nodes go */
+        if (nodes.empty())
+            return 0;
+        collect_boxes();
+        /* children always come after their parent */
+        for (size_t i = nodes.size(); i-- > 0; )
+            refit_node(i);
+        return cost[0];
+    }
+
+    /* refit, then rebuild what degraded; returns the number of subtrees rebuilt */
+    int update(float threshold = BVH_REBUILD_THRESHOLD)
+    {
+        own_tree();
+        if (nodes.empty() || built_objects != object_ptrs.size()) {
+            build();
+            return 1;
+        }
+        refit();
+        int rebuilt = rebuild_degraded(0, 0, threshold);
+        if (num_garbage * 2 > nodes.size())
+            compact();
+        bind();
+        return rebuilt;
+    }
+
+    size_t num_nodes(void) const
+    {
+        if (packed())
+            return 2 * qtree_size + 1;
+        return tree_size - num_garbage;
+    }
+
+    /* bytes in the node table traced */
+    size_t node_bytes(void) const
+    {
+        if (packed())
+            return qtree_size * sizeof(BVHQNode);
+        return num_nodes() * sizeof(BVHNode);
+    }
+
+    /* objects in the leaves, counting each time a split object appears */
+    size_t num_references(void) const
+    {
+        return refs_size;
+    }
+
+    /* how to build it again; the snapshot writer stores the tree with it */
+    bool save(ObjectRecord& r) const
+    {
+        r.kind = OBJECT_BVH;
+        r.index[0] = builder;
+        r.index[1] = compressed;
+        return true;
+    }
+
+    virtual bool hit(const Ray& ray, float& tmin, ShadeRec& sr)
+    {
+        if (!ready.load(std::memory_order_acquire))
+        {
+            Vector3D inv(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+            float t;
+            if (!hit_box(deferred_box, ray, inv, FLT_MAX, t))
+                return false;
+            build_deferred();
+        }
+        if (packed())
+            return hit_compressed(ray, tmin, sr);
+        if (tree_size == 0)
+            return false;
+        Vector3D inv(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+
+        bool hit = false;
+        float t;
+        Normal normal;
+        Point3D local_hit_point;
+        tmin = FLT_MAX;
+
+        unsigned int stack[BVH_STACK_SIZE];
+        int top = 0;
+        unsigned int i = 0;
+        if (!hit_box(tree[0].bbox, ray, inv, tmin, t))
+            return false;
+        for (;;)
+        {
+            const BVHNode& node = tree[i];
+            if (node.left == 0)
+            {
+                for (unsigned int k = node.first; k < node.first + node.count; k++)
+                {
+                    Object *obj_ptr = object_ptrs[refs[k]];
+                    if (obj_ptr->hit(ray, t, sr) && (t < tmin))
+                    {
+                        hit = true;
+                        tmin = t;
+                        normal = sr.normal;
+                        material_id = obj_ptr->material_id;
+                        local_hit_point = sr.local_hit_point;
+                    }
+                }
+            }
+            else
+            {
+                /* nearer child first, the other one saved for later */
+                float tl, tr;
+                bool l = hit_box(tree[node.left].bbox, ray, inv, tmin, tl);
+                bool r = hit_box(tree[node.right].bbox, ray, inv, tmin, tr);
+                if (l && r) {
+                    bool left_first = tl <= tr;
+                    stack[top++] = left_first ? node.right : node.left;
+                    i = left_first ? node.left : node.right;
+                    continue;
+                }
+                if (l || r) {
+                    i = l ? node.left : node.right;
+                    continue;
+                }
+            }
+            if (top == 0)
+                break;
+            i = stack[--top];
+        }
+
+        if (hit)
+        {
+            sr.t = tmin;
+            sr.normal = normal;
+            sr.local_hit_point = local_hit_point;
+        }
+        return hit;
+    }
+
+    virtual bool shadow_hit(const Ray& ray, float& tmin)
+    {
+        ShadeRec sr;
+        return hit(ray, tmin, sr);
+    }
+
+private:
+    tracked_vector<BVHNode, MEM_ACCEL> nodes;
+    tracked_vector<float, MEM_ACCEL> built_cost;   /* per node, when it was built */
+    tracked_vector<float, MEM_ACCEL> cost;         /* per node, at the last refit */
+    tracked_vector<unsigned int, MEM_ACCEL> order; /* object indices, leaf by leaf */
+    std::vector<BBox> boxes;                       /* per object, during a build or refit */
+    size_t num_garbage;
+    size_t built_objects;                          /* object_ptrs.size() at the last build */
+    size_t split_budget;                           /* references the SBVH may still add */
+    float root_area;
+    BVHBuilder builder;
+    ThreadPool *pool;
+    std::atomic<unsigned int> num_used;            /* nodes handed out during a build */
+    bool compressed;
+    tracked_vector<BVHQNode, MEM_ACCEL> qnodes;    /* what is traced when compressed */
+    float root_box[6];
+    unsigned int root_count;                       /* objects when the root is a leaf */
+    const BVHNode *tree;                           /* nodes.data(), or mapped */
+    const unsigned int *refs;                      /* order.data(), or mapped */
+    const BVHQNode *qtree;                         /* qnodes.data(), or mapped */
+    size_t tree_size, refs_size, qtree_size;
+    MappedFile cache_file;                         /* backs the tables after a cache hit */
+    std::atomic<bool> ready;                       /* the tables are valid */
+    float deferred_box[6];                         /* what defer_build() found */
+    std::mutex build_mutex;
+
+    void build_tree(void)
+    {
+        unsigned int n = object_ptrs.size();
+        nodes.clear();
+        built_cost.clear();
+        cost.clear();
+        num_garbage = 0;
+        built_objects = n;
+        qnodes.clear();
+        root_count = 0;
+        cache_file.close_file();
+        empty_box(root_box);
+        order.resize(n);
+        for (unsigned int k = 0; k < n; k++)
+            order[k] = k;
+        collect_boxes();
+        bind();
+        if (n == 0)
+            return;
+
+        /*
+         * The tree depends on nothing but the boxes, the builder and the
+         * build constants.  Not so the SBVH's: it clips the objects
+         * themselves, which two objects with the same box may not share.
+         */
+        unsigned long long key = 0;
+        bool cached = AccelCache::enabled() && builder != BVH_SBVH;
+        if (cached)
+        {
+            key = cache_key();
+            if (load_cached(key))
+                return;
+        }
+
+        if (builder == BVH_LBVH)
+            build_lbvh();
+        else if (builder == BVH_SBVH)
+            build_sbvh();
+        else {
+            nodes.resize(1);
+            num_used = 1;
+            build_subtree(0, 0, n, 0);
+        }
+        if (compressed)
+            compress();
+        bind();
+        if (cached)
+            store_cached(key);
+    }
+
+    void build_deferred(void)
+    {
+        std::lock_guard<std::mutex> lock(build_mutex);
+        if (!ready.load(std::memory_order_relaxed))
+            build();
+    }
+
+    /* the tables traced, after the vectors have changed */
+    void bind(void)
+    {
+        tree = nodes.data();
+        refs = order.data();
+        qtree = qnodes.data();
+        tree_size = nodes.size();
+        refs_size = order.size();
+        qtree_size = qnodes.size();
+    }
+
+    /* a tree used from a mapping is copied into the vectors before it changes */
+    void own_tree(void)
+    {
+        if (tree_size == 0 || !nodes.empty())
+            return;
+        nodes.assign(tree, tree + tree_size);
+        order.assign(refs, refs + refs_size);
+        built_cost.resize(nodes.size());
+        cost.resize(nodes.size());
+        subtree_cost(0);
+        cache_file.close_file();
+        bind();
+    }
+
+    unsigned long long cache_key(void) const
+    {
+        const float constants[] = { (float)BVH_LEAF_SIZE, (float)BVH_BINS, BVH_TRAVERSAL_COST, (float)BVH_SAH_DEPTH };
+        unsigned int n = boxes.size();
+        unsigned long long key = AccelCache::hash(constants, sizeof(constants));
+        key = AccelCache::hash(&builder, sizeof(builder), key);
+        key = AccelCache::hash(&compressed, sizeof(compressed), key);
+        key = AccelCache::hash(&n, sizeof(n), key);
+        for (const BBox& b: boxes)
+            key = AccelCache::hash(&b.x0, 6 * sizeof(float), key);
+        return key;
+    }
+
+    bool load_cached(unsigned long long key)
+    {
+        BVHRecord r;
+        AccelCacheArray arrays[3] = {
+            { nullptr, 0, sizeof(BVHNode) },
+            { nullptr, 0, sizeof(unsigned int) },
+            { nullptr, 0, sizeof(BVHQNode) }
+        };
+        if (!AccelCache::load("bvh", key, &r, sizeof(r), arrays, 3, cache_file))
+            return false;
+        const BVHNode *n = (const BVHNode *)arrays[0].data;
+        const unsigned int *f = (const unsigned int *)arrays[1].data;
+        const BVHQNode *q = (const BVHQNode *)arrays[2].data;
+        if (r.num_objects != object_ptrs.size() || arrays[0].count != r.num_nodes
+                || arrays[1].count != r.num_refs || arrays[2].count != r.num_qnodes
+                || !valid_tree(r, n, f, q)) {
+            cache_file.close_file();
+            return false;
+        }
+        use_tree(r, n, f, q);
+        return true;
+    }
+
+    /*
+     * A mapped file can hold anything, so before a ray follows it every
+     * index is checked against its table, and the tree is walked once to
+     * see that no node is reached twice and none lies deeper than the
+     * traversal stack.  The builders do not promise children after their
+     * parent (the LBVH's do not), so only the ranges are checked.
+     */
+    static bool valid_tree(const BVHRecord& r, const BVHNode *n, const unsigned int *f, const BVHQNode *q)
+    {
+        for (unsigned long long k = 0; k < r.num_refs; k++)
+            if (f[k] >= r.num_objects)
+                return false;
+
+        struct Visit { unsigned int node; int depth; };
+        std::vector<Visit> todo;
+        unsigned long long visited = 0;
+        if (r.root_count > r.num_refs)
+            return false;
+        if (r.num_qnodes && !r.root_count)
+            todo.push_back({ 0, 0 });
+        while (!todo.empty())
+        {
+            Visit v = todo.back();
+            todo.pop_back();
+            if (v.node >= r.num_qnodes || v.depth >= BVH_STACK_SIZE || ++visited > r.num_qnodes)
+                return false;
+            for (int c = 0; c < 2; c++)
+                if (q[v.node].count[c]) {
+                    if ((unsigned long long)q[v.node].child[c] + q[v.node].count[c] > r.num_refs)
+                        return false;
+                }
+                else
+                    todo.push_back({ q[v.node].child[c], v.depth + 1 });
+        }
+
+        visited = 0;
+        if (r.num_nodes)
+            todo.push_back({ 0, 0 });
+        while (!todo.empty())
+        {
+            Visit v = todo.back();
+            todo.pop_back();
+            if (v.node >= r.num_nodes || v.depth >= BVH_STACK_SIZE || ++visited > r.num_nodes)
+                return false;
+            const BVHNode& node = n[v.node];
+            if (node.left == 0) {
+                if ((unsigned long long)node.first + node.count > r.num_refs)
+                    return false;
+                continue;
+            }
+            todo.push_back({ node.left, v.depth + 1 });
+            todo.push_back({ node.right, v.depth + 1 });
+        }
+        return true;
+    }
+
+    void store_cached(unsigned long long key) const
+    {
+        BVHRecord r;
+        save(r);
+        AccelCacheArray arrays[3] = {
+            { tree, tree_size, sizeof(BVHNode) },
+            { refs, refs_size, sizeof(unsigned int) },
+            { qtree, qtree_size, sizeof(BVHQNode) }
+        };
+        AccelCache::store("bvh", key, &r, sizeof(r), arrays, 3);
+    }
+
+    static void set_box(float *b, const BBox& box)
+    {
+        b[0] = box.x0; b[1] = box.y0; b[2] = box.z0;
+        b[3] = box.x1; b[4] = box.y1; b[5] = box.z1;
+    }
+
+    /* fn(k) for k in [0, n), on the pool if there is one */
+    void for_each(size_t n, const std::function<void(size_t)>& fn)
+    {
+        if (pool)
+            pool->parallel_for(n, fn);
+        else
+            for (size_t k = 0; k < n; k++)
+                fn(k);
+    }
+
+    /* [lo, hi) of n items split in the given number of chunks */
+    static void chunk(size_t c, size_t chunks, size_t n, size_t& lo, size_t& hi)
+    {
+        lo = n * c / chunks;
+        hi = n * (c + 1) / chunks;
+    }
+
+    size_t num_chunks(size_t n) const
+    {
+        size_t chunks = pool ? 4 * (pool->num_threads() + 1) : 1;
+        return std::max<size_t>(1, std::min(chunks, n / 1024));
+    }
+
+    void collect_boxes(void)
+    {
+        boxes.resize(object_ptrs.size());
+        size_t chunks = num_chunks(boxes.size());
+        for_each(chunks, [this, chunks](size_t c) {
+            size_t lo, hi;
+            chunk(c, chunks, boxes.size(), lo, hi);
+            for (size_t k = lo; k < hi; k++)
+                boxes[k] = object_ptrs[k]->get_bounding_box();
+        });
+    }
+
+    float centroid(unsigned int k, int axis) const
+    {
+        const BBox& b = boxes[k];
+        switch (axis) {
+            case 0:  return 0.5f * (b.x0 + b.x1);
+            case 1:  return 0.5f * (b.y0 + b.y1);
+            default: return 0.5f * (b.z0 + b.z1);
+        }
+    }
+
+    /*
+     * The surface area heuristic of the subtree, not divided by the node's
+     * own area, so that boxes swelling as objects move show up in it.
+     */
+    float node_cost(const BVHNode& node) const
+    {
+        float a = box_area(node.bbox);
+        if (node.left == 0)
+            return a * node.count;
+        return a * BVH_TRAVERSAL_COST + cost[node.left] + cost[node.right];
+    }
+
+    void refit_node(size_t i)
+    {
+        BVHNode& node = nodes[i];
+        if (node.left == 0) {
+            empty_box(node.bbox);
+            for (unsigned int k = node.first; k < node.first + node.count; k++) {
+                float b[6];
+                set_box(b, boxes[order[k]]);
+                grow_box(node.bbox, b);
+            }
+        }
+        else {
+            memcpy(node.bbox, nodes[node.left].bbox, sizeof(node.bbox));
+            grow_box(node.bbox, nodes[node.right].bbox);
+        }
+        cost[i] = node_cost(node);
+    }
+
+    /* costs of a freshly built subtree, which become its marks */
+    void subtree_cost(unsigned int i)
+    {
+        const BVHNode& node = nodes[i];
+        if (node.left != 0) {
+            subtree_cost(node.left);
+            subtree_cost(node.right);
+        }
+        cost[i] = built_cost[i] = node_cost(node);
+    }
+
+    struct Subtree
+    {
+        unsigned int node, first, count;
+        int depth;
+    };
+
+    /*
+     * Node i over order[first, first + count) by binned SAH, its new nodes
+     * taken from the end of the table.  A subtree has fewer than 2 * count
+     * nodes, so that much room is made first and the tasks can take nodes
+     * from it without a lock.
+     */
+    void build_subtree(unsigned int i, unsigned int first, unsigned int count, int depth)
+    {
+        nodes.resize((size_t)num_used + 2 * count);
+        std::vector<Subtree> deferred;
+        build_node(i, first, count, depth, pool ? &deferred : nullptr);
+        if (!deferred.empty())
+        {
+            /* the biggest first, for the load to even out */
+            std::sort(deferred.begin(), deferred.end(),
+                    [](const Subtree& a, const Subtree& b) { return a.count > b.count; });
+            pool->parallel_for(deferred.size(), [this, &deferred](size_t k) {
+                const Subtree& t = deferred[k];
+                build_node(t.node, t.first, t.count, t.depth, nullptr);
+            });
+        }
+        nodes.resize(num_used);
+        built_cost.resize(num_used);
+        cost.resize(num_used);
+        subtree_cost(i);
+    }
+
+    /*
+     * Binned SAH over order[first, first + count) into node i; children
+     * come after their parent.  With a deferred list, subtrees small enough
+     * to be one task are left in it rather than built.
+     */
+    void build_node(unsigned int i, unsigned int first, unsigned int count, int depth,
+            std::vector<Subtree> *deferred)
+    {
+        if (deferred && count <= BVH_PARALLEL_GRAIN) {
+            deferred->push_back({ i, first, count, depth });
+            return;
+        }
+
+        float box[6], cbox[6];
+        empty_box(box);
+        empty_box(cbox);
+        for (unsigned int k = first; k < first + count; k++)
+        {
+            float b[6];
+            set_box(b, boxes[order[k]]);
+            grow_box(box, b);
+            float c[6];
+            for (int a = 0; a < 3; a++)
+                c[a] = c[a + 3] = centroid(order[k], a);
+            grow_box(cbox, c);
+        }
+
+        int axis = -1;
+        int split = 0;
+        float best = (float)count;
+        if (count > BVH_LEAF_SIZE)
+            best = FLT_MAX;
+        if (count > 1 && depth < BVH_SAH_DEPTH)
+            find_split(count, [this, first](unsigned int k, float *b) { set_box(b, boxes[order[first + k]]); },
+                    [this, first](unsigned int k, int a) { return centroid(order[first + k], a); },
+                    box, cbox, axis, split, best);
+
+        unsigned int mid = first;
+        if (axis >= 0)
+        {
+            float c0 = cbox[axis], scale = BVH_BINS / (cbox[axis + 3] - cbox[axis]);
+            unsigned int *begin = &order[first], *end = begin + count;
+            mid = std::partition(begin, end, [&](unsigned int k) {
+                return bin(centroid(k, axis), c0, scale) < split;
+            }) - &order[0];
+        }
+        else if (count > BVH_LEAF_SIZE)
+        {
+            /* too deep, or all centroids in one place: halves, in no particular order */
+            mid = first + count / 2;
+        }
+
+        BVHNode& node = nodes[i];
+        memcpy(node.bbox, box, sizeof(box));
+        node.first = first;
+        node.count = count;
+        if (mid == first || mid == first + count) {
+            node.left = node.right = 0;
+            return;
+        }
+
+        unsigned int left = num_used.fetch_add(2);
+        node.left = left;
+        node.right = left + 1;
+        build_node(left, first, mid - first, depth + 1, deferred);
+        build_node(left + 1, mid, first + count - mid, depth + 1, deferred);
+    }
+
+    /* ------------------------------------------------------- compression */
+
+    /*
+     * One step of the codes along an axis of the decoded box d, a little
+     * over a 255th so that code 255 reaches past d's far side whatever the
+     * rounding.
+     */
+    static float step(const float *d, int a)
+    {
+        return (d[a + 3] - d[a]) * (1.00001f / 255.0f);
+    }
+
+    /*
+     * The box b in 255ths of the decoded box d, rounded outwards; q gets
+     * the six codes and b what they decode to.
+     */
+    static void quantize(const float *d, float *b, unsigned char *q)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            float scale = step(d, a);
+            int lo = 0, hi = 255;
+            if (scale > 0) {
+                lo = std::max(0, std::min(255, (int)floorf((b[a] - d[a]) / scale)));
+                hi = std::max(lo, std::min(255, (int)ceilf((b[a + 3] - d[a]) / scale)));
+                /* the division may have rounded the wrong way */
+                while (lo > 0 && d[a] + lo * scale > b[a])
+                    lo--;
+                while (hi < 255 && d[a] + hi * scale < b[a + 3])
+                    hi++;
+            }
+            q[a] = lo;
+            q[a + 3] = hi;
+            b[a] = d[a] + lo * scale;
+            b[a + 3] = d[a] + hi * scale;
+        }
+    }
+
+    /*
+     * Records for the interior nodes top-down, each child quantized against
+     * the box its parent decodes to, then the full nodes let go.  Leaves of
+     * more objects than a record counts stay uncompressed.
+     */
+    void compress(void)
+    {
+        for (const BVHNode& node: nodes)
+            if (node.left == 0 && node.count > 0xffff)
+                return;
+        memcpy(root_box, nodes[0].bbox, sizeof(root_box));
+        root_count = nodes[0].left == 0 ? nodes[0].count : 0;
+        qnodes.reserve((nodes.size() - num_garbage) / 2);
+        if (root_count == 0) {
+            qnodes.emplace_back();
+            compress_node(0, 0, root_box);
+        }
+        tracked_vector<BVHNode, MEM_ACCEL>().swap(nodes);
+        tracked_vector<float, MEM_ACCEL>().swap(built_cost);
+        tracked_vector<float, MEM_ACCEL>().swap(cost);
+        std::vector<BBox>().swap(boxes);
+    }
+
+    /* record q for the interior node i, whose box decodes to d */
+    void compress_node(unsigned int i, size_t q, const float *d)
+    {
+        const unsigned int child[2] = { nodes[i].left, nodes[i].right };
+        for (int c = 0; c < 2; c++)
+        {
+            const BVHNode& node = nodes[child[c]];
+            float b[6];
+            memcpy(b, node.bbox, sizeof(b));
+            quantize(d, b, qnodes[q].box[c]);
+            if (node.left == 0) {
+                qnodes[q].count[c] = node.count;
+                qnodes[q].child[c] = node.first;
+                continue;
+            }
+            size_t k = qnodes.size();
+            qnodes.emplace_back();
+            qnodes[q].count[c] = 0;
+            qnodes[q].child[c] = k;
+            compress_node(child[c], k, b);
+        }
+    }
+
+    bool packed(void) const
+    {
+        return qtree_size || root_count;
+    }
+
+    /* a sibling put off for later, with the box it decoded to */
+    struct QEntry
+    {
+        float box[6];
+        float tnear;
+        unsigned int child, count;
+    };
+
+    /*
+     * As hit(), over the records.  The node being visited has its box in
+     * locals; its children are decoded from it there, and only the farther
+     * of two that are both entered goes on the stack.
+     */
+    bool hit_compressed(const Ray& ray, float& tmin, ShadeRec& sr)
+    {
+        Vector3D inv(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+
+        bool hit = false;
+        float t;
+        Normal normal;
+        Point3D local_hit_point;
+        tmin = FLT_MAX;
+
+        QEntry stack[BVH_STACK_SIZE];
+        int top = 0;
+        float d[6];
+        memcpy(d, root_box, sizeof(d));
+        unsigned int child = 0, count = root_count;
+        if (!hit_box(d, ray, inv, tmin, t))
+            return false;
+        for (;;)
+        {
+            if (count)
+            {
+                for (unsigned int k = child; k < child + count; k++)
+                {
+                    Object *obj_ptr = object_ptrs[refs[k]];
+                    if (obj_ptr->hit(ray, t, sr) && (t < tmin))
+                    {
+                        hit = true;
+                        tmin = t;
+                        normal = sr.normal;
+                        material_id = obj_ptr->material_id;
+                        local_hit_point = sr.local_hit_point;
+                    }
+                }
+            }
+            else
+            {
+                const BVHQNode& q = qtree[child];
+                float b[2][6], tn[2];
+                bool h[2];
+                for (int a = 0; a < 3; a++)
+                {
+                    float scale = step(d, a);
+                    b[0][a] = d[a] + q.box[0][a] * scale;
+                    b[0][a + 3] = d[a] + q.box[0][a + 3] * scale;
+                    b[1][a] = d[a] + q.box[1][a] * scale;
+                    b[1][a + 3] = d[a] + q.box[1][a + 3] * scale;
+                }
+                h[0] = hit_box(b[0], ray, inv, tmin, tn[0]);
+                h[1] = hit_box(b[1], ray, inv, tmin, tn[1]);
+                if (h[0] && h[1]) {
+                    int near = tn[1] < tn[0], far = 1 - near;
+                    QEntry& e = stack[top++];
+                    memcpy(e.box, b[far], sizeof(e.box));
+                    e.tnear = tn[far];
+                    e.child = q.child[far];
+                    e.count = q.count[far];
+                    memcpy(d, b[near], sizeof(d));
+                    child = q.child[near];
+                    count = q.count[near];
+                    continue;
+                }
+                if (h[0] || h[1]) {
+                    int k = h[1];
+                    memcpy(d, b[k], sizeof(d));
+                    child = q.child[k];
+                    count = q.count[k];
+                    continue;
+                }
+            }
+
+            /* siblings that start behind the nearest hit so far are dropped */
+            while (top > 0 && stack[top - 1].tnear >= tmin)
+                top--;
+            if (top == 0)
+                break;
+            const QEntry& e = stack[--top];
+            memcpy(d, e.box, sizeof(d));
+            child = e.child;
+            count = e.count;
+        }
+
+        if (hit)
+        {
+            sr.t = tmin;
+            sr.normal = normal;
+            sr.local_hit_point = local_hit_point;
+        }
+        return hit;
+    }
+
+    /* ------------------------------------------------------- SBVH */
+
+    /* an object, or the part of it on one side of a spatial split */
+    struct Reference
+    {
+        float box[6];
+        unsigned int object;
+    };
+
+    void build_sbvh(void)
+    {
+        size_t n = object_ptrs.size();
+        std::vector<Reference> refs(n);
+        float root[6];
+        empty_box(root);
+        for (size_t k = 0; k < n; k++) {
+            set_box(refs[k].box, boxes[k]);
+            refs[k].object = k;
+            grow_box(root, refs[k].box);
+        }
+        root_area = box_area(root);
+        split_budget = (size_t)(n * BVH_SPLIT_BUDGET);
+        order.clear();
+        nodes.resize(1);
+        sbvh_node(0, refs, 0);
+        built_cost.resize(nodes.size());
+        cost.resize(nodes.size());
+        subtree_cost(0);
+    }
+
+    /*
+     * The part of a reference between lo and hi along an axis; false when
+     * there is none, which can happen once the reference has been clipped
+     * along another axis.
+     */
+    bool clip(const Reference& r, int axis, float lo, float hi, float *out)
+    {
+        BBox b = object_ptrs[r.object]->get_clipped_bounding_box(axis, lo, hi);
+        float c[6];
+        set_box(c, b);
+        for (int a = 0; a < 3; a++) {
+            out[a] = std::max(r.box[a], c[a]);
+            out[a + 3] = std::min(r.box[a + 3], c[a + 3]);
+            if (out[a] > out[a + 3])
+                return false;
+        }
+        return true;
+    }
+
+    static float ref_centroid(const Reference& r, int axis)
+    {
+        return 0.5f * (r.box[axis] + r.box[axis + 3]);
+    }
+
+    /* the cheapest cut at a bin boundary of the node's box, if cheaper than best */
+    void find_spatial_split(const std::vector<Reference>& refs, const float *box,
+            int& axis, float& plane, float& best)
+    {
+        float parent_area = box_area(box);
+        for (int a = 0; a < 3; a++)
+        {
+            float extent = box[a + 3] - box[a];
+            if (extent <= 0)
+                continue;
+            float width = extent / BVH_BINS;
+            float bounds[BVH_BINS][6];
+            int entries[BVH_BINS] = {}, exits[BVH_BINS] = {};
+            for (int b = 0; b < BVH_BINS; b++)
+                empty_box(bounds[b]);
+            for (const Reference& r: refs)
+            {
+                int b0 = std::max(0, std::min(BVH_BINS - 1, (int)((r.box[a] - box[a]) / width)));
+                int b1 = std::max(b0, std::min(BVH_BINS - 1, (int)((r.box[a + 3] - box[a]) / width)));
+                entries[b0]++;
+                exits[b1]++;
+                if (b0 == b1) {
+                    grow_box(bounds[b0], r.box);
+                    continue;
+                }
+                for (int b = b0; b <= b1; b++)
+                {
+                    float lo = box[a] + b * width;
+                    float hi = b == BVH_BINS - 1 ? box[a + 3] : lo + width;
+                    float piece[6];
+                    if (clip(r, a, lo, hi, piece))
+                        grow_box(bounds[b], piece);
+                }
+            }
+
+            float right_area[BVH_BINS];
+            int right_count[BVH_BINS];
+            float acc[6];
+            empty_box(acc);
+            int n = 0;
+            for (int b = BVH_BINS - 1; b > 0; b--)
+            {
+                grow_box(acc, bounds[b]);
+                n += exits[b];
+                right_area[b] = n ? box_area(acc) : 0;
+                right_count[b] = n;
+            }
+            empty_box(acc);
+            n = 0;
+            for (int b = 0; b < BVH_BINS - 1; b++)
+            {
+                grow_box(acc, bounds[b]);
+                n += entries[b];
+                if (n == 0 || right_count[b + 1] == 0)
+                    continue;
+                float c = BVH_TRAVERSAL_COST + (box_area(acc) * n
+                        + right_area[b + 1] * right_count[b + 1]) / parent_area;
+                if (c < best) {
+                    best = c;
+                    axis = a;
+                    plane = box[a] + (b + 1) * width;
+                }
+            }
+        }
+    }
+
+    /* node i over refs, which it uses up; leaves append to order[] */
+    void sbvh_node(unsigned int i, std::vector<Reference>& refs, int depth)
+    {
+        unsigned int count = refs.size();
+        float box[6], cbox[6];
+        empty_box(box);
+        empty_box(cbox);
+        for (const Reference& r: refs)
+        {
+            grow_box(box, r.box);
+            float c[6];
+            for (int a = 0; a < 3; a++)
+                c[a] = c[a + 3] = ref_centroid(r, a);
+            grow_box(cbox, c);
+        }
+        memcpy(nodes[i].bbox, box, sizeof(box));
+        nodes[i].first = order.size();
+
+        int axis = -1, split = 0, spatial_axis = -1;
+        float plane = 0, overlap = 0;
+        float best = count > BVH_LEAF_SIZE ? FLT_MAX : (float)count;
+        if (count > 1 && depth < BVH_SAH_DEPTH)
+        {
+            find_split(count, [&refs](unsigned int k, float *b) { memcpy(b, refs[k].box, 6 * sizeof(float)); },
+                    [&refs](unsigned int k, int a) { return ref_centroid(refs[k], a); },
+                    box, cbox, axis, split, best, &overlap);
+            /* no object split at all is worth a try too, unless a leaf will do */
+            bool stuck = axis < 0 && count > BVH_LEAF_SIZE;
+            if (split_budget > 0 && (stuck || overlap > BVH_SPLIT_ALPHA * root_area))
+                find_spatial_split(refs, box, spatial_axis, plane, best);
+        }
+
+        std::vector<Reference> left, right;
+        if (spatial_axis >= 0)
+        {
+            int a = spatial_axis;
+            for (const Reference& r: refs)
+            {
+                if (r.box[a + 3] <= plane)
+                    left.push_back(r);
+                else if (r.box[a] >= plane)
+                    right.push_back(r);
+                else if (split_budget > 0) {
+                    Reference l = r, h = r;
+                    bool in_left = clip(r, a, r.box[a], plane, l.box);
+                    bool in_right = clip(r, a, plane, r.box[a + 3], h.box);
+                    if (in_left || !in_right)
+                        left.push_back(in_right ? l : r);
+                    if (in_right)
+                        right.push_back(in_left ? h : r);
+                    if (in_left && in_right)
+                        split_budget--;
+                }
+                else if (ref_centroid(r, a) < plane)
+                    left.push_back(r);
+                else
+                    right.push_back(r);
+            }
+        }
+        else if (axis >= 0)
+        {
+            float c0 = cbox[axis], scale = BVH_BINS / (cbox[axis + 3] - cbox[axis]);
+            for (const Reference& r: refs)
+                (bin(ref_centroid(r, axis), c0, scale) < split ? left : right).push_back(r);
+        }
+        else if (count > BVH_LEAF_SIZE)
+        {
+            left.assign(refs.begin(), refs.begin() + count / 2);
+            right.assign(refs.begin() + count / 2, refs.end());
+        }
+
+        if (left.empty() || right.empty())
+        {
+            for (const Reference& r: refs)
+                order.push_back(r.object);
+            nodes[i].left = nodes[i].right = 0;
+            nodes[i].count = count;
+            return;
+        }
+        std::vector<Reference>().swap(refs);
+
+        unsigned int l = nodes.size();
+        nodes.resize(l + 2);
+        nodes[i].left = l;
+        nodes[i].right = l + 1;
+        sbvh_node(l, left, depth + 1);
+        sbvh_node(l + 1, right, depth + 1);
+        nodes[i].count = order.size() - nodes[i].first;
+    }
+
+    /* ------------------------------------------------------- LBVH */
+
+    /* common leading bits of two keys; the index in the low half makes keys unique */
+    static int delta(const std::vector<unsigned long long>& keys, long long i, long long j)
+    {
+        if (j < 0 || j >= (long long)keys.size())
+            return -1;
+        return __builtin_clzll(keys[i] ^ keys[j]);
+    }
+
+    void build_lbvh(void)
+    {
+        size_t n = object_ptrs.size();
+        float cbox[6];
+        empty_box(cbox);
+        for (size_t k = 0; k < n; k++)
+        {
+            float c[6];
+            for (int a = 0; a < 3; a++)
+                c[a] = c[a + 3] = centroid(k, a);
+            grow_box(cbox, c);
+        }
+
+        /* Morton code above, object index below */
+        std::vector<unsigned long long> keys(n);
+        size_t chunks = num_chunks(n);
+        for_each(chunks, [&](size_t c) {
+            float extent = std::max(std::max(cbox[3] - cbox[0], cbox[4] - cbox[1]), cbox[5] - cbox[2]);
+            float scale = morton_scale(extent);
+            size_t lo, hi;
+            chunk(c, chunks, n, lo, hi);
+            for (size_t k = lo; k < hi; k++)
+            {
+                float p[3] = { centroid(k, 0), centroid(k, 1), centroid(k, 2) };
+                keys[k] = (unsigned long long)morton_code(p, cbox, scale) << 32 | k;
+            }
+        });
+
+        /* sorted in chunks, then merged pairwise */
+        for_each(chunks, [&](size_t c) {
+            size_t lo, hi;
+            chunk(c, chunks, n, lo, hi);
+            std::sort(keys.begin() + lo, keys.begin() + hi);
+        });
+        std::vector<size_t> bounds(chunks + 1);
+        for (size_t c = 0; c <= chunks; c++)
+            bounds[c] = n * c / chunks;
+        for (size_t width = 1; width < chunks; width *= 2)
+        {
+            size_t pairs = (chunks + 2 * width - 1) / (2 * width);
+            for_each(pairs, [&](size_t p) {
+                size_t a = 2 * p * width;
+                size_t m = std::min(a + width, chunks), b = std::min(a + 2 * width, chunks);
+                std::inplace_merge(keys.begin() + bounds[a], keys.begin() + bounds[m], keys.begin() + bounds[b]);
+            });
+        }
+        for (size_t k = 0; k < n; k++)
+            order[k] = (unsigned int)keys[k];
+
+        /* internal nodes 0 .. n - 2, then the leaves, one object each */
+        nodes.resize(2 * n - 1);
+        size_t leaves = n - 1;
+        for_each(chunks, [&](size_t c) {
+            size_t lo, hi;
+            chunk(c, chunks, n, lo, hi);
+            for (size_t k = lo; k < hi; k++) {
+                BVHNode& leaf = nodes[leaves + k];
+                leaf.left = leaf.right = 0;
+                leaf.first = k;
+                leaf.count = 1;
+            }
+            for (size_t k = lo; k < std::min(hi, n - 1); k++)
+                lbvh_node(keys, k);
+        });
+
+        /* depth-first, small subtrees folded into leaves, then the boxes */
+        cost.resize(nodes.size());
+        built_cost.resize(nodes.size());
+        compact(true);
+        for (size_t i = nodes.size(); i-- > 0; )
+            refit_node(i);
+        subtree_cost(0);
+    }
+
+    /* the range and the children of internal node i, from the sorted keys alone */
+    void lbvh_node(const std::vector<unsigned long long>& keys, long long i)
+    {
+        long long n = keys.size();
+        int d = delta(keys, i, i + 1) > delta(keys, i, i - 1) ? 1 : -1;
+        int delta_min = delta(keys, i, i - d);
+        long long lmax = 2;
+        while (delta(keys, i, i + lmax * d) > delta_min)
+            lmax *= 2;
+        long long l = 0;
+        for (long long t = lmax / 2; t >= 1; t /= 2)
+            if (delta(keys, i, i + (l + t) * d) > delta_min)
+                l += t;
+        long long j = i + l * d;
+
+        int delta_node = delta(keys, i, j);
+        long long s = 0, t = l;
+        do {
+            t = (t + 1) / 2;
+            if (delta(keys, i, i + (s + t) * d) > delta_node)
+                s += t;
+        } while (t > 1);
+        long long gamma = i + s * d + std::min(d, 0);
+
+        BVHNode& node = nodes[i];
+        long long lo = std::min(i, j), hi = std::max(i, j);
+        node.first = lo;
+        node.count = hi - lo + 1;
+        node.left = lo == gamma ? n - 1 + gamma : gamma;
+        node.right = hi == gamma + 1 ? n - 1 + gamma + 1 : gamma + 1;
+    }
+
+    static int bin(float c, float c0, float scale)
+    {
+        return std::min(BVH_BINS - 1, (int)((c - c0) * scale));
+    }
+
+    /*
+     * The cheapest bin boundary on any axis, if cheaper than best.  Item k
+     * of count has its box from box_of(k, b) and its centroid along an axis
+     * from centroid_of(k, axis).  overlap, if given, gets the area the two
+     * sides of the chosen split have in common.
+     */
+    template <typename BoxOf, typename CentroidOf>
+    static void find_split(unsigned int count, BoxOf box_of, CentroidOf centroid_of,
+            const float *box, const float *cbox, int& axis, int& split, float& best, float *overlap = nullptr)
+    {
+        float parent_area = box_area(box);
+        for (int a = 0; a < 3; a++)
+        {
+            float extent = cbox[a + 3] - cbox[a];
+            if (extent <= 0)
+                continue;
+            float scale = BVH_BINS / extent;
+            float bounds[BVH_BINS][6];
+            int counts[BVH_BINS] = {};
+            for (int b = 0; b < BVH_BINS; b++)
+                empty_box(bounds[b]);
+            for (unsigned int k = 0; k < count; k++)
+            {
+                int b = bin(centroid_of(k, a), cbox[a], scale);
+                float ob[6];
+                box_of(k, ob);
+                grow_box(bounds[b], ob);
+                counts[b]++;
+            }
+
+            /* sweep from the right, then from the left */
+            float right_box[BVH_BINS][6];
+            int right_count[BVH_BINS];
+            float acc[6];
+            empty_box(acc);
+            int n = 0;
+            for (int b = BVH_BINS - 1; b > 0; b--)
+            {
+                grow_box(acc, bounds[b]);
+                n += counts[b];
+                memcpy(right_box[b], acc, sizeof(acc));
+                right_count[b] = n;
+            }
+            empty_box(acc);
+            n = 0;
+            for (int b = 0; b < BVH_BINS - 1; b++)
+            {
+                grow_box(acc, bounds[b]);
+                n += counts[b];
+                if (n == 0 || right_count[b + 1] == 0)
+                    continue;
+                float c = BVH_TRAVERSAL_COST + (box_area(acc) * n
+                        + box_area(right_box[b + 1]) * right_count[b + 1]) / parent_area;
+                if (c < best) {
+                    best = c;
+                    axis = a;
+                    split = b + 1;
+                    if (overlap)
+                        *overlap = overlap_area(acc, right_box[b + 1]);
+                }
+            }
+        }
+    }
+
+    static float overlap_area(const float *p, const float *q)
+    {
+        float o[6];
+        for (int a = 0; a < 3; a++) {
+            o[a] = std::max(p[a], q[a]);
+            o[a + 3] = std::min(p[a + 3], q[a + 3]);
+            if (o[a] > o[a + 3])
+                return 0;
+        }
+        return box_area(o);
+    }
+
+    /*
+     * Top-down from node i: the highest nodes whose cost grew past the
+     * threshold are rebuilt, the rest is searched further down.  Costs on
+     * the way back up take in the rebuilt parts.
+     */
+    int rebuild_degraded(unsigned int i, int depth, float threshold)
+    {
+        const BVHNode& node = nodes[i];
+        if (node.left == 0)
+            return 0;
+        if (cost[i] > threshold * built_cost[i])
+        {
+            if (i == 0) {
+                build();
+                return 1;
+            }
+            num_garbage += subtree_size(i) - 1;
+            unsigned int first = node.first, count = node.count;
+            num_used = nodes.size();
+            build_subtree(i, first, count, depth);
+            return 1;
+        }
+        unsigned int l = node.left, r = node.right;
+        int rebuilt = rebuild_degraded(l, depth + 1, threshold) + rebuild_degraded(r, depth + 1, threshold);
+        if (rebuilt)
+            cost[i] = node_cost(nodes[i]);
+        return rebuilt;
+    }
+
+    /*
+     * The live nodes copied out in depth-first order, children after
+     * parents; folded, subtrees of up to BVH_LEAF_SIZE objects become leaves.
+     */
+    void compact(bool fold = false)
+    {
+        tracked_vector<BVHNode, MEM_ACCEL> live;
+        tracked_vector<float, MEM_ACCEL> live_built, live_cost;
+        live.reserve(nodes.size() - num_garbage);
+        live_built.reserve(live.capacity());
+        live_cost.reserve(live.capacity());
+        copy_node(0, live, live_built, live_cost, fold);
+        nodes.swap(live);
+        built_cost.swap(live_built);
+        cost.swap(live_cost);
+        num_garbage = 0;
+    }
+
+    unsigned int copy_node(unsigned int i, tracked_vector<BVHNode, MEM_ACCEL>& live,
+            tracked_vector<float, MEM_ACCEL>& live_built, tracked_vector<float, MEM_ACCEL>& live_cost,
+            bool fold) const
+    {
+        unsigned int k = live.size();
+        live.push_back(nodes[i]);
+        live_built.push_back(built_cost[i]);
+        live_cost.push_back(cost[i]);
+        if (fold && nodes[i].count <= BVH_LEAF_SIZE)
+            live[k].left = live[k].right = 0;
+        else if (nodes[i].left != 0) {
+            unsigned int l = copy_node(nodes[i].left, live, live_built, live_cost, fold);
+            unsigned int r = copy_node(nodes[i].right, live, live_built, live_cost, fold);
+            live[k].left = l;
+            live[k].right = r;
+        }
+        return k;
+    }
+
+    size_t subtree_size(unsigned int i) const
+    {
+        const BVHNode& node = nodes[i];
+        if (node.left == 0)
+            return 1;
+        return 1 + subtree_size(node.left) + subtree_size(node.right);
+    }
+};
+
+#endif // _BVH_H
@@ -0,0 +1,211 @@
+/* ====================================================
+#   File Name     : BoxTree.h
+# ====================================================*/
+
+#ifndef _BOX_TREE_H
+#define _BOX_TREE_H
+
+#include "../Utilities.h"
+
+#include <cfloat>
+#include <algorithm>
+
+/* boxes are six floats, the low corner then the high one */
+
+inline void
+empty_box(float *b)
+{
+    b[0] = b[1] = b[2] = FLT_MAX;
+    b[3] = b[4] = b[5] = -FLT_MAX;
+}
+
+inline void
+grow_box(float *b, const float *c)
+{
+    for (int a = 0; a < 3; a++) {
+        b[a] = std::min(b[a], c[a]);
+        b[a + 3] = std::max(b[a + 3], c[a + 3]);
+    }
+}
+
+inline float
+box_area(const float *b)
+{
+    float dx = b[3] - b[0], dy = b[4] - b[1], dz = b[5] - b[2];
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+/* the slab test, for a box entered before tmax; tnear is where it is */
+inline bool
+hit_box(const float *b, const Ray& ray, const Vector3D& inv, float tmax, float& tnear)
+{
+    float tx0 = (b[0] - ray.o.x) * inv.x, tx1 = (b[3] - ray.o.x) * inv.x;
+    float ty0 = (b[1] - ray.o.y) * inv.y, ty1 = (b[4] - ray.o.y) * inv.y;
+    float tz0 = (b[2] - ray.o.z) * inv.z, tz1 = (b[5] - ray.o.z) * inv.z;
+    float t0 = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::min(tz0, tz1));
+    float t1 = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1));
+    tnear = t0;
+    return t0 <= t1 && t1 > 0 && t0 < tmax;
+}
+
+const int BOX_TREE_BINS = 16;
+/* deeper than this, nodes are split in halves, which bounds the depth at twice it */
+const int BOX_TREE_SAH_DEPTH = 32;
+const int BOX_TREE_STACK_SIZE = 2 * BOX_TREE_SAH_DEPTH;
+
+/*
+ * A node of a tree over primitives that an object keeps itself, in
+ * depth-first order so that an interior node's first child is the node
+ * after it.  count is 0 for an interior node, whose second child is at
+ * offset; a leaf holds the primitives offset .. offset + count - 1.
+ */
+struct BoxNode
+{
+    float bbox[6];
+    unsigned int offset, count;
+};
+
+/* the centroids' bin along an axis of cbox */
+inline int
+box_tree_bin(float c, const float *cbox, int axis)
+{
+    float extent = cbox[axis + 3] - cbox[axis];
+    int b = (int)((c - cbox[axis]) / extent * BOX_TREE_BINS);
+    return std::min(std::max(b, 0), BOX_TREE_BINS - 1);
+}
+
+/*
+ * Binned SAH over primitives first .. first + n - 1, whose box and
+ * centroids' box are known, appending the node and then its subtrees to
+ * nodes.  The bins give the children their boxes too, so each level reads
+ * the primitives twice: once to bin them, once to partition them.  prims
+ * holds the primitives in place and has
+ *
+ *   add(k, box, cbox)    primitive k's box into box, its centroid into cbox
+ *   centroid(k, axis)    one coordinate of that centroid
+ *   swap(i, j)           primitives i and j trade places
+ */
+template <typename Nodes, typename Prims>
+unsigned int
+build_box_tree(Nodes& nodes, Prims& prims, size_t first, size_t n, const float *box, const float *cbox,
+        unsigned int leaf_size, int depth)
+{
+    unsigned int index = nodes.size();
+    nodes.emplace_back();
+    std::copy(box, box + 6, nodes[index].bbox);
+    if (n <= leaf_size) {
+        nodes[index].offset = first;
+        nodes[index].count = n;
+        return index;
+    }
+
+    struct Bin { float box[6], cbox[6]; size_t n; };
+    int axis = -1, split = 0;
+    float best = FLT_MAX;
+    Bin bins[3][BOX_TREE_BINS];
+    if (depth < BOX_TREE_SAH_DEPTH)
+    {
+        for (int a = 0; a < 3; a++)
+            for (Bin& b: bins[a]) {
+                empty_box(b.box);
+                empty_box(b.cbox);
+                b.n = 0;
+            }
+        for (size_t k = first; k < first + n; k++)
+            for (int a = 0; a < 3; a++)
+            {
+                if (cbox[a + 3] <= cbox[a])
+                    continue;
+                Bin& b = bins[a][box_tree_bin(prims.centroid(k, a), cbox, a)];
+                prims.add(k, b.box, b.cbox);
+                b.n++;
+            }
+
+        /* cost of each split: boxes swept in from the right, then from the left */
+        for (int a = 0; a < 3; a++)
+        {
+            if (cbox[a + 3] <= cbox[a])
+                continue;
+            float right_area[BOX_TREE_BINS];
+            size_t right_n[BOX_TREE_BINS];
+            float acc[6];
+            size_t acc_n = 0;
+            empty_box(acc);
+            for (int s = BOX_TREE_BINS - 1; s > 0; s--) {
+                grow_box(acc, bins[a][s].box);
+                acc_n += bins[a][s].n;
+                right_area[s] = box_area(acc);
+                right_n[s] = acc_n;
+            }
+            empty_box(acc);
+            acc_n = 0;
+            for (int s = 1; s < BOX_TREE_BINS; s++)
+            {
+                grow_box(acc, bins[a][s - 1].box);
+                acc_n += bins[a][s - 1].n;
+                if (acc_n == 0 || right_n[s] == 0)
+                    continue;
+                float cost = box_area(acc) * acc_n + right_area[s] * right_n[s];
+                if (cost < best) {
+                    best = cost;
+                    axis = a;
+                    split = s;
+                }
+            }
+        }
+    }
+
+    size_t mid;
+    float lbox[6], lcbox[6], rbox[6], rcbox[6];
+    empty_box(lbox); empty_box(lcbox);
+    empty_box(rbox); empty_box(rcbox);
+    if (axis >= 0)
+    {
+        /* the primitives of the left bins to the front */
+        size_t i = first, j = first + n;
+        while (i < j)
+        {
+            if (box_tree_bin(prims.centroid(i, axis), cbox, axis) < split)
+                i++;
+            else
+                prims.swap(i, --j);
+        }
+        mid = i;
+        for (int s = 0; s < BOX_TREE_BINS; s++) {
+            grow_box(s < split ? lbox : rbox, bins[axis][s].box);
+            grow_box(s < split ? lcbox : rcbox, bins[axis][s].cbox);
+        }
+    }
+    else
+    {
+        /* every centroid in one place, or too deep: halves as they are */
+        mid = first + n / 2;
+        for (size_t k = first; k < mid; k++)
+            prims.add(k, lbox, lcbox);
+        for (size_t k = mid; k < first + n; k++)
+            prims.add(k, rbox, rcbox);
+    }
+
+    build_box_tree(nodes, prims, first, mid - first, lbox, lcbox, leaf_size, depth + 1);
+    unsigned int right = build_box_tree(nodes, prims, mid, first + n - mid, rbox, rcbox, leaf_size, depth + 1);
+    nodes[index].offset = right;
+    nodes[index].count = 0;
+    return index;
+}
+
+/* the whole tree over primitives 0 .. n - 1, none if there are none */
+template <typename Nodes, typename Prims>
+void
+build_box_tree(Nodes& nodes, Prims& prims, size_t n, unsigned int leaf_size)
+{
+    if (n == 0)
+        return;
+    float box[6], cbox[6];
+    empty_box(box);
+    empty_box(cbox);
+    for (size_t k = 0; k < n; k++)
+        prims.add(k, box, cbox);
+    build_box_tree(nodes, prims, 0, n, box, cbox, leaf_size, 0);
+}
+
+#endif // _BOX_TREE_H
@@ -0,0 +1,651 @@
+/* ====================================================
+#   File Name     : CompactMesh.h
+# ====================================================*/
+
+#ifndef _COMPACT_MESH_H
+#define _COMPACT_MESH_H
+
+#include "BBox.h"
+#include "Object.h"
+#include "BoxTree.h"
+#include "../MemoryStats.h"
+
+#include <cmath>
+#include <cfloat>
+#include <climits>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+/* triangles per cluster at most; a cluster is a leaf of the mesh's tree */
+const unsigned int CLUSTER_SIZE = 16;
+/* the finest lattice positions are snapped to has this many steps across the mesh */
+const int CLUSTER_LATTICE_BITS = 30;
+
+/*
+ * Up to CLUSTER_SIZE triangles that are near each other, with their own
+ * copy of the vertices they use.  A vertex is 16 bits per axis counted
+ * from base in steps of 2^level of the mesh's lattice, and a triangle
+ * names its corners by 8 bits each among the cluster's vertices.
+ */
+struct MeshCluster
+{
+    int base[3];
+    unsigned int first_vertex;
+    unsigned int first_triangle;
+    unsigned char num_vertices;
+    unsigned char num_triangles;
+    unsigned char level;
+    unsigned char reserved;
+};
+
+/* a built mesh as it is stored in a scene snapshot, each array a run of its table */
+struct CompactRecord
+{
+    float lo[3];
+    float step;
+    unsigned long long first_node, num_nodes;
+    unsigned long long first_cluster, num_clusters;
+    unsigned long long first_position, num_positions;
+    unsigned long long first_corner, num_corners;
+};
+
+/*
+ * A triangle mesh stored compressed, as one object, for meshes whose
+ * MeshTriangles and accelerator would not fit: about 20 bytes a triangle
+ * against well over a hundred.  Positions are quantized relative to the
+ * bounds of their cluster and the intersector decodes a cluster's
+ * vertices when a ray reaches it.  The normal is the face normal of the
+ * decoded triangle, not a stored one: the diffuse BRDF samples directions
+ * in the surface's plane, so a normal even slightly off the plane that is
+ * traced shifts the image.
+ *
+ * Every cluster's step is a power of two times one lattice over the whole
+ * mesh, and a vertex shared by clusters is snapped to the coarsest of
+ * their steps, so every cluster decodes it to the same point and the
+ * quantization opens no cracks between clusters.
+ */
+class CompactMesh: public Object
+{
+public:
+    CompactMesh(void):
+        nodes(),
+        clusters(),
+        positions(),
+        corners(),
+        tree(nullptr),
+        cluster_table(nullptr),
+        position_table(nullptr),
+        corner_table(nullptr),
+        tree_size(0),
+        cluster_count(0),
+        position_count(0),
+        corner_count(0),
+        step(1)
+    {
+        lo[0] = lo[1] = lo[2] = 0;
+    }
+
+    size_t num_triangles(void) const
+    {
+        return corner_count / 3;
+    }
+
+    size_t bytes(void) const
+    {
+        return nodes.capacity() * sizeof(BoxNode) + clusters.capacity() * sizeof(MeshCluster)
+            + positions.capacity() * sizeof(unsigned short) + corners.capacity();
+    }
+
+    /* from a mesh's vertices and index triples, which it does not keep */
+    void build(const Point3D *points, int num_vertices, const int *indices, int num_triangles)
+    {
+        tracked_vector<BoxNode, MEM_ACCEL>().swap(nodes);
+        use_vectors();
+        if (num_triangles == 0)
+            return;
+
+        /* the tree over the triangles' centroids, leaves of up to CLUSTER_SIZE */
+        std::vector<unsigned int> order(num_triangles);
+        std::vector<float> centroids((size_t)num_triangles * 3);
+        std::vector<float> boxes((size_t)num_triangles * 6);
+        for (int t = 0; t < num_triangles; t++)
+        {
+            order[t] = t;
+            float *b = &boxes[(size_t)t * 6];
+            empty_box(b);
+            for (int k = 0; k < 3; k++)
+            {
+                const Point3D& v = points[indices[t * 3 + k]];
+                float p[6] = { v.x, v.y, v.z, v.x, v.y, v.z };
+                grow_box(b, p);
+            }
+            float *c = &centroids[(size_t)t * 3];
+            for (int a = 0; a < 3; a++)
+                c[a] = 0.5f * (b[a] + b[a + 3]);
+        }
+        nodes.reserve(num_triangles / (CLUSTER_SIZE / 4) + 1);
+        Triangles triangles = { order, centroids, boxes };
+        build_box_tree(nodes, triangles, num_triangles, CLUSTER_SIZE);
+        std::vector<float>().swap(centroids);
+        std::vector<float>().swap(boxes);
+
+        quantize(points, num_vertices, indices, order);
+        nodes.shrink_to_fit();
+        use_vectors();
+    }
+
+    /* adopt a mesh built earlier, e.g. one of a mapped snapshot */
+    void use_arrays(const CompactRecord& r, const BoxNode *nodes_, const MeshCluster *clusters_,
+            const unsigned short *positions_, const unsigned char *corners_)
+    {
+        tracked_vector<BoxNode, MEM_ACCEL>().swap(nodes);
+        tracked_vector<MeshCluster, MEM_MESHES>().swap(clusters);
+        tracked_vector<unsigned short, MEM_MESHES>().swap(positions);
+        tracked_vector<unsigned char, MEM_MESHES>().swap(corners);
+        std::copy(r.lo, r.lo + 3, lo);
+        step = r.step;
+        tree = nodes_;
+        cluster_table = clusters_;
+        position_table = positions_;
+        corner_table = corners_;
+        tree_size = r.num_nodes;
+        cluster_count = r.num_clusters;
+        position_count = r.num_positions;
+        corner_count = r.num_corners;
+    }
+
+    void save(CompactRecord& r) const
+    {
+        memset(&r, 0, sizeof(r));
+        std::copy(lo, lo + 3, r.lo);
+        r.step = step;
+        r.num_nodes = tree_size;
+        r.num_clusters = cluster_count;
+        r.num_positions = position_count;
+        r.num_corners = corner_count;
+    }
+
+    bool save(ObjectRecord& r) const
+    {
+        r.kind = OBJECT_COMPACT_MESH;
+        return true;
+    }
+
+    const BoxNode* get_nodes(void) const
+    {
+        return tree;
+    }
+
+    const MeshCluster* get_clusters(void) const
+    {
+        return cluster_table;
+    }
+
+    const unsigned short* get_positions(void) const
+    {
+        return position_table;
+    }
+
+    const unsigned char* get_corners(void) const
+    {
+        return corner_table;
+    }
+
+    bool hit(const Ray& ray, float& tmin, ShadeRec& sr)
+    {
+        if (tree_size == 0)
+            return false;
+        Vector3D inv(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+
+        float t;
+        tmin = FLT_MAX;
+        size_t best = num_triangles();
+        Point3D best_v[3];
+        Point3D v[3 * CLUSTER_SIZE];
+        unsigned int stack[BOX_TREE_STACK_SIZE];
+        int top = 0;
+        unsigned int i = 0;
+        if (!hit_box(tree[0].bbox, ray, inv, tmin, t))
+            return false;
+        for (;;)
+        {
+            const BoxNode& node = tree[i];
+            if (node.count)
+            {
+                const MeshCluster& c = cluster_table[node.offset];
+                const unsigned short *q = position_table + (size_t)c.first_vertex * 3;
+                for (unsigned int k = 0; k < c.num_vertices; k++)
+                    v[k] = decode(c, q + k * 3);
+                const unsigned char *corner = corner_table + (size_t)c.first_triangle * 3;
+                for (unsigned int k = 0; k < c.num_triangles; k++, corner += 3)
+                    if (hit_triangle(ray, v[corner[0]], v[corner[1]], v[corner[2]], t) && t < tmin) {
+                        tmin = t;
+                        best = c.first_triangle + k;
+                        for (int j = 0; j < 3; j++)
+                            best_v[j] = v[corner[j]];
+                    }
+            }
+            else
+            {
+                /* nearer child first, the other one saved for later */
+                float tl, tr;
+                bool l = hit_box(tree[i + 1].bbox, ray, inv, tmin, tl);
+                bool r = hit_box(tree[node.offset].bbox, ray, inv, tmin, tr);
+                if (l && r) {
+                    bool left_first = tl <= tr;
+                    stack[top++] = left_first ? node.offset : i + 1;
+                    i = left_first ? i + 1 : node.offset;
+                    continue;
+                }
+                if (l || r) {
+                    i = l ? i + 1 : node.offset;
+                    continue;
+                }
+            }
+            if (top == 0)
+                break;
+            i = stack[--top];
+        }
+
+        if (best == num_triangles())
+            return false;
+        sr.normal = (best_v[1] - best_v[0]) ^ (best_v[2] - best_v[0]);
+        sr.normal.normalize();
+        sr.local_hit_point = ray.o + ray.d * tmin;
+        return true;
+    }
+
+    bool shadow_hit(const Ray& ray, float& tmin)
+    {
+        ShadeRec sr;
+        return hit(ray, tmin, sr);
+    }
+
+    BBox get_bounding_box(void)
+    {
+        if (tree_size == 0)
+            return BBox(0, 0, 0, 0, 0, 0);
+        const float *b = tree[0].bbox;
+        return BBox(b[0], b[1], b[2], b[3], b[4], b[5]);
+    }
+
+    /*
+     * Cut into subtrees of at most max_triangles, each handed to f as a
+     * CompactMesh of its own on the same lattice, so the pieces decode
+     * every vertex exactly as the whole does and open no cracks between
+     * them.  top gets the nodes above the cut in the same depth-first
+     * order; a leaf of it has count 1 and the offset f returned for its
+     * piece.
+     */
+    template <typename F>
+    void split(size_t max_triangles, std::vector<BoxNode>& top, F f) const
+    {
+        top.clear();
+        if (!nodes.empty())
+            split_node(0, max_triangles, top, f);
+    }
+
+    /* everything it holds as one block of bytes, and back */
+    size_t packed_size(void) const
+    {
+        return sizeof(PackedHeader) + nodes.size() * sizeof(BoxNode) + clusters.size() * sizeof(MeshCluster)
+            + positions.size() * sizeof(unsigned short) + corners.size();
+    }
+
+    void pack(char *out) const
+    {
+        PackedHeader h = { { lo[0], lo[1], lo[2] }, step,
+            { nodes.size(), clusters.size(), positions.size(), corners.size() } };
+        memcpy(out, &h, sizeof(h));
+        out += sizeof(h);
+        out = pack_array(out, nodes);
+        out = pack_array(out, clusters);
+        out = pack_array(out, positions);
+        pack_array(out, corners);
+    }
+
+    bool unpack(const char *in, size_t size)
+    {
+        PackedHeader h;
+        if (size < sizeof(h))
+            return false;
+        memcpy(&h, in, sizeof(h));
+        if (size != sizeof(h) + h.counts[0] * sizeof(BoxNode) + h.counts[1] * sizeof(MeshCluster)
+                + h.counts[2] * sizeof(unsigned short) + h.counts[3])
+            return false;
+        std::copy(h.lo, h.lo + 3, lo);
+        step = h.step;
+        in += sizeof(h);
+        in = unpack_array(in, h.counts[0], nodes);
+        in = unpack_array(in, h.counts[1], clusters);
+        in = unpack_array(in, h.counts[2], positions);
+        unpack_array(in, h.counts[3], corners);
+        use_vectors();
+        return true;
+    }
+
+private:
+    CompactMesh(const CompactMesh&);
+    CompactMesh& operator = (const CompactMesh&);
+
+    struct PackedHeader
+    {
+        float lo[3];
+        float step;
+        unsigned long long counts[4];
+    };
+
+    template <typename V>
+    static char* pack_array(char *out, const V& v)
+    {
+        size_t size = v.size() * sizeof(v[0]);
+        if (size)
+            memcpy(out, v.data(), size);
+        return out + size;
+    }
+
+    template <typename V>
+    static const char* unpack_array(const char *in, size_t count, V& v)
+    {
+        v.resize(count);
+        v.shrink_to_fit();
+        size_t size = count * sizeof(v[0]);
+        if (size)
+            memcpy(v.data(), in, size);
+        return in + size;
+    }
+
+    /* the first node past the subtree at i, which is its last leaf's successor */
+    unsigned int subtree_end(unsigned int i) const
+    {
+        while (nodes[i].count == 0)
+            i = nodes[i].offset;
+        return i + 1;
+    }
+
+    template <typename F>
+    void split_node(unsigned int i, size_t max_triangles, std::vector<BoxNode>& top, F& f) const
+    {
+        unsigned int index = top.size();
+        top.push_back(nodes[i]);
+        unsigned int end = subtree_end(i);
+        unsigned int first = i;
+        while (nodes[first].count == 0)
+            first++;
+        /* the subtree's clusters are the leaves between i and end, in order */
+        const MeshCluster& c0 = clusters[nodes[first].offset];
+        const MeshCluster& c1 = clusters[nodes[end - 1].offset];
+        if (nodes[i].count || c1.first_triangle + c1.num_triangles - c0.first_triangle <= max_triangles)
+        {
+            CompactMesh piece;
+            extract(i, end, piece);
+            top[index].offset = f(piece);
+            top[index].count = 1;
+            return;
+        }
+        split_node(i + 1, max_triangles, top, f);
+        unsigned int right = top.size();
+        split_node(nodes[i].offset, max_triangles, top, f);
+        top[index].offset = right;
+    }
+
+    /* nodes i .. end - 1, a whole subtree, and what its clusters use */
+    void extract(unsigned int i, unsigned int end, CompactMesh& piece) const
+    {
+        std::copy(lo, lo + 3, piece.lo);
+        piece.step = step;
+        unsigned int first = i;
+        while (nodes[first].count == 0)
+            first++;
+        unsigned int c0 = nodes[first].offset, c1 = nodes[end - 1].offset + 1;
+        size_t v0 = clusters[c0].first_vertex, v1 = clusters[c1 - 1].first_vertex + clusters[c1 - 1].num_vertices;
+        size_t t0 = clusters[c0].first_triangle, t1 = clusters[c1 - 1].first_triangle + clusters[c1 - 1].num_triangles;
+
+        piece.nodes.assign(nodes.begin() + i, nodes.begin() + end);
+        for (BoxNode& node: piece.nodes)
+            node.offset -= node.count ? c0 : i;
+        piece.clusters.assign(clusters.begin() + c0, clusters.begin() + c1);
+        for (MeshCluster& c: piece.clusters) {
+            c.first_vertex -= v0;
+            c.first_triangle -= t0;
+        }
+        piece.positions.assign(positions.begin() + v0 * 3, positions.begin() + v1 * 3);
+        piece.corners.assign(corners.begin() + t0 * 3, corners.begin() + t1 * 3);
+        piece.use_vectors();
+    }
+
+    void use_vectors(void)
+    {
+        tree = nodes.data();
+        cluster_table = clusters.data();
+        position_table = positions.data();
+        corner_table = corners.data();
+        tree_size = nodes.size();
+        cluster_count = clusters.size();
+        position_count = positions.size();
+        corner_count = corners.size();
+    }
+
+    /* q is the vertex's three steps in positions */
+    Point3D decode(const MeshCluster& c, const unsigned short *q) const
+    {
+        return Point3D(lo[0] + (float)(c.base[0] + (q[0] << c.level)) * step,
+                lo[1] + (float)(c.base[1] + (q[1] << c.level)) * step,
+                lo[2] + (float)(c.base[2] + (q[2] << c.level)) * step);
+    }
+
+    /* as MeshTriangle::hit() */
+    bool hit_triangle(const Ray& ray, const Point3D& v0, const Point3D& v1, const Point3D& v2, float& tmin) const
+    {
+        float a = v0.x - v1.x, b = v0.x - v2.x, c = ray.d.x, d = v0.x - ray.o.x;
+        float e = v0.y - v1.y, f = v0.y - v2.y, g = ray.d.y, h = v0.y - ray.o.y;
+        float i = v0.z - v1.z, j = v0.z - v2.z, k = ray.d.z, l = v0.z - ray.o.z;
+
+        float m = f * k - g * j, n = h * k - g * l, p = f * l - h * j;
+        float q = g * i - e * k, s = e * j - f * i;
+
+        float inv_denom = 1.0 / (a * m + b * q + c * s);
+
+        float e1 = d * m - b * n - c * p;
+        float beta = e1 * inv_denom;
+        if (beta < 0)
+            return false;
+
+        float r = e * l - h * i;
+        float e2 = a * n + d * q + c * r;
+        float gamma = e2 * inv_denom;
+        if (gamma < 0)
+            return false;
+        if (beta + gamma > 1)
+            return false;
+
+        float e3 = a * p - b * r + d * s;
+        float t = e3 * inv_denom;
+        if (t < eps)
+            return false;
+        tmin = t;
+        return true;
+    }
+
+    /* ------------------------------------------------------------ build */
+
+    /*
+     * The triangles as build_box_tree() sees them, through order[]; a
+     * leaf's offset is the first of its triangles in order until
+     * quantize() makes it a cluster.
+     */
+    struct Triangles
+    {
+        std::vector<unsigned int>& order;
+        const std::vector<float>& centroids;
+        const std::vector<float>& boxes;
+
+        void add(size_t k, float *box, float *cbox) const
+        {
+            const float *c = &centroids[(size_t)order[k] * 3];
+            float cp[6] = { c[0], c[1], c[2], c[0], c[1], c[2] };
+            grow_box(box, &boxes[(size_t)order[k] * 6]);
+            grow_box(cbox, cp);
+        }
+
+        float centroid(size_t k, int axis) const
+        {
+            return centroids[(size_t)order[k] * 3 + axis];
+        }
+
+        void swap(size_t i, size_t j)
+        {
+            std::swap(order[i], order[j]);
+        }
+    };
+
+    /*
+     * The leaves become clusters.  Each cluster first gets the finest step
+     * its extent fits 16 bits in, then every vertex is snapped to the
+     * coarsest step among the clusters using it, which may stretch a
+     * cluster past 16 bits and coarsen it in turn, until nothing changes.
+     * The boxes are then made again from the decoded vertices.
+     */
+    void quantize(const Point3D *points, int num_vertices, const int *indices, const std::vector<unsigned int>& order)
+    {
+        float hi[3];
+        for (int a = 0; a < 3; a++) {
+            lo[a] = nodes[0].bbox[a];
+            hi[a] = nodes[0].bbox[a + 3];
+        }
+        float extent = std::max(std::max(hi[0] - lo[0], hi[1] - lo[1]), hi[2] - lo[2]);
+        step = extent > 0 ? extent / (1 << CLUSTER_LATTICE_BITS) : 1.0f;
+
+        std::vector<int> lattice((size_t)num_vertices * 3);
+        for (int v = 0; v < num_vertices; v++)
+            for (int a = 0; a < 3; a++) {
+                double q = ((&points[v].x)[a] - lo[a]) / step;
+                lattice[(size_t)v * 3 + a] = (int)std::min(std::max(floor(q + 0.5), 0.0), (double)(1 << CLUSTER_LATTICE_BITS));
+            }
+
+        std::vector<unsigned int> leaves;
+        for (unsigned int i = 0; i < nodes.size(); i++)
+            if (nodes[i].count)
+                leaves.push_back(i);
+        std::vector<unsigned char> leaf_level(leaves.size(), 0);
+        std::vector<unsigned char> vertex_level(num_vertices, 0);
+        std::vector<int> snapped;
+        for (bool changed = true; changed; )
+        {
+            for (size_t l = 0; l < leaves.size(); l++)
+                for_corners(indices, order, nodes[leaves[l]], [&](int v) {
+                    vertex_level[v] = std::max(vertex_level[v], leaf_level[l]);
+                });
+            snapped = lattice;
+            for (int v = 0; v < num_vertices; v++)
+                for (int a = 0; a < 3; a++) {
+                    int& g = snapped[(size_t)v * 3 + a];
+                    int half = vertex_level[v] ? 1 << (vertex_level[v] - 1) : 0;
+                    g = (g + half) >> vertex_level[v] << vertex_level[v];
+                }
+
+            changed = false;
+            for (size_t l = 0; l < leaves.size(); l++)
+            {
+                int gmin[3] = { INT_MAX, INT_MAX, INT_MAX }, gmax[3] = { INT_MIN, INT_MIN, INT_MIN };
+                for_corners(indices, order, nodes[leaves[l]], [&](int v) {
+                    for (int a = 0; a < 3; a++) {
+                        gmin[a] = std::min(gmin[a], snapped[(size_t)v * 3 + a]);
+                        gmax[a] = std::max(gmax[a], snapped[(size_t)v * 3 + a]);
+                    }
+                });
+                int range = std::max(std::max(gmax[0] - gmin[0], gmax[1] - gmin[1]), gmax[2] - gmin[2]);
+                while ((range >> leaf_level[l]) > 0xffff) {
+                    leaf_level[l]++;
+                    changed = true;
+                }
+            }
+        }
+        std::vector<unsigned char>().swap(vertex_level);
+        std::vector<int>().swap(lattice);
+
+        /* each cluster's own vertices, in the order its triangles first use them */
+        clusters.resize(leaves.size());
+        corners.resize(order.size() * 3);
+        positions.reserve(order.size() * 3);
+        size_t triangle = 0;
+        for (size_t l = 0; l < leaves.size(); l++)
+        {
+            BoxNode& node = nodes[leaves[l]];
+            MeshCluster& c = clusters[l];
+            c.level = leaf_level[l];
+            c.reserved = 0;
+            c.first_triangle = triangle;
+            c.num_triangles = node.count;
+            c.first_vertex = positions.size() / 3;
+            for (int a = 0; a < 3; a++)
+                c.base[a] = INT_MAX;
+            for_corners(indices, order, node, [&](int v) {
+                for (int a = 0; a < 3; a++)
+                    c.base[a] = std::min(c.base[a], snapped[(size_t)v * 3 + a]);
+            });
+
+            int used[3 * CLUSTER_SIZE];
+            int num_used = 0;
+            for (unsigned int k = 0; k < node.count; k++, triangle++)
+            {
+                const int *tri = &indices[(size_t)order[node.offset + k] * 3];
+                for (int j = 0; j < 3; j++)
+                {
+                    int u = std::find(used, used + num_used, tri[j]) - used;
+                    if (u == num_used)
+                    {
+                        used[num_used++] = tri[j];
+                        for (int a = 0; a < 3; a++)
+                            positions.push_back((snapped[(size_t)tri[j] * 3 + a] - c.base[a]) >> c.level);
+                    }
+                    corners[triangle * 3 + j] = u;
+                }
+            }
+            c.num_vertices = num_used;
+
+            empty_box(node.bbox);
+            for (int k = 0; k < num_used; k++)
+            {
+                Point3D p = decode(c, &positions[(size_t)(c.first_vertex + k) * 3]);
+                float pb[6] = { p.x, p.y, p.z, p.x, p.y, p.z };
+                grow_box(node.bbox, pb);
+            }
+            node.offset = l;
+        }
+        positions.shrink_to_fit();
+
+        /* children come after their parent */
+        for (size_t i = nodes.size(); i-- > 0; )
+            if (nodes[i].count == 0) {
+                empty_box(nodes[i].bbox);
+                grow_box(nodes[i].bbox, nodes[i + 1].bbox);
+                grow_box(nodes[i].bbox, nodes[nodes[i].offset].bbox);
+            }
+    }
+
+    /* the vertices of a leaf's triangles, before it is a cluster */
+    template <typename F>
+    static void for_corners(const int *indices, const std::vector<unsigned int>& order, const BoxNode& leaf, F f)
+    {
+        for (unsigned int k = 0; k < leaf.count; k++)
+            for (int j = 0; j < 3; j++)
+                f(indices[(size_t)order[leaf.offset + k] * 3 + j]);
+    }
+
+private:
+    tracked_vector<BoxNode, MEM_ACCEL> nodes;
+    tracked_vector<MeshCluster, MEM_MESHES> clusters;
+    tracked_vector<unsigned short, MEM_MESHES> positions;
+    tracked_vector<unsigned char, MEM_MESHES> corners;
+    const BoxNode *tree;                    /* nodes.data() and so on, or mapped */
+    const MeshCluster *cluster_table;
+    const unsigned short *position_table;
+    const unsigned char *corner_table;
+    size_t tree_size, cluster_count, position_count, corner_count;
+    float lo[3];
+    float step;
+};
+
+#endif // _COMPACT_MESH_H
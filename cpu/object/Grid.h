@@ -10,9 +10,14 @@
 #define _GRID_H
 
 #include "BBox.h"
+#include "../Arena.h"
+#include "../AccelCache.h"
 #include "../Utilities.h"
 #include <cfloat>
+#include <mutex>
+#include <atomic>
 #include "Object.h"
+#include "Morton.h"
 
 class Mesh
 {
@@ -22,29 +27,150 @@ public:
         indices(),
         normals(),
         vertex_faces(),
+        triangles(64 * 1024, MEM_GEOMETRY),
+        points(nullptr),
+        faces(nullptr),
         num_vertices(0),
         num_triangles(0),
         num_indices(0)
     {}
 public:
-	std::vector<Point3D> vertices;
-	std::vector<int> indices;
-	std::vector<Normal> normals;
-	std::vector<std::vector<int>> vertex_faces;
+	tracked_vector<Point3D, MEM_MESHES> vertices;
+	tracked_vector<int, MEM_MESHES> indices;
+	tracked_vector<Normal, MEM_MESHES> normals;
+	tracked_vector<tracked_vector<int, MEM_MESHES>, MEM_MESHES> vertex_faces;
+	/* the mesh's MeshTriangles, so a loader thread can make them on its own */
+	Arena triangles;
 	// std::vector<float> u; /* u texture coordinates */
 	// std::vector<float> v; /* v texture coordinates */
+	/* what the triangles read: vertices.data(), or the vertices of a mapped snapshot */
+	const Point3D *points;
+	/* what they are made from: indices.data(), or the indices of a mapped snapshot */
+	const int *faces;
 	int num_vertices;
 	int num_triangles;
 	int num_indices;
+
+	/*
+	 * Sorts the triangles along a Morton curve through their centroids and
+	 * numbers the vertices in the order the sorted triangles first use
+	 * them, so that what is close in space is close in memory: a leaf's
+	 * triangles, and the vertices they read.  The triangles are made after
+	 * this, in the new order, so their objects follow it too.  Per-vertex
+	 * normals and face lists, where a loader filled them, move along.
+	 *
+	 * Only render times back this up, a few percent on a shuffled mesh;
+	 * the cache misses themselves are unmeasured, as the machines it was
+	 * timed on expose no hardware counters.
+	 */
+	void reorder(void)
+	{
+		size_t nt = indices.size() / 3;
+		float lo[3] = { FLT_MAX, FLT_MAX, FLT_MAX }, hi[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		for (const Point3D& v: vertices)
+			for (int a = 0; a < 3; a++) {
+				lo[a] = std::min(lo[a], (&v.x)[a]);
+				hi[a] = std::max(hi[a], (&v.x)[a]);
+			}
+		float scale = morton_scale(std::max(std::max(hi[0] - lo[0], hi[1] - lo[1]), hi[2] - lo[2]));
+
+		/* Morton code above, triangle below */
+		std::vector<unsigned long long> keys(nt);
+		for (size_t t = 0; t < nt; t++)
+		{
+			const Point3D& a = vertices[indices[t * 3]];
+			const Point3D& b = vertices[indices[t * 3 + 1]];
+			const Point3D& c = vertices[indices[t * 3 + 2]];
+			float centroid[3] = { (a.x + b.x + c.x) / 3, (a.y + b.y + c.y) / 3, (a.z + b.z + c.z) / 3 };
+			keys[t] = (unsigned long long)morton_code(centroid, lo, scale) << 32 | t;
+		}
+		std::sort(keys.begin(), keys.end());
+
+		std::vector<int> renumber(vertices.size(), -1);
+		std::vector<int> moved_to(nt);
+		tracked_vector<Point3D, MEM_MESHES> sorted_vertices;
+		tracked_vector<int, MEM_MESHES> sorted_indices(indices.size());
+		sorted_vertices.reserve(vertices.size());
+		for (size_t t = 0; t < nt; t++)
+		{
+			size_t from = (unsigned int)keys[t];
+			moved_to[from] = t;
+			for (int k = 0; k < 3; k++)
+			{
+				int& v = renumber[indices[from * 3 + k]];
+				if (v < 0) {
+					v = sorted_vertices.size();
+					sorted_vertices.push_back(vertices[indices[from * 3 + k]]);
+				}
+				sorted_indices[t * 3 + k] = v;
+			}
+		}
+		/* vertices no triangle uses keep their place at the end */
+		for (size_t v = 0; v < vertices.size(); v++)
+			if (renumber[v] < 0) {
+				renumber[v] = sorted_vertices.size();
+				sorted_vertices.push_back(vertices[v]);
+			}
+
+		if (!normals.empty())
+		{
+			tracked_vector<Normal, MEM_MESHES> sorted_normals(normals.size());
+			for (size_t v = 0; v < normals.size(); v++)
+				sorted_normals[renumber[v]] = normals[v];
+			normals.swap(sorted_normals);
+		}
+		if (!vertex_faces.empty())
+		{
+			tracked_vector<tracked_vector<int, MEM_MESHES>, MEM_MESHES> sorted_faces(vertex_faces.size());
+			for (size_t v = 0; v < vertex_faces.size(); v++)
+			{
+				tracked_vector<int, MEM_MESHES>& f = sorted_faces[renumber[v]];
+				f.swap(vertex_faces[v]);
+				for (int& t: f)
+					t = moved_to[t];
+			}
+			vertex_faces.swap(sorted_faces);
+		}
+
+		vertices.swap(sorted_vertices);
+		indices.swap(sorted_indices);
+		points = vertices.data();
+		faces = indices.data();
+	}
+};
+
+/* cells per object along the cube root of the grid's volume */
+const float GRID_MULTIPLIER = 2.0f;
+
+/* a built grid as it is stored in a scene snapshot or the accelerator cache */
+struct GridRecord
+{
+    float bbox[6];
+    int nx, ny, nz;
+    unsigned int reserved;           /* number of objects, in the cache */
+    unsigned long long first_start;  /* into the snapshot's cell start table */
+    unsigned long long first_item;   /* into the snapshot's cell item table */
 };
 
+/*
+ * Uniform grid over the objects added to it.  The cells are stored flat:
+ * the objects of cell i are object_ptrs[items[k]] for k in
+ * [starts[i], starts[i + 1]).  Being plain indices, the two tables can be
+ * used straight from a mapped snapshot as well as from the vectors below.
+ */
 class Grid: public Compound
 {
 public:
     Grid(void):
-        cells(),
+        cell_starts(),
+        cell_items(),
+        starts(nullptr),
+        items(nullptr),
+        cache_file(),
+        ready(false),
+        build_mutex(),
         bbox(),
-        mesh_ptr(new Mesh),
+        mesh_ptr(nullptr),
         nx(0), ny(0), nz(0)
     {}
 
@@ -53,78 +179,74 @@ public:
         return bbox;
     }
 
+    /*
+     * Bounds now, cells when the first ray enters them.  For grids nested
+     * in another accelerator, so that parts of the scene no ray reaches
+     * never cost a build.  Safe when several threads trace at once: one of
+     * them builds and the others wait for it.  The bounds are final here,
+     * as rays read them before they know whether the cells are ready.
+     */
+    void defer_cells(void)
+    {
+        set_bounds(object_boxes());
+        ready.store(false, std::memory_order_release);
+    }
+
+    void build(void)
+    {
+        setup_cells();
+    }
+
+    /* build now if defer_cells() left it for later */
+    void ensure_cells(void)
+    {
+        if (!ready.load(std::memory_order_acquire))
+            build_cells();
+    }
+
     void setup_cells(void)
     {
-        Point3D p0 = min_coordinate();
-        Point3D p1 = max_coordinate();
-        bbox.x0 = p0.x; bbox.y0 = p0.y; bbox.z0 = p0.z;
-        bbox.x1 = p1.x; bbox.y1 = p1.y; bbox.z1 = p1.z;
+        std::vector<BBox> boxes = object_boxes();
+        set_bounds(boxes);
+        fill_cells(boxes);
+    }
 
-        int num_objects = object_ptrs.size();
-        float wx = p1.x - p0.x;
-        float wy = p1.y - p0.y;
-        float wz = p1.z - p0.z;
-        const float multiplier = 2.0;
-        float s = powf(wx * wy * wz / num_objects, 0.33333);
-        nx = multiplier * wx / s + 1;
-        ny = multiplier * wy / s + 1;
-        nz = multiplier * wz / s + 1;
+    /* adopt cell tables built earlier, e.g. the ones of a mapped snapshot */
+    void use_cells(const GridRecord& r, const unsigned int *starts_, const unsigned int *items_)
+    {
+        bbox = BBox(r.bbox[0], r.bbox[1], r.bbox[2], r.bbox[3], r.bbox[4], r.bbox[5]);
+        use_tables(r, starts_, items_);
+    }
 
-        int num_cells = nx * ny * nz;
-        cells.reserve(num_cells);
-        for (int i = 0; i < num_cells; i++)
-        {
-            cells.push_back(nullptr);
-        }
+    void save(GridRecord& r) const
+    {
+        memset(&r, 0, sizeof(r));
+        r.bbox[0] = bbox.x0; r.bbox[1] = bbox.y0; r.bbox[2] = bbox.z0;
+        r.bbox[3] = bbox.x1; r.bbox[4] = bbox.y1; r.bbox[5] = bbox.z1;
+        r.nx = nx;
+        r.ny = ny;
+        r.nz = nz;
+    }
 
-        std::vector<int> count(num_cells, 0);
+    bool save(ObjectRecord& r) const
+    {
+        r.kind = OBJECT_GRID;
+        return true;
+    }
 
-        BBox obj_bbox;
-        int index;
+    int num_cells(void) const
+    {
+        return nx * ny * nz;
+    }
 
-        for (Object *obj_ptr: object_ptrs)
-        {
-            obj_bbox = obj_ptr->get_bounding_box();
-
-            // compute the cell indices for the corners of the bouding box of the object
-                int ixmin = clamp((obj_bbox.x0 - p0.x) * nx / (p1.x - p0.x), 0, nx - 1);
-            int iymin = clamp((obj_bbox.y0 - p0.y) * ny / (p1.y - p0.y), 0, ny - 1);
-            int izmin = clamp((obj_bbox.z0 - p0.z) * nz / (p1.z - p0.z), 0, nz - 1);
-            int ixmax = clamp((obj_bbox.x1 - p0.x) * nx / (p1.x - p0.x), 0, nx - 1);
-            int iymax = clamp((obj_bbox.y1 - p0.y) * ny / (p1.y - p0.y), 0, ny - 1);
-            int izmax = clamp((obj_bbox.z1 - p0.z) * nz / (p1.z - p0.z), 0, nz - 1);
-
-            //  add objects to cells
-                for (int iz = izmin; iz <= izmax; iz++)
-                    for (int iy = iymin; iy <= iymax; iy++)
-                        for (int ix = ixmin; ix <= ixmax; ix++)
-                        {
-                            index = ix + nx * iy + nx * ny * iz;
-
-                            if (count[index] == 0)
-                            {
-                                cells[index] = obj_ptr;
-                                count[index] += 1;
-                            }
-                            else
-                            {
-                                if (count[index] == 1)
-                                {
-                                    Compound *compound_ptr = new Compound;
-                                    compound_ptr->add_object(cells[index]);
-                                    compound_ptr->add_object(obj_ptr);
-                                    cells[index] = compound_ptr;
-                                    count[index] += 1;
-                                }
-                                else
-                                {
-                                    ((Compound *)cells[index])->add_object(obj_ptr);
-                                    count[index] += 1;
-                                }
-                            }
-                        }
-        }
-        count.erase(count.begin(), count.end());
+    const unsigned int* get_cell_starts(void) const
+    {
+        return starts;
+    }
+
+    const unsigned int* get_cell_items(void) const
+    {
+        return items;
     }
 
     virtual bool hit(const Ray& ray, float& tmin, ShadeRec& sr)
@@ -196,9 +318,13 @@ public:
         if (tz_max < t1)
             t1 = tz_max;
 
-        if (t0 > t1)
+        /* missed, or the whole grid lies behind the ray */
+        if (t0 > t1 || t1 < eps)
             return(false);
 
+        if (!ready.load(std::memory_order_acquire))
+            build_cells();
+
         /* initial cell coordinates */
         int ix, iy, iz;
 
@@ -278,15 +404,12 @@ public:
 
         /* traverse the grid */
         while (true) {
-            Object* object_ptr = cells[ix + nx * iy + nx * ny * iz];
+            int cell = ix + nx * iy + nx * ny * iz;
 
             if (tx_next < ty_next && tx_next < tz_next)
             {
-                if (object_ptr && object_ptr->hit(ray, tmin, sr) && tmin < tx_next)
-                {
-                    material_ptr = object_ptr->material_ptr;
+                if (hit_cell(cell, ray, tmin, sr) && tmin < tx_next)
                     return (true);
-                }
                 tx_next += dtx;
                 ix += ix_step;
                 if (ix == ix_stop)
@@ -296,11 +419,8 @@ public:
             {
                 if (ty_next < tz_next)
                 {
-                    if (object_ptr && object_ptr->hit(ray, tmin, sr) && tmin < ty_next)
-                    {
-                        material_ptr = object_ptr->material_ptr;
+                    if (hit_cell(cell, ray, tmin, sr) && tmin < ty_next)
                         return (true);
-                    }
                     ty_next += dty;
                     iy += iy_step;
                     if (iy == iy_stop)
@@ -308,11 +428,8 @@ public:
                 }
                 else
                 {
-                    if (object_ptr && object_ptr->hit(ray, tmin, sr) && tmin < tz_next)
-                    {
-                        material_ptr = object_ptr->material_ptr;
+                    if (hit_cell(cell, ray, tmin, sr) && tmin < tz_next)
                         return (true);
-                    }
                     tz_next += dtz;
                     iz += iz_step;
                     if (iz == iz_stop)
@@ -328,116 +445,242 @@ public:
         return hit(ray, tmin, sr);
     }
 
-    void reverse_normals()
+	// void read_ply_file(char *);
+
+private:
+	tracked_vector<unsigned int, MEM_ACCEL> cell_starts;
+	tracked_vector<unsigned int, MEM_GRID_CELLS> cell_items;
+	const unsigned int *starts; /* cell_starts.data(), or mapped */
+	const unsigned int *items;
+	MappedFile cache_file;      /* backs starts and items after a cache hit */
+	std::atomic<bool> ready;    /* starts and items are valid */
+	std::mutex build_mutex;
+	BBox bbox;
+	int nx, ny, nz;
+	Mesh *mesh_ptr;
+
+    /* the nearest hit among the objects of one cell, as Compound::hit */
+    bool hit_cell(int cell, const Ray& ray, float& tmin, ShadeRec& sr)
     {
-        Point3D p0 = min_coordinate();
-        Point3D p1 = max_coordinate();
-        bbox.x0 = p0.x; bbox.y0 = p0.y; bbox.z0 = p0.z;
-        bbox.x1 = p1.x; bbox.y1 = p1.y; bbox.z1 = p1.z;
+        unsigned int first = starts[cell], last = starts[cell + 1];
+        if (first == last)
+            return false;
+        if (last - first == 1)
+        {
+            Object *obj_ptr = object_ptrs[items[first]];
+            if (!obj_ptr->hit(ray, tmin, sr))
+                return false;
+            material_id = obj_ptr->material_id;
+            return true;
+        }
+
+        float t;
+        bool hit = false;
+        Normal normal;
+        Point3D local_hit_point;
+        tmin = FLT_MAX;
+        for (unsigned int k = first; k < last; k++)
+        {
+            Object *obj_ptr = object_ptrs[items[k]];
+            if (obj_ptr->hit(ray, t, sr) && (t < tmin))
+            {
+                hit = true;
+                tmin = t;
+                normal = sr.normal;
+                material_id = obj_ptr->material_id;
+                local_hit_point = sr.local_hit_point;
+            }
+        }
+        if (hit)
+        {
+            sr.t = tmin;
+            sr.normal = normal;
+            sr.local_hit_point = local_hit_point;
+        }
+        return hit;
+    }
+
+    /* the range of cells an object's bounding box overlaps, clamped to the grid */
+    void cell_extent(const BBox& b, const Point3D& p0, const Point3D& p1, int *e) const
+    {
+        e[0] = clamp((b.x0 - p0.x) * nx / (p1.x - p0.x), 0, nx - 1);
+        e[1] = clamp((b.y0 - p0.y) * ny / (p1.y - p0.y), 0, ny - 1);
+        e[2] = clamp((b.z0 - p0.z) * nz / (p1.z - p0.z), 0, nz - 1);
+        e[3] = clamp((b.x1 - p0.x) * nx / (p1.x - p0.x), 0, nx - 1);
+        e[4] = clamp((b.y1 - p0.y) * ny / (p1.y - p0.y), 0, ny - 1);
+        e[5] = clamp((b.z1 - p0.z) * nz / (p1.z - p0.z), 0, nz - 1);
+    }
+
+    /* the cells within bbox, which is left as it is */
+    void fill_cells(const std::vector<BBox>& boxes)
+    {
+        int num_objects = boxes.size();
+
+        /* the cells depend on nothing but the boxes and the build constants */
+        unsigned long long key = 0;
+        if (AccelCache::enabled())
+        {
+            key = AccelCache::hash(&GRID_MULTIPLIER, sizeof(GRID_MULTIPLIER));
+            key = AccelCache::hash(&num_objects, sizeof(num_objects), key);
+            for (const BBox& b: boxes)
+                key = AccelCache::hash(&b.x0, 6 * sizeof(float), key);
+            if (load_cached(key, num_objects))
+                return;
+        }
+
+        Point3D p0(bbox.x0, bbox.y0, bbox.z0);
+        Point3D p1(bbox.x1, bbox.y1, bbox.z1);
 
-        int num_objects = object_ptrs.size();
         float wx = p1.x - p0.x;
         float wy = p1.y - p0.y;
         float wz = p1.z - p0.z;
-        const float multiplier = 2.0;
+        const float multiplier = GRID_MULTIPLIER;
         float s = powf(wx * wy * wz / num_objects, 0.33333);
         nx = multiplier * wx / s + 1;
         ny = multiplier * wy / s + 1;
         nz = multiplier * wz / s + 1;
 
         int num_cells = nx * ny * nz;
-        cells.reserve(num_cells);
+
+        /* two passes over the objects: count per cell, then fill in order */
+        std::vector<int> extent(num_objects * 6);
+        cell_starts.assign(num_cells + 1, 0);
+        for (int k = 0; k < num_objects; k++)
+        {
+            int *e = &extent[k * 6];
+            cell_extent(boxes[k], p0, p1, e);
+            for (int iz = e[2]; iz <= e[5]; iz++)
+                for (int iy = e[1]; iy <= e[4]; iy++)
+                    for (int ix = e[0]; ix <= e[3]; ix++)
+                        cell_starts[ix + nx * iy + nx * ny * iz + 1]++;
+        }
         for (int i = 0; i < num_cells; i++)
+            cell_starts[i + 1] += cell_starts[i];
+
+        std::vector<unsigned int> fill(cell_starts.begin(), cell_starts.end() - 1);
+        cell_items.resize(cell_starts[num_cells]);
+        for (int k = 0; k < num_objects; k++)
         {
-            cells.push_back(nullptr);
+            const int *e = &extent[k * 6];
+            for (int iz = e[2]; iz <= e[5]; iz++)
+                for (int iy = e[1]; iy <= e[4]; iy++)
+                    for (int ix = e[0]; ix <= e[3]; ix++)
+                        cell_items[fill[ix + nx * iy + nx * ny * iz]++] = k;
         }
+        starts = cell_starts.data();
+        items = cell_items.data();
 
-        std::vector<int> count(num_cells, 0);
+        if (AccelCache::enabled())
+            store_cached(key);
+        ready.store(true, std::memory_order_release);
+    }
 
-        BBox obj_bbox;
-        int index;
+    void build_cells(void)
+    {
+        std::lock_guard<std::mutex> lock(build_mutex);
+        if (!ready.load(std::memory_order_relaxed))
+            fill_cells(object_boxes());
+    }
 
-        for (Object *obj_ptr: object_ptrs)
-        {
-            obj_bbox = obj_ptr->get_bounding_box();
-
-            /* compute the cell indices for the corners of the bouding box of the object */
-            int ixmin = clamp((obj_bbox.x0 - p0.x) * nx / (p1.x - p0.x), 0, nx - 1);
-            int iymin = clamp((obj_bbox.y0 - p0.y) * ny / (p1.y - p0.y), 0, ny - 1);
-            int izmin = clamp((obj_bbox.z0 - p0.z) * nz / (p1.z - p0.z), 0, nz - 1);
-            int ixmax = clamp((obj_bbox.x1 - p0.x) * nx / (p1.x - p0.x), 0, nx - 1);
-            int iymax = clamp((obj_bbox.y1 - p0.y) * ny / (p1.y - p0.y), 0, ny - 1);
-            int izmax = clamp((obj_bbox.z1 - p0.z) * nz / (p1.z - p0.z), 0, nz - 1);
-
-            /* add objects to cells */
-            for (int iz = izmin; iz <= izmax; iz++)
-                for (int iy = iymin; iy <= iymax; iy++)
-                    for (int ix = ixmin; ix <= ixmax; ix++)
-                    {
-                        index = ix + nx * iy + nx * ny * iz;
-
-                        if (count[index] == 0)
-                        {
-                            cells[index] = obj_ptr;
-                            count[index] += 1;
-                        }
-                        else
-                        {
-                            if (count[index] == 1)
-                            {
-                                Compound *compound_ptr = new Compound;
-                                compound_ptr->add_object(cells[index]);
-                                compound_ptr->add_object(obj_ptr);
-                                cells[index] = compound_ptr;
-                                count[index] += 1;
-                            }
-                            else
-                            {
-                                ((Compound *)cells[index])->add_object(obj_ptr);
-                                count[index] += 1;
-                            }
-                        }
-                    }
+    /* as use_cells(), for a grid whose bounds are already set */
+    void use_tables(const GridRecord& r, const unsigned int *starts_, const unsigned int *items_)
+    {
+        nx = r.nx;
+        ny = r.ny;
+        nz = r.nz;
+        cell_starts.clear();
+        cell_items.clear();
+        starts = starts_;
+        items = items_;
+        ready.store(true, std::memory_order_release);
+    }
+
+    std::vector<BBox> object_boxes(void)
+    {
+        std::vector<BBox> boxes(object_ptrs.size());
+        for (size_t k = 0; k < boxes.size(); k++)
+            boxes[k] = object_ptrs[k]->get_bounding_box();
+        return boxes;
+    }
+
+    void set_bounds(const std::vector<BBox>& boxes)
+    {
+        Point3D p0 = min_coordinate(boxes);
+        Point3D p1 = max_coordinate(boxes);
+        bbox = BBox(p0.x, p0.y, p0.z, p1.x, p1.y, p1.z);
+    }
+
+    bool load_cached(unsigned long long key, int num_objects)
+    {
+        GridRecord r;
+        AccelCacheArray arrays[2] = {
+            { nullptr, 0, sizeof(unsigned int) },
+            { nullptr, 0, sizeof(unsigned int) }
+        };
+        if (!AccelCache::load("grid", key, &r, sizeof(r), arrays, 2, cache_file))
+            return false;
+        const unsigned int *s = (const unsigned int *)arrays[0].data;
+        const unsigned int *it = (const unsigned int *)arrays[1].data;
+        if (r.reserved != (unsigned int)num_objects || !valid_tables(r, s, arrays[0].count, it, arrays[1].count)) {
+            cache_file.close_file();
+            return false;
         }
-        count.erase(count.begin(), count.end());
+        use_tables(r, s, it);
+        return true;
     }
-	// void read_ply_file(char *);
 
-private:
-	std::vector<Object*> cells;
-	BBox bbox;
-	int nx, ny, nz;
-	Mesh *mesh_ptr;
+    /* a mapped file can hold anything: every start and item is checked before a ray follows it */
+    static bool valid_tables(const GridRecord& r, const unsigned int *s, unsigned long long num_starts,
+            const unsigned int *it, unsigned long long num_items)
+    {
+        if (r.nx <= 0 || r.ny <= 0 || r.nz <= 0)
+            return false;
+        unsigned long long num_cells = (unsigned long long)r.nx * r.ny * r.nz;
+        if (num_starts != num_cells + 1 || s[0] != 0 || s[num_cells] != num_items)
+            return false;
+        for (unsigned long long k = 0; k < num_cells; k++)
+            if (s[k] > s[k + 1])
+                return false;
+        for (unsigned long long k = 0; k < num_items; k++)
+            if (it[k] >= r.reserved)
+                return false;
+        return true;
+    }
 
-	Point3D min_coordinate(void)
+    void store_cached(unsigned long long key) const
     {
-        BBox obj_bbox;
-        Point3D p0(FLT_MAX);
+        GridRecord r;
+        save(r);
+        r.reserved = object_ptrs.size();
+        AccelCacheArray arrays[2] = {
+            { starts, (unsigned long long)num_cells() + 1, sizeof(unsigned int) },
+            { items, starts[num_cells()], sizeof(unsigned int) }
+        };
+        AccelCache::store("grid", key, &r, sizeof(r), arrays, 2);
+    }
 
-        for (Object *obj_ptr: object_ptrs)
+	Point3D min_coordinate(const std::vector<BBox>& boxes)
+    {
+        Point3D p0(FLT_MAX);
+        for (const BBox& obj_bbox: boxes)
         {
-            obj_bbox = obj_ptr->get_bounding_box();
             if (obj_bbox.x0 < p0.x) p0.x = obj_bbox.x0;
             if (obj_bbox.y0 < p0.y) p0.y = obj_bbox.y0;
             if (obj_bbox.z0 < p0.z) p0.z = obj_bbox.z0;
         }
         p0.x -= eps; p0.y -= eps; p0.z -= eps;
-        bbox.x0 = p0.x; bbox.y0 = p0.y; bbox.z0 = p0.z;
         return p0;
     }
-	Point3D max_coordinate(void)
+	Point3D max_coordinate(const std::vector<BBox>& boxes)
     {
-        BBox obj_bbox;
         Point3D p1(FLT_MIN);
-        for (Object *obj_ptr: object_ptrs)
+        for (const BBox& obj_bbox: boxes)
         {
-            obj_bbox = obj_ptr->get_bounding_box();
             if (obj_bbox.x1 > p1.x) p1.x = obj_bbox.x1;
             if (obj_bbox.y1 > p1.y) p1.y = obj_bbox.y1;
             if (obj_bbox.z1 > p1.z) p1.z = obj_bbox.z1;
         }
         p1.x += eps; p1.y += eps; p1.z += eps;
-        bbox.x1 = p1.x; bbox.y1 = p1.y; bbox.z1 = p1.z;
         return p1;
     }
 };
@@ -446,13 +689,15 @@ class MeshTriangle: public Object
 {
 public:
 	MeshTriangle(void) {}
-    MeshTriangle(Mesh *mesh_ptr_, const int i0, const int i1, const int i2):
+    /* triangle t of the mesh's faces */
+    MeshTriangle(Mesh *mesh_ptr_, const int t):
         Object(),
         mesh_ptr(mesh_ptr_),
-        index0(i0), index1(i1), index2(i2)
+        index0(mesh_ptr_->faces[t * 3]), index1(mesh_ptr_->faces[t * 3 + 1]), index2(mesh_ptr_->faces[t * 3 + 2]),
+        number(t)
     {
-        normal = (mesh_ptr->vertices[index1] - mesh_ptr->vertices[index0]) ^
-            (mesh_ptr->vertices[index2] - mesh_ptr->vertices[index0]);
+        normal = (mesh_ptr->points[index1] - mesh_ptr->points[index0]) ^
+            (mesh_ptr->points[index2] - mesh_ptr->points[index0]);
         normal.normalize();
     }
 
@@ -467,9 +712,9 @@ public:
     bool hit(const Ray& ray, float& tmin, ShadeRec& sr)
     {
 
-        Point3D v0 = mesh_ptr->vertices[index0];
-        Point3D v1 = mesh_ptr->vertices[index1];
-        Point3D v2 = mesh_ptr->vertices[index2];
+        Point3D v0 = mesh_ptr->points[index0];
+        Point3D v1 = mesh_ptr->points[index1];
+        Point3D v2 = mesh_ptr->points[index2];
 
         float a = v0.x - v1.x, b = v0.x - v2.x, c = ray.d.x, d = v0.x - ray.o.x;
         float e = v0.y - v1.y, f = v0.y - v2.y, g = ray.d.y, h = v0.y - ray.o.y;
@@ -516,9 +761,9 @@ public:
 
     BBox get_bounding_box(void)
     {
-        Point3D v0 = mesh_ptr->vertices[index0];
-        Point3D v1 = mesh_ptr->vertices[index1];
-        Point3D v2 = mesh_ptr->vertices[index2];
+        Point3D v0 = mesh_ptr->points[index0];
+        Point3D v1 = mesh_ptr->points[index1];
+        Point3D v2 = mesh_ptr->points[index2];
 
         return BBox(std::min(std::min(v0.x, v1.x), v2.x),
                 std::min(std::min(v0.y, v1.y), v2.y),
@@ -528,16 +773,45 @@ public:
                 std::max(std::max(v0.z, v1.z), v2.z));
     }
 
+    BBox get_clipped_bounding_box(int axis, float lo, float hi)
+    {
+        BBox b;
+        if (!clipped_triangle_box(mesh_ptr->points[index0], mesh_ptr->points[index1],
+                    mesh_ptr->points[index2], axis, lo, hi, b))
+            return Object::get_clipped_bounding_box(axis, lo, hi);
+        return b;
+    }
+
 	const Normal& get_normal(void) const
     {
         return normal;
     }
+
+    const Mesh* get_mesh(void) const
+    {
+        return mesh_ptr;
+    }
+
+    int get_number(void) const
+    {
+        return number;
+    }
+
+    /* a run of one; the writer numbers the mesh and joins runs */
+    bool save(ObjectRecord& r) const
+    {
+        r.kind = OBJECT_MESH_TRIANGLES;
+        r.index[0] = number;
+        r.count = 1;
+        return true;
+    }
 public:
 	Normal normal;
 private:
 	Normal interpolate_normals(const float, const float);
 	Mesh *mesh_ptr;
 	int index0, index1, index2;
+	int number;
 };
 
 #endif
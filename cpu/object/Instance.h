@@ -0,0 +1,132 @@
+/* ====================================================
+#   File Name     : Instance.h
+# ====================================================*/
+
+#ifndef _INSTANCE_H
+#define _INSTANCE_H
+
+#include "Object.h"
+#include "../Matrix.h"
+
+#include <cfloat>
+#include <algorithm>
+
+/*
+ * Another copy of an object, placed by an affine transform.  The object
+ * and whatever accelerator it carries (a mesh's grid, say) are shared by
+ * all of its instances; an instance holds only the transform, so a scene
+ * of ten thousand copies costs one copy of the geometry.  Rays are taken
+ * into the object's space on the way in and left unnormalized there, which
+ * keeps t the same along both rays.  The instance's own material, when it
+ * has one, overrides the object's.
+ */
+class Instance: public Object
+{
+public:
+    Instance(Object *object_ptr_, const Matrix& transform_, MaterialId m = 0):
+        Object(),
+        object_ptr(object_ptr_),
+        transform(transform_),
+        inv_transform(transform_.inverse()),
+        instance_material(m)
+    {
+        material_id = m;
+    }
+
+    /* what the scene gives the instance, as opposed to the one last hit */
+    void set_instance_material(MaterialId id_)
+    {
+        instance_material = id_;
+        material_id = id_;
+    }
+
+    MaterialId get_instance_material(void) const
+    {
+        return instance_material;
+    }
+
+    Object* get_object(void) const
+    {
+        return object_ptr;
+    }
+
+    /* for a loader that makes the object's accelerator after placing its copies */
+    void set_object(Object *object_ptr_)
+    {
+        object_ptr = object_ptr_;
+    }
+
+    const Matrix& get_transform(void) const
+    {
+        return transform;
+    }
+
+    /* moves the instance; whatever it sits in needs a refit afterwards */
+    void set_transform(const Matrix& transform_)
+    {
+        transform = transform_;
+        inv_transform = transform_.inverse();
+    }
+
+    bool hit(const Ray& ray, float& tmin, ShadeRec& sr)
+    {
+        if (!object_ptr->hit(local_ray(ray), tmin, sr))
+            return false;
+        sr.normal = inv_transform.transposed_vector(sr.normal);
+        material_id = instance_material ? instance_material : object_ptr->material_id;
+        return true;
+    }
+
+    bool shadow_hit(const Ray& ray, float& tmin)
+    {
+        return object_ptr->shadow_hit(local_ray(ray), tmin);
+    }
+
+    /* the object's box with its corners transformed */
+    BBox get_bounding_box(void)
+    {
+        BBox b = object_ptr->get_bounding_box();
+        Point3D p0(FLT_MAX), p1(-FLT_MAX);
+        for (int k = 0; k < 8; k++)
+        {
+            Point3D c = transform.point(Point3D(k & 1 ? b.x1 : b.x0,
+                        k & 2 ? b.y1 : b.y0, k & 4 ? b.z1 : b.z0));
+            p0.x = std::min(p0.x, c.x); p1.x = std::max(p1.x, c.x);
+            p0.y = std::min(p0.y, c.y); p1.y = std::max(p1.y, c.y);
+            p0.z = std::min(p0.z, c.z); p1.z = std::max(p1.z, c.z);
+        }
+        return BBox(p0.x, p0.y, p0.z, p1.x, p1.y, p1.z);
+    }
+
+    /* the object goes in its own record, ref is filled in by the writer */
+    bool save(ObjectRecord& r) const
+    {
+        r.kind = OBJECT_INSTANCE;
+        r.index[0] = instance_material;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                r.p[i * 4 + j] = transform.m[i][j];
+        return true;
+    }
+
+private:
+    /* the ray in the object's space, with its footprint measured there too */
+    Ray local_ray(const Ray& ray) const
+    {
+        Ray local(inv_transform.point(ray.o), inv_transform.vector(ray.d));
+        if (ray.width > 0 || ray.spread > 0) {
+            float k = sqrtf((local.d * local.d) / (ray.d * ray.d));
+            local.width = ray.width * k;
+            local.spread = ray.spread * k;
+        }
+        return local;
+    }
+
+private:
+    Object *object_ptr;
+    Matrix transform;       /* object space to world space */
+    Matrix inv_transform;
+    MaterialId instance_material;
+};
+
+#endif // _INSTANCE_H
@@ -0,0 +1,262 @@
+/* ====================================================
+#   File Name     : LodMesh.h
+# ====================================================*/
+
+#ifndef _LOD_MESH_H
+#define _LOD_MESH_H
+
+#include "BBox.h"
+#include "Object.h"
+#include "Grid.h"
+#include "BVH.h"
+#include "../Arena.h"
+
+#include <cmath>
+#include <cfloat>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+/* a coarser level may be used while it stays within this much of the ray's width */
+const float LOD_TOLERANCE = 0.25f;
+const int LOD_MAX_LEVELS = 8;
+/* a level is kept only if it has at most this share of the triangles of the one before */
+const float LOD_MIN_REDUCTION = 0.5f;
+/* nothing coarser is made after a level this small */
+const size_t LOD_MIN_TRIANGLES = 64;
+
+/*
+ * A mesh with simplified copies of itself, each traced instead of the
+ * full mesh by rays too wide to tell them apart.  A level is made by
+ * clustering the vertices on a grid, each cell twice the size of the
+ * last try's, and dropping the triangles that collapse, so no vertex
+ * moves further than the cell's diagonal.  The level's error is twice
+ * that, the whole cell either side of the surface, since a ray can see
+ * the level and the mesh on opposite sides of a vertex.  A ray takes the
+ * coarsest level whose error is within LOD_TOLERANCE of its width where
+ * it enters the mesh's box, which is the nearest and so the finest point
+ * the mesh can be hit at.
+ *
+ * A ray that starts inside the box, as the bounces and shadow rays from
+ * the mesh itself do, is as wide as its parent was at the hit, so it
+ * takes the level its parent took, or the next coarser one, and is traced
+ * against that from where it starts.  Traced against the full mesh, it
+ * would find the full surface just above wherever the level dips below
+ * it and shadow itself; skipping past that would lose the light the mesh
+ * throws on itself nearby.  A ray that enters a coarser level from
+ * outside skips twice its error first, which is far short of the mesh.
+ *
+ * The levels are made on a loader thread, so they come from an arena of
+ * their own, as a Mesh's triangles do.
+ */
+class LodMesh: public Object
+{
+public:
+    LodMesh(void):
+        full(nullptr),
+        levels(),
+        arena()
+    {
+        box[0] = box[1] = box[2] = FLT_MAX;
+        box[3] = box[4] = box[5] = -FLT_MAX;
+    }
+
+    /* the mesh itself, in whatever accelerator it was given */
+    void set_full(Object *full_)
+    {
+        full = full_;
+    }
+
+    size_t num_levels(void) const
+    {
+        return levels.size() + 1;
+    }
+
+    /* the coarser levels, from the mesh's vertices and index triples */
+    void simplify(const Point3D *points, int num_vertices, const int *indices, int num_triangles)
+    {
+        levels.clear();
+        for (int v = 0; v < num_vertices; v++)
+        {
+            const Point3D& p = points[v];
+            box[0] = std::min(box[0], p.x); box[3] = std::max(box[3], p.x);
+            box[1] = std::min(box[1], p.y); box[4] = std::max(box[4], p.y);
+            box[2] = std::min(box[2], p.z); box[5] = std::max(box[5], p.z);
+        }
+        double edges = 0;
+        for (int t = 0; t < num_triangles; t++)
+        {
+            const int *k = &indices[(size_t)t * 3];
+            edges += points[k[0]].distance(points[k[1]]) + points[k[1]].distance(points[k[2]])
+                + points[k[2]].distance(points[k[0]]);
+        }
+        if (num_triangles == 0 || !(edges > 0))
+            return;
+
+        std::vector<int> cluster(num_vertices);
+        std::vector<std::array<int, 3> > triangles;
+        size_t previous = num_triangles;
+        float cell = 2.0f * edges / (3.0 * num_triangles);
+        for (int level = 1; level < LOD_MAX_LEVELS && previous > LOD_MIN_TRIANGLES; level++, cell *= 2)
+        {
+            tracked_vector<Point3D, MEM_MESHES> vertices;
+            std::vector<int> count;
+            std::unordered_map<unsigned long long, int> cells;
+            for (int v = 0; v < num_vertices; v++)
+            {
+                const Point3D& p = points[v];
+                unsigned long long key = cell_coordinate(p.x, box[0], cell)
+                    | cell_coordinate(p.y, box[1], cell) << 21 | cell_coordinate(p.z, box[2], cell) << 42;
+                auto it = cells.emplace(key, (int)count.size());
+                if (it.second) {
+                    vertices.push_back(Point3D(0, 0, 0));
+                    count.push_back(0);
+                }
+                cluster[v] = it.first->second;
+                vertices[cluster[v]] = vertices[cluster[v]] + p;
+                count[cluster[v]]++;
+            }
+            /* each cell's vertex is the one of its own nearest their mean, which keeps it on the surface */
+            std::vector<float> nearest(count.size(), FLT_MAX);
+            std::vector<Point3D> mean(count.size());
+            for (size_t c = 0; c < count.size(); c++)
+                mean[c] = vertices[c] / (float)count[c];
+            for (int v = 0; v < num_vertices; v++)
+            {
+                int c = cluster[v];
+                float d = points[v].distance_sqr(mean[c]);
+                if (d < nearest[c]) {
+                    nearest[c] = d;
+                    vertices[c] = points[v];
+                }
+            }
+
+            /* what is left of each triangle, with its smallest corner first so the same one is found twice */
+            triangles.clear();
+            for (int t = 0; t < num_triangles; t++)
+            {
+                const int *k = &indices[(size_t)t * 3];
+                std::array<int, 3> c = {{ cluster[k[0]], cluster[k[1]], cluster[k[2]] }};
+                if (c[0] == c[1] || c[1] == c[2] || c[2] == c[0])
+                    continue;
+                std::rotate(c.begin(), std::min_element(c.begin(), c.end()), c.end());
+                triangles.push_back(c);
+            }
+            std::sort(triangles.begin(), triangles.end());
+            triangles.erase(std::unique(triangles.begin(), triangles.end()), triangles.end());
+            if (triangles.empty() || triangles.size() > LOD_MIN_REDUCTION * previous)
+                continue;
+
+            Mesh *mesh = arena.make<Mesh>();
+            mesh->vertices.swap(vertices);
+            mesh->indices.resize(triangles.size() * 3);
+            for (size_t t = 0; t < triangles.size(); t++)
+                std::copy(triangles[t].begin(), triangles[t].end(), &mesh->indices[t * 3]);
+            mesh->points = mesh->vertices.data();
+            mesh->faces = mesh->indices.data();
+            mesh->num_vertices = mesh->vertices.size();
+            mesh->num_triangles = triangles.size();
+            mesh->num_indices = triangles.size() * 3;
+
+            Level l;
+            l.bvh = arena.make<BVH>();
+            for (size_t t = 0; t < triangles.size(); t++)
+                l.bvh->add_object(mesh->triangles.make<MeshTriangle>(mesh, (int)t));
+            l.bvh->build();
+            l.error = 2.0f * cell * sqrtf(3.0f);
+            levels.push_back(l);
+            previous = triangles.size();
+        }
+    }
+
+    bool hit(const Ray& ray, float& tmin, ShadeRec& sr)
+    {
+        float skip;
+        Object *level = select(ray, skip);
+        if (skip == 0)
+            return level->hit(ray, tmin, sr);
+        Ray moved(ray.o + ray.d * skip, ray.d, ray.footprint(skip), ray.spread);
+        if (!level->hit(moved, tmin, sr))
+            return false;
+        tmin += skip;
+        return true;
+    }
+
+    bool shadow_hit(const Ray& ray, float& tmin)
+    {
+        float skip;
+        Object *level = select(ray, skip);
+        if (skip == 0)
+            return level->shadow_hit(ray, tmin);
+        Ray moved(ray.o + ray.d * skip, ray.d, ray.footprint(skip), ray.spread);
+        if (!level->shadow_hit(moved, tmin))
+            return false;
+        tmin += skip;
+        return true;
+    }
+
+    BBox get_bounding_box(void)
+    {
+        return full->get_bounding_box();
+    }
+
+    const char* snapshot_kind(const char*& hint) const
+    {
+        hint = "; save without that option";
+        return "a mesh simplified with --mesh-lod";
+    }
+
+private:
+    struct Level
+    {
+        BVH *bvh;       /* over the triangles of a Mesh in the arena */
+        float error;
+    };
+
+    static unsigned long long cell_coordinate(float x, float lo, float cell)
+    {
+        return std::min((unsigned long long)((x - lo) / cell), (1ull << 21) - 1);
+    }
+
+    /* the level for the ray, and the t it skips on it */
+    Object* select(const Ray& ray, float& skip) const
+    {
+        skip = 0;
+        if (levels.empty() || !(ray.width > 0 || ray.spread > 0))
+            return full;
+
+        /* where the ray enters the box, or 0 if it starts inside */
+        float t0 = 0, t1 = FLT_MAX;
+        const float *o = &ray.o.x, *d = &ray.d.x;
+        for (int a = 0; a < 3; a++)
+        {
+            float inv = 1.0f / d[a];
+            float tn = (box[a] - o[a]) * inv, tf = (box[a + 3] - o[a]) * inv;
+            if (tn > tf)
+                std::swap(tn, tf);
+            t0 = std::max(t0, tn);
+            t1 = std::min(t1, tf);
+        }
+        if (t0 > t1)
+            return full;
+
+        float width = LOD_TOLERANCE * ray.footprint(t0);
+        size_t l = 0;
+        while (l < levels.size() && levels[l].error <= width)
+            l++;
+        if (l == 0)
+            return full;
+        if (t0 > 0)
+            skip = 2.0f * levels[l - 1].error / sqrtf(ray.d * ray.d);
+        return levels[l - 1].bvh;
+    }
+
+private:
+    Object *full;
+    std::vector<Level> levels;      /* the coarser ones, finest first */
+    Arena arena;
+    float box[6];
+};
+
+#endif // _LOD_MESH_H
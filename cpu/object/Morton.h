@@ -0,0 +1,44 @@
+/* ====================================================
+#   File Name     : Morton.h
+# ====================================================*/
+
+#ifndef _MORTON_H
+#define _MORTON_H
+
+#include <algorithm>
+
+/* per axis, so that a code fits in 30 bits */
+const int MORTON_BITS = 10;
+
+/* the bits of x, two zeros after each */
+inline unsigned int
+morton_spread_bits(unsigned int x)
+{
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+/* scale for a cube of side extent: cubic cells, so a flat set is not split across its thin side */
+inline float
+morton_scale(float extent)
+{
+    return extent > 0 ? (float)(1 << MORTON_BITS) / extent : 0;
+}
+
+/* where point c falls along the curve through the cube at lo */
+inline unsigned int
+morton_code(const float *c, const float *lo, float scale)
+{
+    unsigned int code = 0;
+    for (int a = 0; a < 3; a++) {
+        float q = (c[a] - lo[a]) * scale;
+        unsigned int cell = std::min((unsigned int)std::max(q, 0.0f), (1u << MORTON_BITS) - 1);
+        code |= morton_spread_bits(cell) << (2 - a);
+    }
+    return code;
+}
+
+#endif // _MORTON_H
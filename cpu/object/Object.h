@@ -10,6 +10,7 @@
 #include <cmath>
 #include <cfloat>
 #include <vector>
+#include <algorithm>
 #include "BBox.h"
 #include "../RGBColor.h"
 #include "../Utilities.h"
@@ -27,19 +28,97 @@ clamp(float x, float min, float max)
 	return (x < min ? min : (x > max ? max : x));
 }
 
+/*
+ * The box of what is left of triangle abc between lo and hi along an axis,
+ * false if nothing is.  For spatial splits, where a triangle's own box
+ * would leave most of the benefit on the table.
+ */
+inline bool
+clipped_triangle_box(const Point3D& a, const Point3D& b, const Point3D& c, int axis, float lo, float hi,
+        BBox& box)
+{
+	/* the corners inside the slab and the points where edges cross its planes */
+	const Point3D *v[3] = { &a, &b, &c };
+	float *b0 = &box.x0, *b1 = &box.x1;
+	for (int i = 0; i < 3; i++) {
+		b0[i] = FLT_MAX;
+		b1[i] = -FLT_MAX;
+	}
+	bool any = false;
+	for (int k = 0; k < 3; k++)
+	{
+		const Point3D& p = *v[k];
+		const Point3D& q = *v[(k + 1) % 3];
+		float dp = (&p.x)[axis], dq = (&q.x)[axis];
+		Point3D points[3];
+		int n = 0;
+		if (dp >= lo && dp <= hi)
+			points[n++] = p;
+		if ((dp < lo) != (dq < lo))
+			points[n++] = p + (q - p) * ((lo - dp) / (dq - dp));
+		if ((dp > hi) != (dq > hi))
+			points[n++] = p + (q - p) * ((hi - dp) / (dq - dp));
+		for (int j = 0; j < n; j++)
+			for (int i = 0; i < 3; i++) {
+				b0[i] = std::min(b0[i], (&points[j].x)[i]);
+				b1[i] = std::max(b1[i], (&points[j].x)[i]);
+			}
+		any |= n > 0;
+	}
+	if (!any)
+		return false;
+	/* the cut itself lies on the planes */
+	b0[axis] = std::max(b0[axis], lo);
+	b1[axis] = std::min(b1[axis], hi);
+	return true;
+}
+
+enum ObjectKind
+{
+    OBJECT_SPHERE = 1,
+    OBJECT_INVERTED_SPHERE,
+    OBJECT_PLANE,
+    OBJECT_RECTANGLE,
+    OBJECT_TRIANGLE,
+    OBJECT_MESH_TRIANGLES,
+    OBJECT_COMPOUND,
+    OBJECT_GRID,
+    OBJECT_INSTANCE,
+    OBJECT_BVH,
+    OBJECT_SPHERE_CLOUD,
+    OBJECT_COMPACT_MESH
+};
+
+/*
+ * An object as it is stored in a scene snapshot: its kind, its material and
+ * the parameters its constructor takes.  References to other records (the
+ * children of a compound, the mesh of a triangle) are indices that the
+ * snapshot writer fills in.  Mesh triangles have no record each: one
+ * record stands for a run of them, read from the mesh's own indices.
+ */
+struct ObjectRecord
+{
+    unsigned int kind;
+    unsigned int material;
+    unsigned int ref;      /* first child, mesh, or instanced object */
+    unsigned int count;    /* number of children, or of triangles in a run */
+    int index[3];          /* the first triangle of a run, or a table of the snapshot's */
+    float p[12];
+};
+
 class Object
 {
 protected:
 	const float eps = 1e-4;
 
 public:
-	Material *material_ptr;
+	MaterialId material_id;
 	Sampler *sampler_ptr;
 
-	Object(void) {}
+	Object(void): material_id(0) {}
 	virtual ~Object(void) {}
 
-	inline void set_material(Material *m_ptr_) { material_ptr = m_ptr_; }
+	inline void set_material(MaterialId id_) { material_id = id_; }
 	inline void set_sampler(Sampler *s_ptr_) {sampler_ptr = s_ptr_; }
 
 	virtual bool hit(const Ray& r, float& tmin, ShadeRec& sr) = 0;
@@ -47,6 +126,14 @@ public:
 
 	virtual BBox get_bounding_box(void) = 0;
 
+	/* bounds of the part between lo and hi along an axis, for spatial splits */
+	virtual BBox get_clipped_bounding_box(int axis, float lo, float hi) {
+        BBox b = get_bounding_box();
+        (&b.x0)[axis] = std::max((&b.x0)[axis], lo);
+        (&b.x1)[axis] = std::min((&b.x1)[axis], hi);
+        return b;
+    }
+
 	virtual Point3D sample(void) {
         return Point3D();
     }
@@ -57,6 +144,17 @@ public:
         return Normal();
     }
 
+	/* false for objects that cannot be written to a snapshot */
+	virtual bool save(ObjectRecord&) const {
+        return false;
+    }
+
+	/* what an object save() refuses is, for the error, and how to leave it out */
+	virtual const char* snapshot_kind(const char*& hint) const {
+        hint = "";
+        return "an object of the scene";
+    }
+
 };
 
 class Sphere: public Object
@@ -69,7 +167,7 @@ public:
 
     Sphere() {}
     /* center radius color */
-    Sphere(const Point3D& ct, const float r, Material* m) :
+    Sphere(const Point3D& ct, const float r, MaterialId m) :
         center(ct),
         radius(r)
     {
@@ -115,6 +213,34 @@ public:
         return hit(ray, tmin, dummy_sr);
     }
 
+    /* uniform over the surface, so it can act as an area light */
+    Point3D sample(void)
+    {
+        Point2D sp = sampler_ptr->sample_unit_square();
+        float z = 1.0f - 2.0f * sp.x;
+        float r = sqrtf(std::max(0.0f, 1.0f - z * z));
+        float phi = 2.0f * (float)M_PI * sp.y;
+        return center + Vector3D(r * cosf(phi), r * sinf(phi), z) * radius;
+    }
+
+    float pdf(ShadeRec&)
+    {
+        return 1.0f / (4.0f * (float)M_PI * radius * radius);
+    }
+
+    Normal get_normal(const Point3D& p)
+    {
+        return (p - center) / radius;
+    }
+
+    bool save(ObjectRecord& r) const
+    {
+        r.kind = OBJECT_SPHERE;
+        r.p[0] = center.x; r.p[1] = center.y; r.p[2] = center.z;
+        r.p[3] = radius;
+        return true;
+    }
+
     void set_center(float x, float y, float z)
     {
         center = Point3D(x, y, z);
@@ -132,6 +258,35 @@ public:
 
 };
 
+/* a sphere seen from inside: same surface, normals facing the center */
+class InvertedSphere: public Sphere
+{
+public:
+    InvertedSphere(const Point3D& ct, const float r, MaterialId m):
+        Sphere(ct, r, m)
+    {}
+
+    bool hit(const Ray& ray, float& tmin, ShadeRec& sr)
+    {
+        if (!Sphere::hit(ray, tmin, sr))
+            return false;
+        sr.normal = -sr.normal;
+        return true;
+    }
+
+    Normal get_normal(const Point3D& p)
+    {
+        return -Sphere::get_normal(p);
+    }
+
+    bool save(ObjectRecord& r) const
+    {
+        Sphere::save(r);
+        r.kind = OBJECT_INVERTED_SPHERE;
+        return true;
+    }
+};
+
 class Plane: public Object
 {
 public:
@@ -171,6 +326,14 @@ public:
         return BBox();
     }
 
+    bool save(ObjectRecord& r) const
+    {
+        r.kind = OBJECT_PLANE;
+        r.p[0] = point.x; r.p[1] = point.y; r.p[2] = point.z;
+        r.p[3] = normal.x; r.p[4] = normal.y; r.p[5] = normal.z;
+        return true;
+    }
+
 private:
 	Point3D point;
 	Normal normal;
@@ -254,11 +417,20 @@ public:
         y0 = min(min(p0.y, p1.y), min(p2.y, p3.y));
         z0 = min(min(p0.z, p1.z), min(p2.z, p3.z));
         x1 = max(max(p0.x, p1.x), max(p2.x, p3.x));
-        y1 = max(max(p0.y, p1.y), max(p2.x, p3.x));
+        y1 = max(max(p0.y, p1.y), max(p2.y, p3.y));
         z1 = max(max(p0.z, p1.z), max(p2.z, p3.z));
         return BBox(x0, y0, z0, x1, y1, z1);
     }
 
+    bool save(ObjectRecord& r) const
+    {
+        r.kind = OBJECT_RECTANGLE;
+        r.p[0] = p0.x; r.p[1] = p0.y; r.p[2] = p0.z;
+        r.p[3] = a.x; r.p[4] = a.y; r.p[5] = a.z;
+        r.p[6] = b.x; r.p[7] = b.y; r.p[8] = b.z;
+        return true;
+    }
+
 private:
 	Point3D p0;
 	Vector3D a, b;
@@ -349,6 +521,23 @@ public:
         return BBox(x0, y0, z0, x1, y1, z1);
     }
 
+    BBox get_clipped_bounding_box(int axis, float lo, float hi)
+    {
+        BBox b;
+        if (!clipped_triangle_box(v0, v1, v2, axis, lo, hi, b))
+            return Object::get_clipped_bounding_box(axis, lo, hi);
+        return b;
+    }
+
+    bool save(ObjectRecord& r) const
+    {
+        r.kind = OBJECT_TRIANGLE;
+        r.p[0] = v0.x; r.p[1] = v0.y; r.p[2] = v0.z;
+        r.p[3] = v1.x; r.p[4] = v1.y; r.p[5] = v1.z;
+        r.p[6] = v2.x; r.p[7] = v2.y; r.p[8] = v2.z;
+        return true;
+    }
+
 };
 
 class Compound: public Object
@@ -357,11 +546,11 @@ public:
     Compound(void):
         object_ptrs()
     {}
-    virtual void set_material(Material* m_ptr_)
+    virtual void set_material(MaterialId id_)
     {
-        material_ptr = m_ptr_;
+        material_id = id_;
         for (Object* obj_ptr: object_ptrs)
-            obj_ptr->set_material(m_ptr_);
+            obj_ptr->set_material(id_);
     }
 
     void add_object(Object* obj_ptr_)
@@ -369,6 +558,27 @@ public:
         object_ptrs.push_back(obj_ptr_);
     }
 
+    /* room for n more objects, before adding them one by one */
+    void reserve_objects(size_t n)
+    {
+        object_ptrs.reserve(object_ptrs.size() + n);
+    }
+
+    const tracked_vector<Object*, MEM_ACCEL>& get_objects(void) const
+    {
+        return object_ptrs;
+    }
+
+    /* once the objects are in; a plain compound tests them all and needs none */
+    virtual void build(void)
+    {}
+
+    bool save(ObjectRecord& r) const
+    {
+        r.kind = OBJECT_COMPOUND;
+        return true;
+    }
+
     bool hit(const Ray& ray, float& tmin, ShadeRec& sr)
     {
         float t;
@@ -384,7 +594,7 @@ public:
                 hit = true;
                 tmin = t;
                 normal = sr.normal;
-                material_ptr = obj_ptr->material_ptr;
+                material_id = obj_ptr->material_id;
                 local_hit_point = sr.local_hit_point;
             }
         }
@@ -409,7 +619,7 @@ public:
         BBox bbox;
         using namespace std;
         float x0 = FLT_MAX, y0 = FLT_MAX, z0 = FLT_MAX;
-        float x1 = FLT_MIN, y1 = FLT_MIN, z1 = FLT_MIN;
+        float x1 = -FLT_MAX, y1 = -FLT_MAX, z1 = -FLT_MAX;
         for (Object* obj_ptr: object_ptrs)
         {
             bbox = obj_ptr->get_bounding_box();
@@ -424,6 +634,6 @@ public:
     }
 
 protected:
-	std::vector<Object*> object_ptrs;
+	tracked_vector<Object*, MEM_ACCEL> object_ptrs;
 };
 #endif
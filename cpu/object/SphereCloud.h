@@ -0,0 +1,366 @@
+/* ====================================================
+#   File Name     : SphereCloud.h
+# ====================================================*/
+
+#ifndef _SPHERE_CLOUD_H
+#define _SPHERE_CLOUD_H
+
+#include "BBox.h"
+#include "Object.h"
+#include "BoxTree.h"
+#include "../MemoryStats.h"
+
+#include <cfloat>
+#include <vector>
+#include <algorithm>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CLOUD_AVX 1
+#include <immintrin.h>
+#endif
+
+/* spheres tested together by the AVX kernel, and per leaf at most */
+const unsigned int CLOUD_BATCH = 8;
+const unsigned int CLOUD_LEAF_SIZE = 2 * CLOUD_BATCH;
+
+/*
+ * A built cloud as it is stored in a scene snapshot: its spheres are four
+ * runs of stride floats each, x, y, z and radius, then its nodes.
+ */
+struct CloudRecord
+{
+    unsigned long long first_sphere, stride;     /* into the snapshot's sphere table */
+    unsigned long long first_node, num_nodes;    /* into its node table */
+    unsigned long long count;
+};
+
+/*
+ * Any number of spheres of one material as a single object, for particle
+ * data.  Centres and radii are kept in four arrays, 16 bytes a sphere,
+ * with no object, vtable or pointer each; build() sorts them into the
+ * leaves of the cloud's own BVH, so a leaf is a run of each array and is
+ * tested CLOUD_BATCH spheres at a time with AVX where the CPU has it.
+ */
+class SphereCloud: public Object
+{
+public:
+    SphereCloud(void):
+        cx(),
+        cy(),
+        cz(),
+        radius(),
+        nodes(),
+        xs(nullptr),
+        ys(nullptr),
+        zs(nullptr),
+        rs(nullptr),
+        tree(nullptr),
+        tree_size(0),
+        count(0),
+        use_avx(has_avx())
+    {}
+
+    /* room for n spheres, each set with set_sphere() before build() */
+    void resize(size_t n)
+    {
+        /* a batch may read past the last sphere; the lanes are masked out */
+        count = n;
+        cx.assign(n + CLOUD_BATCH - 1, 0.0f);
+        cy.assign(n + CLOUD_BATCH - 1, 0.0f);
+        cz.assign(n + CLOUD_BATCH - 1, 0.0f);
+        radius.assign(n + CLOUD_BATCH - 1, 0.0f);
+    }
+
+    void set_sphere(size_t i, const Point3D& center, float r)
+    {
+        cx[i] = center.x;
+        cy[i] = center.y;
+        cz[i] = center.z;
+        radius[i] = r;
+    }
+
+    size_t size(void) const
+    {
+        return count;
+    }
+
+    size_t num_nodes(void) const
+    {
+        return tree_size;
+    }
+
+    /* spheres and tree together */
+    size_t bytes(void) const
+    {
+        return 4 * cx.capacity() * sizeof(float) + nodes.capacity() * sizeof(BoxNode);
+    }
+
+    /* binned SAH over the centres, reordering the spheres as it goes */
+    void build(void)
+    {
+        tracked_vector<BoxNode, MEM_ACCEL>().swap(nodes);
+        use_vectors();
+        if (count == 0)
+            return;
+        /* leaves come out about 11 spheres full */
+        nodes.reserve(count / 5 + 1);
+        Spheres spheres = { *this };
+        build_box_tree(nodes, spheres, count, CLOUD_LEAF_SIZE);
+        if (nodes.capacity() > nodes.size() + nodes.size() / 4)
+            nodes.shrink_to_fit();
+        use_vectors();
+    }
+
+    /* adopt spheres and a tree built earlier, e.g. those of a mapped snapshot */
+    void use_arrays(const CloudRecord& r, const float *spheres, const BoxNode *nodes_)
+    {
+        tracked_vector<float, MEM_MESHES>().swap(cx);
+        tracked_vector<float, MEM_MESHES>().swap(cy);
+        tracked_vector<float, MEM_MESHES>().swap(cz);
+        tracked_vector<float, MEM_MESHES>().swap(radius);
+        tracked_vector<BoxNode, MEM_ACCEL>().swap(nodes);
+        count = r.count;
+        xs = spheres;
+        ys = spheres + r.stride;
+        zs = spheres + 2 * r.stride;
+        rs = spheres + 3 * r.stride;
+        tree = nodes_;
+        tree_size = r.num_nodes;
+    }
+
+    /* the first of the four runs of spheres, and the nodes */
+    void save(CloudRecord& r) const
+    {
+        r.first_sphere = r.first_node = 0;
+        r.stride = count ? count + CLOUD_BATCH - 1 : 0;
+        r.num_nodes = tree_size;
+        r.count = count;
+    }
+
+    bool save(ObjectRecord& r) const
+    {
+        r.kind = OBJECT_SPHERE_CLOUD;
+        return true;
+    }
+
+    const float* get_spheres(int axis) const
+    {
+        return axis == 0 ? xs : axis == 1 ? ys : axis == 2 ? zs : rs;
+    }
+
+    const BoxNode* get_nodes(void) const
+    {
+        return tree;
+    }
+
+    bool hit(const Ray& ray, float& tmin, ShadeRec& sr)
+    {
+        if (tree_size == 0)
+            return false;
+        Vector3D inv(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+        float a = ray.d.x * ray.d.x + ray.d.y * ray.d.y + ray.d.z * ray.d.z;
+
+        float t;
+        tmin = FLT_MAX;
+        size_t best = count;
+        unsigned int stack[BOX_TREE_STACK_SIZE];
+        int top = 0;
+        unsigned int i = 0;
+        if (!hit_box(tree[0].bbox, ray, inv, tmin, t))
+            return false;
+        for (;;)
+        {
+            const BoxNode& node = tree[i];
+            if (node.count)
+            {
+#if defined(CLOUD_AVX)
+                if (use_avx)
+                    hit_leaf_avx(ray, a, node.offset, node.count, tmin, best);
+                else
+#endif
+                    hit_leaf(ray, a, node.offset, node.count, tmin, best);
+            }
+            else
+            {
+                /* nearer child first, the other one saved for later */
+                float tl, tr;
+                bool l = hit_box(tree[i + 1].bbox, ray, inv, tmin, tl);
+                bool r = hit_box(tree[node.offset].bbox, ray, inv, tmin, tr);
+                if (l && r) {
+                    bool left_first = tl <= tr;
+                    stack[top++] = left_first ? node.offset : i + 1;
+                    i = left_first ? i + 1 : node.offset;
+                    continue;
+                }
+                if (l || r) {
+                    i = l ? i + 1 : node.offset;
+                    continue;
+                }
+            }
+            if (top == 0)
+                break;
+            i = stack[--top];
+        }
+
+        if (best == count)
+            return false;
+        Vector3D temp = ray.o - Point3D(xs[best], ys[best], zs[best]);
+        sr.normal = temp + ray.d * tmin;
+        sr.local_hit_point = ray.o + ray.d * tmin;
+        return true;
+    }
+
+    bool shadow_hit(const Ray& ray, float& tmin)
+    {
+        ShadeRec dummy_sr;
+        return hit(ray, tmin, dummy_sr);
+    }
+
+    BBox get_bounding_box(void)
+    {
+        if (tree_size == 0)
+            return BBox(0, 0, 0, 0, 0, 0);
+        const float *b = tree[0].bbox;
+        return BBox(b[0], b[1], b[2], b[3], b[4], b[5]);
+    }
+
+private:
+    static bool has_avx(void)
+    {
+#if defined(CLOUD_AVX)
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx");
+#else
+        return false;
+#endif
+    }
+
+    /*
+     * The nearest of spheres first .. first + n - 1 beyond eps and before
+     * tmin, which it moves up to; best is where it was found.  The AVX
+     * kernel below does the same arithmetic in the same order, so the two
+     * agree to the bit.
+     */
+    void hit_leaf(const Ray& ray, float a, unsigned int first, unsigned int n, float& tmin, size_t& best) const
+    {
+        for (unsigned int k = first; k < first + n; k++)
+        {
+            float x = ray.o.x - xs[k], y = ray.o.y - ys[k], z = ray.o.z - zs[k];
+            float b = x * ray.d.x + y * ray.d.y + z * ray.d.z;
+            float c = x * x + y * y + z * z - rs[k] * rs[k];
+            float disc = b * b - a * c;
+            if (!(disc >= 0))
+                continue;
+            float e = sqrtf(disc);
+            float t = (-b - e) / a;
+            if (!(t > eps))
+                t = (-b + e) / a;
+            if (t > eps && t < tmin) {
+                tmin = t;
+                best = k;
+            }
+        }
+    }
+
+#if defined(CLOUD_AVX)
+    __attribute__((target("avx")))
+    void hit_leaf_avx(const Ray& ray, float a, unsigned int first, unsigned int n, float& tmin, size_t& best) const
+    {
+        const __m256 ox = _mm256_set1_ps(ray.o.x), oy = _mm256_set1_ps(ray.o.y), oz = _mm256_set1_ps(ray.o.z);
+        const __m256 dx = _mm256_set1_ps(ray.d.x), dy = _mm256_set1_ps(ray.d.y), dz = _mm256_set1_ps(ray.d.z);
+        const __m256 va = _mm256_set1_ps(a), veps = _mm256_set1_ps(eps);
+        const __m256 zero = _mm256_setzero_ps(), sign = _mm256_set1_ps(-0.0f);
+        const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+        for (unsigned int k = 0; k < n; k += CLOUD_BATCH)
+        {
+            unsigned int j = first + k;
+            __m256 x = _mm256_sub_ps(ox, _mm256_loadu_ps(xs + j));
+            __m256 y = _mm256_sub_ps(oy, _mm256_loadu_ps(ys + j));
+            __m256 z = _mm256_sub_ps(oz, _mm256_loadu_ps(zs + j));
+            __m256 r = _mm256_loadu_ps(rs + j);
+            __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, dx), _mm256_mul_ps(y, dy)), _mm256_mul_ps(z, dz));
+            __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)),
+                        _mm256_mul_ps(z, z)), _mm256_mul_ps(r, r));
+            __m256 disc = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(va, c));
+            __m256 valid = _mm256_and_ps(_mm256_cmp_ps(disc, zero, _CMP_GE_OQ),
+                    _mm256_cmp_ps(lane, _mm256_set1_ps((float)(n - k)), _CMP_LT_OQ));
+            if (!_mm256_movemask_ps(valid))
+                continue;
+
+            __m256 e = _mm256_sqrt_ps(_mm256_max_ps(disc, zero));
+            __m256 nb = _mm256_xor_ps(b, sign);
+            __m256 t0 = _mm256_div_ps(_mm256_sub_ps(nb, e), va);
+            __m256 t1 = _mm256_div_ps(_mm256_add_ps(nb, e), va);
+            __m256 t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, veps, _CMP_GT_OQ));
+            __m256 hit = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, veps, _CMP_GT_OQ),
+                        _mm256_cmp_ps(t, _mm256_set1_ps(tmin), _CMP_LT_OQ)));
+            int mask = _mm256_movemask_ps(hit);
+            if (!mask)
+                continue;
+            float ts[CLOUD_BATCH];
+            _mm256_storeu_ps(ts, t);
+            for (unsigned int l = 0; l < CLOUD_BATCH; l++)
+                if ((mask >> l & 1) && ts[l] < tmin) {
+                    tmin = ts[l];
+                    best = j + l;
+                }
+        }
+    }
+#endif
+
+    void use_vectors(void)
+    {
+        xs = cx.data();
+        ys = cy.data();
+        zs = cz.data();
+        rs = radius.data();
+        tree = nodes.data();
+        tree_size = nodes.size();
+    }
+
+    /* ------------------------------------------------------------ build */
+
+    /* the spheres as build_box_tree() sees them, sorted in place */
+    struct Spheres
+    {
+        SphereCloud& cloud;
+
+        void add(size_t k, float *box, float *cbox) const
+        {
+            float c[3] = { cloud.cx[k], cloud.cy[k], cloud.cz[k] }, r = cloud.radius[k];
+            for (int a = 0; a < 3; a++) {
+                box[a] = std::min(box[a], c[a] - r);
+                box[a + 3] = std::max(box[a + 3], c[a] + r);
+                cbox[a] = std::min(cbox[a], c[a]);
+                cbox[a + 3] = std::max(cbox[a + 3], c[a]);
+            }
+        }
+
+        float centroid(size_t k, int axis) const
+        {
+            return axis == 0 ? cloud.cx[k] : axis == 1 ? cloud.cy[k] : cloud.cz[k];
+        }
+
+        void swap(size_t i, size_t j)
+        {
+            std::swap(cloud.cx[i], cloud.cx[j]);
+            std::swap(cloud.cy[i], cloud.cy[j]);
+            std::swap(cloud.cz[i], cloud.cz[j]);
+            std::swap(cloud.radius[i], cloud.radius[j]);
+        }
+    };
+
+private:
+    tracked_vector<float, MEM_MESHES> cx;
+    tracked_vector<float, MEM_MESHES> cy;
+    tracked_vector<float, MEM_MESHES> cz;
+    tracked_vector<float, MEM_MESHES> radius;
+    tracked_vector<BoxNode, MEM_ACCEL> nodes;
+    const float *xs, *ys, *zs, *rs;    /* cx.data() and so on, or mapped */
+    const BoxNode *tree;               /* nodes.data(), or mapped */
+    size_t tree_size;
+    size_t count;
+    bool use_avx;
+};
+
+#endif // _SPHERE_CLOUD_H
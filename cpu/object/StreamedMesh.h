@@ -0,0 +1,169 @@
+/* ====================================================
+#   File Name     : StreamedMesh.h
+# ====================================================*/
+
+#ifndef _STREAMED_MESH_H
+#define _STREAMED_MESH_H
+
+#include "BBox.h"
+#include "Object.h"
+#include "BoxTree.h"
+#include "CompactMesh.h"
+#include "../ChunkStore.h"
+
+#include <cfloat>
+#include <memory>
+#include <vector>
+#include <algorithm>
+
+/* triangles per piece on disk at most, about a megabyte and a quarter of it */
+const size_t STREAM_CHUNK_TRIANGLES = 1 << 16;
+/* pieces a ray can put off reading at once; past that they are read one by one */
+const int STREAM_PENDING = 64;
+
+/*
+ * A CompactMesh whose tree is cut into pieces of nearby triangles that
+ * live in a ChunkStore, so a mesh far larger than memory can still be
+ * rendered.  Only the nodes above the cut stay in memory.  A ray first
+ * tests the pieces it reaches that are already in memory and puts the
+ * others off; once those have had their say, the pieces still nearer than
+ * the hit are read in one batch and tested nearest first.  A nearby hit
+ * among resident pieces therefore spares every read behind it.
+ */
+class StreamedMesh: public Object
+{
+public:
+    StreamedMesh(ChunkStore *store_):
+        store(store_),
+        nodes()
+    {}
+
+    /* whole is cut up and written out; it is not needed afterwards */
+    bool build(const CompactMesh& whole)
+    {
+        bool ok = true;
+        std::vector<BoxNode> top;
+        whole.split(STREAM_CHUNK_TRIANGLES, top, [&](const CompactMesh& piece) {
+            unsigned int id = 0;
+            if (ok)
+                ok = store->add(piece, id);
+            return id;
+        });
+        nodes.assign(top.begin(), top.end());
+        return ok;
+    }
+
+    bool hit(const Ray& ray, float& tmin, ShadeRec& sr)
+    {
+        tmin = FLT_MAX;
+        if (nodes.empty())
+            return false;
+        Vector3D inv(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+
+        struct Entry { unsigned int node; float t; };
+        Entry stack[BOX_TREE_STACK_SIZE];
+        Entry pending[STREAM_PENDING];
+        int top = 0, num_pending = 0;
+        bool found = false;
+        unsigned int i = 0;
+        float tnear;
+        if (!hit_box(nodes[0].bbox, ray, inv, tmin, tnear))
+            return false;
+        for (;;)
+        {
+            const BoxNode& node = nodes[i];
+            if (node.count)
+            {
+                std::shared_ptr<CompactMesh> piece = store->get(node.offset);
+                if (!piece && num_pending == STREAM_PENDING)
+                    store->page_in(&node.offset, 1, &piece);
+                if (piece)
+                    found |= hit_piece(*piece, ray, tmin, sr);
+                else
+                    pending[num_pending++] = { node.offset, tnear };
+            }
+            else
+            {
+                float tl, tr;
+                bool l = hit_box(nodes[i + 1].bbox, ray, inv, tmin, tl);
+                bool r = hit_box(nodes[node.offset].bbox, ray, inv, tmin, tr);
+                if (l && r) {
+                    bool left_first = tl <= tr;
+                    stack[top++] = left_first ? Entry{ node.offset, tr } : Entry{ i + 1, tl };
+                    i = left_first ? i + 1 : node.offset;
+                    tnear = left_first ? tl : tr;
+                    continue;
+                }
+                if (l || r) {
+                    i = l ? i + 1 : node.offset;
+                    tnear = l ? tl : tr;
+                    continue;
+                }
+            }
+            while (top > 0 && stack[top - 1].t >= tmin)
+                top--;
+            if (top == 0)
+                break;
+            top--;
+            i = stack[top].node;
+            tnear = stack[top].t;
+        }
+
+        if (num_pending)
+        {
+            std::sort(pending, pending + num_pending, [](const Entry& a, const Entry& b) { return a.t < b.t; });
+            while (num_pending > 0 && pending[num_pending - 1].t >= tmin)
+                num_pending--;
+            unsigned int ids[STREAM_PENDING];
+            std::shared_ptr<CompactMesh> pieces[STREAM_PENDING];
+            for (int k = 0; k < num_pending; k++)
+                ids[k] = pending[k].node;
+            store->page_in(ids, num_pending, pieces);
+            for (int k = 0; k < num_pending && pending[k].t < tmin; k++)
+                if (pieces[k])
+                    found |= hit_piece(*pieces[k], ray, tmin, sr);
+        }
+        return found;
+    }
+
+    bool shadow_hit(const Ray& ray, float& tmin)
+    {
+        ShadeRec sr;
+        return hit(ray, tmin, sr);
+    }
+
+    BBox get_bounding_box(void)
+    {
+        if (nodes.empty())
+            return BBox(0, 0, 0, 0, 0, 0);
+        const float *b = nodes[0].bbox;
+        return BBox(b[0], b[1], b[2], b[3], b[4], b[5]);
+    }
+
+    /* its pieces live in a chunk store that goes with the run */
+    const char* snapshot_kind(const char*& hint) const
+    {
+        hint = "; save without that option";
+        return "a mesh read with --stream-meshes";
+    }
+
+private:
+    static bool hit_piece(CompactMesh& piece, const Ray& ray, float& tmin, ShadeRec& sr)
+    {
+        float t;
+        ShadeRec s;
+        if (!piece.hit(ray, t, s) || t >= tmin)
+            return false;
+        tmin = t;
+        sr.normal = s.normal;
+        sr.local_hit_point = s.local_hit_point;
+        return true;
+    }
+
+private:
+    ChunkStore *store;
+    /* the tree above the cut; a leaf's offset is its piece in the store */
+    tracked_vector<BoxNode, MEM_ACCEL> nodes;
+};
+
+#endif // _STREAMED_MESH_H
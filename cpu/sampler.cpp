@@ -7,16 +7,89 @@
 # ====================================================*/
 
 #include "sampler.h"
-#include <ctime>
 #include <cstdlib>
 #include <algorithm>
 
 #define PI 3.141592
 
+/*
+ * xorshift64* generator shared by all sampling code on a thread.  Its whole
+ * state is one word, so a checkpoint can capture it and a resumed render
+ * continues with exactly the numbers an uninterrupted one would have drawn.
+ */
+static thread_local unsigned long long rand_state = 0x2545F4914F6CDD1DULL;
+
+unsigned int
+rand_int()
+{
+	rand_state ^= rand_state >> 12;
+	rand_state ^= rand_state << 25;
+	rand_state ^= rand_state >> 27;
+	return (unsigned int)((rand_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
 float
 rand_float()
 {
-	return (float)(rand() + clock()) / (float)(RAND_MAX);
+	return (float)(rand_int() >> 8) * (1.0f / 16777216.0f);
+}
+
+void
+seed_rand(unsigned long long seed)
+{
+	/* splitmix64 so that nearby seeds give unrelated streams; never zero */
+	seed += 0x9E3779B97F4A7C15ULL;
+	seed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	seed = (seed ^ (seed >> 27)) * 0x94D049BB133111EBULL;
+	seed ^= seed >> 31;
+	rand_state = seed ? seed : 0x2545F4914F6CDD1DULL;
+}
+
+unsigned long long
+get_rand_state(void)
+{
+	return rand_state;
+}
+
+void
+set_rand_state(unsigned long long state)
+{
+	rand_state = state;
+}
+
+/*
+ * The pattern sizes the renderer asks for in practice.  Each table is a
+ * constant expression, so the compiler evaluates it and stores the result
+ * in .rodata.
+ */
+static constexpr NRooksTable<16> nrooks_16(0x9E3779B97F4A7C15ULL);
+static constexpr NRooksTable<64> nrooks_64(0xBF58476D1CE4E5B9ULL);
+static constexpr NRooksTable<100> nrooks_100(0x94D049BB133111EBULL);
+
+static const SampleTableView sample_tables[] = {
+	{ 16, nrooks_16.square, nrooks_16.disk, nrooks_16.hemisphere },
+	{ 64, nrooks_64.square, nrooks_64.disk, nrooks_64.hemisphere },
+	{ 100, nrooks_100.square, nrooks_100.disk, nrooks_100.hemisphere },
+};
+
+const SampleTableView*
+find_sample_table(int num_samples)
+{
+	for (const SampleTableView& t: sample_tables)
+		if (t.num_samples == num_samples)
+			return &t;
+	return nullptr;
+}
+
+/*
+ * Built on first use and never destroyed, so samplers created during static
+ * init or torn down with other globals at exit can always (un)register.
+ */
+std::vector<Sampler*>&
+Sampler::registry(void)
+{
+	static std::vector<Sampler*> *live = new std::vector<Sampler*>;
+	return *live;
 }
 
 Sampler::Sampler():
@@ -24,55 +97,139 @@ Sampler::Sampler():
 	num_sets(0),
 	count(0),
 	jump(0),
+	square_ptr(nullptr),
+	disk_ptr(nullptr),
+	hemisphere_ptr(nullptr),
+	table(nullptr),
 	samples(),
 	samples_disk(),
 	shuffled_indices()
-{}
+{
+	registry().push_back(this);
+}
 
 Sampler::Sampler(int num_samples_):
 	num_samples(num_samples_),
-	num_sets(83),
+	num_sets(SAMPLE_SETS),
 	count(0),
 	jump(0),
+	square_ptr(nullptr),
+	disk_ptr(nullptr),
+	hemisphere_ptr(nullptr),
+	table(nullptr),
 	samples(),
 	samples_disk(),
 	shuffled_indices()
-{}
+{
+	registry().push_back(this);
+}
+
+Sampler::Sampler(const Sampler& s):
+	num_samples(s.num_samples),
+	num_sets(s.num_sets),
+	table(s.table),
+	samples(s.samples),
+	samples_disk(s.samples_disk),
+	samples_hemisphere(s.samples_hemisphere),
+	shuffled_indices(s.shuffled_indices),
+	count(s.count),
+	jump(s.jump)
+{
+	rebind(s);
+	registry().push_back(this);
+}
+
+Sampler&
+Sampler::operator = (const Sampler& s)
+{
+	if (this == &s)
+		return *this;
+	num_samples = s.num_samples;
+	num_sets = s.num_sets;
+	table = s.table;
+	samples = s.samples;
+	samples_disk = s.samples_disk;
+	samples_hemisphere = s.samples_hemisphere;
+	shuffled_indices = s.shuffled_indices;
+	count = s.count;
+	jump = s.jump;
+	rebind(s);
+	return *this;
+}
+
+/* after a copy: shared tables stay shared, owned patterns follow the copy */
+void
+Sampler::rebind(const Sampler& s)
+{
+	square_ptr = s.square_ptr == s.samples.data() ? samples.data() : s.square_ptr;
+	disk_ptr = s.disk_ptr == s.samples_disk.data() ? samples_disk.data() : s.disk_ptr;
+	hemisphere_ptr = s.hemisphere_ptr == s.samples_hemisphere.data() ? samples_hemisphere.data() : s.hemisphere_ptr;
+}
 
 Sampler::~Sampler()
-{}
+{
+	std::vector<Sampler*>& live = registry();
+	live.erase(std::find(live.begin(), live.end(), this));
+}
+
+void
+Sampler::get_state(unsigned long& count_, int& jump_) const
+{
+	count_ = count;
+	jump_ = jump;
+}
+
+void
+Sampler::set_state(unsigned long count_, int jump_)
+{
+	count = count_;
+	jump = jump_;
+}
+
+const std::vector<Sampler*>&
+Sampler::live_samplers(void)
+{
+	return registry();
+}
 
 Point2D
 Sampler::sample_unit_square(void)
 {
 	if (count % num_samples == 0)
-		jump = (rand() % num_sets) * num_samples;
-	return samples[jump + count++ % num_samples];
+		jump = (rand_int() % num_sets) * num_samples;
+	return square_ptr[jump + count++ % num_samples];
 }
 
 Point2D
 Sampler::sample_unit_disk(void)
 {
 	if (count % num_samples == 0)
-		jump = (rand() % num_sets) * num_samples;
-	return samples_disk[jump + count++ % num_samples];
+		jump = (rand_int() % num_sets) * num_samples;
+	return disk_ptr[jump + count++ % num_samples];
 }
 
 Point3D
 Sampler::sample_unit_hemisphere(void)
 {
 	if (count % num_samples == 0)
-		jump = (rand() % num_sets) * num_samples;
-	return samples_hemisphere[jump + count++ % num_samples];
+		jump = (rand_int() % num_sets) * num_samples;
+	return hemisphere_ptr[jump + count++ % num_samples];
 }
 
 void
 Sampler::map_samples_to_unit_disk(void)
 {
+	if (table) {
+		disk_ptr = table->disk;
+		return;
+	}
+
 	float r, phi;
 	float x, y;
-	for (Point2D& p: samples)
+	samples_disk.clear();
+	for (int k = 0; k < num_samples * num_sets; k++)
 	{
+		const Point2D& p = square_ptr[k];
 		x = 2 * p.x - 1;
 		y = 2 * p.y - 1;
 		if (x > -y)
@@ -116,13 +273,21 @@ Sampler::map_samples_to_unit_disk(void)
 		phi *= PI / 4.0;
 		samples_disk.push_back(Point2D(r * cosf(phi), r * sinf(phi)));
 	}
+	disk_ptr = samples_disk.data();
 }
 
 void
 Sampler::map_samples_to_hemisphere(const float e = 1)
 {
-	for (Point2D& p: samples)
+	samples_hemisphere.clear();
+	if (table && e == 1) {
+		hemisphere_ptr = table->hemisphere;
+		return;
+	}
+
+	for (int k = 0; k < num_samples * num_sets; k++)
 	{
+		const Point2D& p = square_ptr[k];
 		float cos_phi = cosf(2 * PI * p.x);
 		float sin_phi = sinf(2 * PI * p.x);
 		float cos_theta = powf((1 - p.y), 1 / (e + 1));
@@ -131,6 +296,7 @@ Sampler::map_samples_to_hemisphere(const float e = 1)
 											 sin_theta * sin_phi,
 											 cos_theta));
 	}
+	hemisphere_ptr = samples_hemisphere.data();
 }
 
 /* inplementation of NRooks */
@@ -148,6 +314,12 @@ NRooks::NRooks(int num_samples_):
 void
 NRooks::generate_samples(void)
 {
+	table = num_sets == SAMPLE_SETS ? find_sample_table(num_samples) : nullptr;
+	if (table) {
+		square_ptr = table->square;
+		return;
+	}
+
 	for (int p = 0; p < num_sets; p++)
 		for (int j = 0; j < num_samples; j++)
 		{
@@ -156,6 +328,7 @@ NRooks::generate_samples(void)
 		}
 	shuffle_x_coordinates();
 	shuffle_y_coordinates();
+	square_ptr = samples.data();
 }
 
 void
@@ -164,9 +337,9 @@ NRooks::shuffle_x_coordinates()
 	for (int p = 0; p < num_sets; p++)
 		for (int i = 0; i < num_samples; i++)
 		{
-			int target = (int)rand() % num_samples + p * num_samples;
-			float temp = samples[i + p * num_samples + 1].x;
-			samples[i + p * num_samples + 1].x = samples[target].x;
+			int target = (int)(rand_int() % num_samples) + p * num_samples;
+			float temp = samples[i + p * num_samples].x;
+			samples[i + p * num_samples].x = samples[target].x;
 			samples[target].x = temp;
 		}
 }
@@ -177,9 +350,9 @@ NRooks::shuffle_y_coordinates()
 	for (int p = 0; p < num_sets; p++)
 		for (int i = 0; i < num_samples; i++)
 		{
-			int target = (int)rand() % num_samples + p * num_samples;
-			float temp = samples[i + p * num_samples + 1].y;
-			samples[i + p * num_samples + 1].y = samples[target].y;
+			int target = (int)(rand_int() % num_samples) + p * num_samples;
+			float temp = samples[i + p * num_samples].y;
+			samples[i + p * num_samples].y = samples[target].y;
 			samples[target].y = temp;
 		}
 }
@@ -195,8 +368,8 @@ Point2D
 Hammersley::sample_unit_square(void)
 {
 	if (count % num_samples == 0)
-		jump = (rand() % num_sets) * num_samples;
-	return samples[jump + shuffled_indices[count++ % num_samples]];
+		jump = (rand_int() % num_sets) * num_samples;
+	return square_ptr[jump + shuffled_indices[count++ % num_samples]];
 }
 
 void
@@ -209,6 +382,7 @@ Hammersley::generate_samples(void)
 			Point2D sp(x, phi(i));
 			samples.push_back(sp);
 		}
+	square_ptr = samples.data();
 	shuffle_indices();
 }
 
@@ -221,7 +395,7 @@ Hammersley::shuffle_indices(void)
 		indices.push_back(j);
 	for (int p = 0; p < num_samples; p++)
 	{
-		random_shuffle(indices.begin(), indices.end());
+		random_shuffle(indices.begin(), indices.end(), [](int n) { return (int)(rand_int() % n); });
 		for (int j = 0; j < num_samples; j++)
 			shuffled_indices.push_back(indices[j]);
 	}
@@ -10,9 +10,15 @@
 #define _SAMPLER_H
 
 #include "Utilities.h"
+#include "MemoryStats.h"
+#include "SampleTables.h"
 #include <vector>
 
 float rand_float();
+unsigned int rand_int();
+void seed_rand(unsigned long long);
+unsigned long long get_rand_state(void);
+void set_rand_state(unsigned long long);
 
 class Sampler
 {
@@ -21,6 +27,8 @@ public:
 
 	Sampler();
 	Sampler(int num_samples_);
+	Sampler(const Sampler&);
+	Sampler& operator = (const Sampler&);
 	virtual ~Sampler();
 	virtual void generate_samples(void) = 0;
 	void setup_shuffled_indices(void);
@@ -30,16 +38,33 @@ public:
 	Point2D sample_unit_disk(void);
 	Point3D sample_unit_hemisphere(void);
 
+	/* position in the sample stream, saved with render checkpoints */
+	void get_state(unsigned long& count_, int& jump_) const;
+	void set_state(unsigned long count_, int jump_);
+	static const std::vector<Sampler*>& live_samplers(void);
+
 protected:
 	int num_sets;
-	std::vector<Point2D> samples;
-	std::vector<Point2D> samples_disk;
-	std::vector<Point3D> samples_hemisphere;
-	std::vector<int> shuffled_indices;
+	/*
+	 * The patterns in use.  They point into a compiled-in table when one of
+	 * the right size exists, and into the vectors below otherwise.
+	 */
+	const Point2D *square_ptr;
+	const Point2D *disk_ptr;
+	const Point3D *hemisphere_ptr;
+	const SampleTableView *table;
+	tracked_vector<Point2D, MEM_SAMPLERS> samples;
+	tracked_vector<Point2D, MEM_SAMPLERS> samples_disk;
+	tracked_vector<Point3D, MEM_SAMPLERS> samples_hemisphere;
+	tracked_vector<int, MEM_SAMPLERS> shuffled_indices;
 	unsigned long count;
 	int jump;
 
 	void shuffle_samples(void);
+	void rebind(const Sampler&);
+
+private:
+	static std::vector<Sampler*>& registry(void);
 };
 
 class NRooks: public Sampler